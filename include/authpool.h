@@ -0,0 +1,39 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Thread pool for CPU-heavy login work.
+ */
+
+extern int cf_auth_threads;
+
+struct AuthJob;
+
+typedef void (*auth_job_cb)(struct AuthJob *job);
+
+/* embedded in the job specific struct */
+struct AuthJob {
+	struct List head;
+	auth_job_cb work;	/* runs in an auth thread */
+	auth_job_cb done;	/* runs in the event loop after work */
+};
+
+void authpool_setup(void);
+bool auth_threads_enabled(void);
+void auth_job_submit(struct AuthJob *job, auth_job_cb work, auth_job_cb done);
+int auth_jobs_queued(void);
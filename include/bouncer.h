@@ -56,7 +56,7 @@ enum SocketState {
 	CL_WAITING,		/* pool->waiting_client_list */
 	CL_WAITING_LOGIN,	/*   - but return to CL_LOGIN instead of CL_ACTIVE */
 	CL_ACTIVE,		/* pool->active_client_list */
-	CL_CANCEL,		/* pool->cancel_req_list */
+	CL_CANCEL,		/* pool->cancel_req_list, being forwarded */
 
 	SV_FREE,		/* free_server_list */
 	SV_JUSTFREE,		/* justfree_server_list */
@@ -119,6 +119,13 @@ extern int cf_sbuf_len;
 #include "janitor.h"
 #include "hba.h"
 #include "pam.h"
+#include "authpool.h"
+#include "workers.h"
+#include "prepare.h"
+#include "cancel.h"
+#include "probes.h"
+#include "metrics.h"
+#include "querystats.h"
 
 #ifndef WIN32
 #define DEFAULT_UNIX_SOCKET_DIR "/tmp"
@@ -256,17 +263,21 @@ struct PgStats {
  *   for each stats_period:
  *   ->older_stats = ->newer_stats
  *   ->newer_stats = ->stats
+ *   ->latency histograms of the period are moved aside the same way
  */
 struct PgPool {
 	struct List head;			/* entry in global pool_list */
 	struct List map_head;			/* entry in user->pool_list */
+	struct List db_head;			/* entry in db->pool_list */
+	struct List active_head;		/* entry in active_pool_list */
+	struct List hash_head;			/* entry in pool_index */
 
 	PgDatabase *db;			/* corresponding database */
 	PgUser *user;			/* user logged in as */
 
 	struct StatList active_client_list;	/* waiting events logged in clients */
 	struct StatList waiting_client_list;	/* client waits for a server to be available */
-	struct StatList cancel_req_list;	/* closed client connections with server key */
+	struct StatList cancel_req_list;	/* cancel requests being forwarded */
 
 	struct StatList active_server_list;	/* servers linked with clients */
 	struct StatList idle_server_list;	/* servers ready to be linked with clients */
@@ -277,6 +288,10 @@ struct PgPool {
 	PgStats stats;
 	PgStats newer_stats;
 	PgStats older_stats;
+	struct PoolLatency *latency;	/* allocated on first recorded event */
+	uint64_t tls_full;		/* server TLS handshakes without resumption */
+	uint64_t tls_resumed;		/* server TLS handshakes that resumed a session */
+	struct ProtoStats proto_stats;	/* messages by type, never reset */
 
 	/* database info to be sent to client */
 	struct PktBuf *welcome_msg; /* ServerParams without VarCache ones */
@@ -287,6 +302,8 @@ struct PgPool {
 
 	/* if last connect to server failed, there should be delay before next */
 	usec_t last_connect_time;
+	usec_t login_retry_delay;	/* delay after last failure, with backoff */
+	int login_failures;		/* logins failed since last success */
 	bool last_connect_failed:1;
 	bool last_login_failed:1;
 
@@ -329,6 +346,8 @@ struct PgPoolEvent {
  */
 struct PgUser {
 	struct List pool_list;		/* list of pools where pool->user == this user */
+	struct StatList evict_list;	/* idle, used and tested servers, oldest first */
+	struct StatList active_list;	/* active servers, oldest first */
 	struct AANode tree_node;	/* used to attach user to tree */
 	char name[MAX_USERNAME];
 	char passwd[MAX_PASSWORD];	/* password stored in auth_file, empty if user not in auth_file */
@@ -340,6 +359,7 @@ struct PgUser {
 	int pool_mode;
 	int max_user_connections;	/* how much server connections are allowed */
 	int connection_count;	/* how much connections are used by user now */
+	struct SharedCounter *shared_counter;	/* connection count over all workers */
 };
 
 /*
@@ -355,6 +375,9 @@ struct PgUserEvent {
  */
 struct PgDatabase {
 	struct List head;
+	struct List hash_head;	/* entry in database_index */
+	struct List pool_list;	/* list of pools where pool->db == this db */
+	struct StatList evict_list;	/* idle, used and tested servers, oldest first */
 	char name[MAX_DBNAME];	/* db name for clients */
 	struct AATree user_passwds;	/* user passwords for this database from auth_query */
 
@@ -368,7 +391,10 @@ struct PgDatabase {
 	int res_pool_size;	/* additional server connections in case of trouble */
 	int pool_mode;		/* pool mode for this database */
 	int max_db_connections;	/* max server connections between all pools */
+	int max_concurrent_logins;	/* server logins in progress per pool */
+	int connect_rate;	/* new server connections per second */
 	char *connect_query;	/* startup commands to send to server after connect */
+	struct QueryStats *query_stats;	/* query shapes, NULL until first query */
 
 	struct PktBuf *startup_params; /* partial StartupMessage (without user) be sent to server */
 	const char *dbname;	/* server-side name, pointer to inside startup_msg */
@@ -388,6 +414,8 @@ struct PgDatabase {
 	usec_t inactive_time;	/* when auto-database became inactive (to kill it after timeout) */
 	unsigned active_stamp;	/* set if autodb has connections */
 	int connection_count;	/* total connections for this database in all pools */
+	usec_t connect_tat;	/* connect_rate limiter, when the bucket is full again */
+	struct SharedCounter *shared_counter;	/* connection count over all workers */
 };
 
 struct PgUserPassword {
@@ -403,6 +431,11 @@ struct PgUserPassword {
  */
 struct PgSocket {
 	struct List head;		/* list header */
+	struct List db_evict_head;	/* server: entry in db->evict_list */
+	struct List user_evict_head;	/* server: entry in user->evict_list or user->active_list */
+	struct TimerWheelNode timeout;	/* next timeout check, see janitor.c */
+	struct List cancel_head;	/* client: entry in cancel_index */
+	struct CancelConn *cancel_conn;	/* cancel request: forwarding connection */
 	PgSocket *link;		/* the dest of packets */
 	PgPool *pool;		/* parent pool, if NULL not yet assigned */
 
@@ -424,6 +457,7 @@ struct PgSocket {
 	bool wait_for_user_conn:1;/* client: waiting for auth_conn server connection */
 	bool wait_for_user:1;	/* client: waiting for auth_conn query results */
 	bool wait_for_auth:1;	/* client: waiting for external auth (PAM) to be completed */
+	bool auth_job_done:1;	/* client: auth thread finished work for the current packet */
 
 	bool suspended:1;	/* client/server: if the socket is suspended */
 
@@ -435,11 +469,21 @@ struct PgSocket {
 
 	int expect_rfq_count;	/* client: count of ReadyForQuery packets client should see */
 
+	struct CBTree *prepared_statements;	/* client: named statements, see prepare.c */
+	struct PktBuf *prepare_buf;		/* client: large packet being collected for rewrite */
+	struct ServerPrepared *server_prepared;	/* server: statements prepared on connection */
+
 	usec_t connect_time;	/* when connection was made */
 	usec_t request_time;	/* last activity time */
 	usec_t query_start;	/* query start moment */
 	usec_t xact_start;	/* xact start moment */
 	usec_t wait_start;	/* waiting start moment */
+	usec_t link_time;	/* client: when the current server was linked */
+
+	PgStats stats;		/* client: own share of pool->stats */
+	usec_t server_time;	/* client: total time linked to a server */
+	uint64_t query_fp;	/* client: query shape being timed, see querystats.c */
+	uint64_t query_fp_bytes;	/* client: stats.server_bytes when it started */
 
 	uint8_t cancel_key[BACKENDKEY_LEN]; /* client: generated, server: remote */
 	PgAddr remote_addr;	/* ip:port for remote endpoint */
@@ -456,7 +500,6 @@ struct PgSocket {
 		char *client_final_message_without_proof;
 		char *server_nonce;
 		char *server_first_message;
-		uint8_t	*SaltedPassword;
 		char cbind_flag;
 		bool adhoc;	/* SCRAM data made up from plain-text password */
 		int iterations;
@@ -517,6 +560,10 @@ extern usec_t cf_server_check_delay;
 extern int cf_server_fast_close;
 extern usec_t cf_server_connect_timeout;
 extern usec_t cf_server_login_retry;
+extern usec_t cf_server_login_retry_max;
+extern int cf_max_concurrent_logins;
+extern int cf_server_connect_rate;
+extern int cf_server_connect_burst;
 extern usec_t cf_query_timeout;
 extern usec_t cf_query_wait_timeout;
 extern usec_t cf_client_idle_timeout;
@@ -532,6 +579,7 @@ extern char *cf_resolv_conf;
 extern int cf_auth_type;
 extern char *cf_auth_file;
 extern char *cf_auth_query;
+extern int cf_scram_key_cache_size;
 extern char *cf_auth_user;
 extern char *cf_auth_hba_file;
 
@@ -551,6 +599,7 @@ extern int cf_reboot;
 extern unsigned int cf_max_packet_size;
 
 extern int cf_sbuf_loopcnt;
+extern int cf_splice_threshold;
 extern int cf_so_reuseport;
 extern int cf_tcp_keepalive;
 extern int cf_tcp_keepcnt;
@@ -573,6 +622,10 @@ extern char *cf_client_tls_key_file;
 extern char *cf_client_tls_ciphers;
 extern char *cf_client_tls_dheparams;
 extern char *cf_client_tls_ecdhecurve;
+extern int cf_client_tls_ktls;
+extern int cf_client_tls_session_tickets;
+extern int cf_client_tls_session_cache_size;
+extern usec_t cf_client_tls_session_lifetime;
 
 extern int cf_server_tls_sslmode;
 extern char *cf_server_tls_protocols;
@@ -580,6 +633,8 @@ extern char *cf_server_tls_ca_file;
 extern char *cf_server_tls_cert_file;
 extern char *cf_server_tls_key_file;
 extern char *cf_server_tls_ciphers;
+extern int cf_server_tls_ktls;
+extern int cf_server_tls_session_cache;
 
 extern const struct CfLookup pool_mode_map[];
 
@@ -21,3 +21,9 @@ struct HBA;
 struct HBA *hba_load_rules(const char *fn);
 void hba_free(struct HBA *hba);
 int hba_eval(struct HBA *hba, PgAddr *addr, bool is_tls, const char *dbname, const char *username);
+
+typedef void (*hba_walk_rule_f)(void *arg, int linenr, const char *type, const char *addr,
+				int method, uint64_t hits);
+
+void hba_walk_rules(struct HBA *hba, hba_walk_rule_f cb, void *arg);
+void hba_cache_info(struct HBA *hba, int *size, int *used, uint64_t *hits, uint64_t *misses);
@@ -21,5 +21,6 @@ void config_postprocess(void);
 void resume_all(void);
 void per_loop_maint(void);
 bool suspend_socket(PgSocket *sk, bool force)  _MUSTCHECK;
+void socket_timeout_arm(PgSocket *sk);
 void kill_pool(PgPool *pool);
 void kill_database(PgDatabase *db);
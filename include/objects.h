@@ -19,8 +19,12 @@
 
 extern struct AATree user_tree;
 extern struct StatList pool_list;
+extern struct StatList active_pool_list;
 extern struct StatList database_list;
 extern struct StatList autodatabase_idle_list;
+extern struct HashIndex database_index;
+extern struct HashIndex pool_index;
+extern struct HashIndex cancel_index;
 extern struct StatList login_client_list;
 extern struct Slab *client_cache;
 extern struct Slab *server_cache;
@@ -32,7 +36,6 @@ extern struct Slab *iobuf_cache;
 PgDatabase *find_database(const char *name);
 PgUser *find_user(const char *name);
 PgPool *get_pool(PgDatabase *, PgUser *);
-PgSocket *compare_connections_by_time(PgSocket *lhs, PgSocket *rhs);
 bool evict_connection(PgDatabase *db)		_MUSTCHECK;
 bool evict_idle_user_connection(PgUser *user)	_MUSTCHECK;
 bool find_server(PgSocket *client)		_MUSTCHECK;
@@ -62,7 +65,7 @@ struct UserWalkInfo {
 };
 
 void accept_cancel_request(PgSocket *req);
-void forward_cancel_request(PgSocket *server);
+void register_cancel_key(PgSocket *client);
 
 void launch_new_connection(PgPool *pool);
 
@@ -94,6 +97,8 @@ void handle_pool_cf_update(evutil_socket_t sock, short flags, void *arg);
 void notify_pool_event(PgPool *pool, event_callback_fn cb);
 
 void tag_pool_dirty(PgPool *pool);
+void mark_pool_active(PgPool *pool);
+void mark_database_active(PgDatabase *db);
 void tag_database_dirty(PgDatabase *db);
 void tag_autodb_dirty(void);
 void tag_host_addr_dirty(const char *host, const struct sockaddr *sa);
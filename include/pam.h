@@ -23,13 +23,14 @@
 /* Name of the service to be passed to PAM */
 #define PGBOUNCER_PAM_SERVICE "pgbouncer"
 
-/*
- * Defines how many authentication requests can be placed to the waiting queue.
- * When the queue is full calls to pam_auth_begin() will block until there is
- * free space in the queue.
- */
-#define PAM_REQUEST_QUEUE_SIZE 20
+/* Number of entries in the cache of successful logins */
+#define PAM_CACHE_SIZE 1024
+
+extern int cf_pam_workers;
+extern usec_t cf_pam_cache_ttl;
 
 void pam_init(void);
 void pam_auth_begin(PgSocket *client, const char *passwd);
 int pam_poll(void);
+int pam_queue_count(void);
+void pam_cache_info(int *size, int *used, uint64_t *hits, uint64_t *misses);
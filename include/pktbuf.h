@@ -146,9 +146,6 @@ void pktbuf_write_ExtQuery(PktBuf *buf, const char *query, int nargs, ...);
 #define SEND_ReadyForQuery(res, sk) \
 	SEND_wrap(8, pktbuf_write_ReadyForQuery, res, sk)
 
-#define SEND_CancelRequest(res, sk, key) \
-	SEND_wrap(16, pktbuf_write_CancelRequest, res, sk, key)
-
 #define SEND_PasswordMessage(res, sk, psw) \
 	SEND_wrap(MAX_PASSWORD + 8, pktbuf_write_PasswordMessage, res, sk, psw)
 
@@ -0,0 +1,35 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+extern int cf_max_prepared_statements;
+
+struct ServerPrepared;
+
+/* should client's Parse/Bind/Describe/Close packets be rewritten */
+#define prepare_tracking(client) \
+	((client)->link->server_prepared || \
+	 (cf_max_prepared_statements > 0 && pool_pool_mode((client)->pool) != POOL_SESSION))
+
+bool prepare_client_packet(PgSocket *client, PktHdr *pkt) _MUSTCHECK;
+bool prepare_client_fetch(PgSocket *client, struct MBuf *data) _MUSTCHECK;
+bool prepare_server_sync(PgSocket *server) _MUSTCHECK;
+bool prepare_server_packet(PgSocket *server, PktHdr *pkt) _MUSTCHECK;
+void prepare_server_release(PgSocket *server);
+
+void free_client_prepared(PgSocket *client);
+void free_server_prepared(PgSocket *server);
@@ -42,7 +42,13 @@ typedef enum {
  */
 #define SBUF_SMALL_PKT	64
 
+/* SBuf.ktls: directions handled by kernel TLS */
+#define SBUF_KTLS_SEND	1
+#define SBUF_KTLS_RECV	2
+
 struct tls;
+struct PktBuf;
+struct SplicePipe;
 
 /* fwd def */
 typedef struct SBuf SBuf;
@@ -73,6 +79,7 @@ struct SBuf {
 	uint8_t wait_type;	/* track wait state */
 	uint8_t pkt_action;	/* method for handling current pkt */
 	uint8_t tls_state;	/* progress of tls */
+	uint8_t ktls;		/* SBUF_KTLS_* */
 
 	int sock;		/* fd for this socket */
 
@@ -84,9 +91,17 @@ struct SBuf {
 
 	IOBuf *io;		/* data buffer, lazily allocated */
 
+	struct PktBuf *extra;	/* generated data to send before io */
+
+	struct SplicePipe *pipe;	/* packet data spliced but not yet sent */
+	bool no_splice;		/* splice() not supported on sock */
+
+	uint8_t uring_op;	/* recv() or send() queued for io_uring */
+
 	const SBufIO *ops;	/* normal vs. TLS */
 	struct tls *tls;	/* TLS context */
 	const char *tls_host;	/* target hostname */
+	struct TLSHandshakeJob *tls_job;	/* handshake step running in an auth thread */
 };
 
 #define sbuf_socket(sbuf) ((sbuf)->sock)
@@ -112,7 +127,8 @@ extern int server_connect_sslmode;
 
 bool sbuf_tls_setup(void);
 bool sbuf_tls_accept(SBuf *sbuf)  _MUSTCHECK;
-bool sbuf_tls_connect(SBuf *sbuf, const char *hostname)  _MUSTCHECK;
+bool sbuf_tls_connect(SBuf *sbuf, const char *hostname, const char *session_key)  _MUSTCHECK;
+bool sbuf_tls_session_reused(SBuf *sbuf);
 
 bool sbuf_pause(SBuf *sbuf) _MUSTCHECK;
 void sbuf_continue(SBuf *sbuf);
@@ -124,6 +140,8 @@ void sbuf_prepare_skip(SBuf *sbuf, unsigned amount);
 void sbuf_prepare_fetch(SBuf *sbuf, unsigned amount);
 
 bool sbuf_answer(SBuf *sbuf, const void *buf, size_t len)  _MUSTCHECK;
+bool sbuf_queue_packet(SBuf *sbuf, SBuf *dst, struct PktBuf *pkt)  _MUSTCHECK;
+bool sbuf_flush(SBuf *sbuf)  _MUSTCHECK;
 
 bool sbuf_continue_with_callback(SBuf *sbuf, event_callback_fn cb)  _MUSTCHECK;
 bool sbuf_use_callback_once(SBuf *sbuf, short ev, event_callback_fn user_cb) _MUSTCHECK;
@@ -134,7 +152,7 @@ bool sbuf_use_callback_once(SBuf *sbuf, short ev, event_callback_fn user_cb) _MU
  */
 static inline bool sbuf_is_empty(SBuf *sbuf)
 {
-	return iobuf_empty(sbuf->io) && sbuf->pkt_remain == 0;
+	return iobuf_empty(sbuf->io) && sbuf->pkt_remain == 0 && !sbuf->extra && !sbuf->pipe;
 }
 
 static inline bool sbuf_is_closed(SBuf *sbuf)
@@ -161,4 +179,8 @@ static inline int sbuf_op_close(SBuf *sbuf)
 	return sbuf->ops->sbufio_close(sbuf);
 }
 
+bool sbuf_uring_setup(void);
+bool sbuf_uring_pending(void);
+void sbuf_uring_flush(void);
+
 void sbuf_cleanup(void);
@@ -25,6 +25,14 @@
 
 void free_scram_state(ScramState *scram_state);
 
+void scram_key_cache_info(int *size, int *used, uint64_t *hits, uint64_t *misses);
+
+struct ScramKeyJob;
+
+struct ScramKeyJob *scram_key_job_new(const char *username, const char *password, const char *secret);
+bool scram_key_job_run(struct ScramKeyJob *job);
+void scram_key_job_free(struct ScramKeyJob *job);
+
 typedef enum PasswordType
 {
     PASSWORD_TYPE_PLAINTEXT = 0,
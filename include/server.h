@@ -38,6 +38,8 @@ int pool_pool_size(PgPool *pool) _MUSTCHECK;
 int pool_min_pool_size(PgPool *pool) _MUSTCHECK;
 int pool_res_pool_size(PgPool *pool) _MUSTCHECK;
 int database_max_connections(PgDatabase *db) _MUSTCHECK;
+int database_max_concurrent_logins(PgDatabase *db) _MUSTCHECK;
+int database_connect_rate(PgDatabase *db) _MUSTCHECK;
 void database_add_user_password(PgDatabase *db, const char *username, const char *passwd);
 int user_max_connections(PgUser *user) _MUSTCHECK;
 bool user_requires_auth_query(PgUser *user) _MUSTCHECK;
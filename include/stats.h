@@ -16,9 +16,80 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* latencies kept in a histogram per pool */
+enum LatencyKind {
+	LATENCY_QUERY,
+	LATENCY_XACT,
+	LATENCY_WAIT,
+	LATENCY_CONNECT,
+	LATENCY_TLS,
+	LATENCY_KIND_COUNT
+};
+
+struct PoolLatency;
+
+/* event loop statistics, see main_loop_once() */
+enum LoopStat {
+	LOOP_ITERATION,		/* busy part of an iteration */
+	LOOP_WAIT,		/* blocked waiting for events */
+	LOOP_EVENTS,		/* event callbacks, includes LOOP_JANITOR */
+	LOOP_JANITOR,
+	LOOP_PAM,
+	LOOP_MAINT,
+	LOOP_REUSE,
+	LOOP_TIMERS,
+	LOOP_POOLER,
+	LOOP_DNS,
+	LOOP_SOCKETS,		/* sockets serviced per iteration */
+	LOOP_YIELDS,		/* sbuf_loopcnt hits per iteration */
+	LOOP_STAT_COUNT
+};
+
+/*
+ * Protocol messages per type, kept in PgPool.  Slot 0 counts
+ * unknown types, the slot maps are filled in stats_setup().
+ */
+#define PROTO_CLIENT_TYPES	14
+#define PROTO_SERVER_TYPES	25
+
+struct ProtoCounter {
+	uint64_t count;
+	uint64_t bytes;
+};
+
+struct ProtoStats {
+	struct ProtoCounter client[PROTO_CLIENT_TYPES];
+	struct ProtoCounter server[PROTO_SERVER_TYPES];
+};
+
+extern uint8_t proto_client_slot[256];
+extern uint8_t proto_server_slot[256];
+
+#define proto_stats_add(pool, dir, pkt) do { \
+		struct ProtoCounter *_c = &(pool)->proto_stats.dir[proto_ ## dir ## _slot[(uint8_t)(pkt)->type]]; \
+		_c->count++; \
+		_c->bytes += (pkt)->len; \
+	} while (0)
+
 void stats_setup(void);
 
+void stats_record_latency(PgPool *pool, enum LatencyKind kind, usec_t value);
+void stats_free_latency(PgPool *pool);
+void stats_client_tls(bool resumed);
+
+void loop_stats_begin(void);
+void loop_stats_dispatched(void);
+void loop_stats_phase(enum LoopStat phase);
+void loop_stats_end(void);
+void loop_stats_wake(void);
+void loop_stats_socket(void);
+void loop_stats_yield(void);
+void loop_stats_record(enum LoopStat stat, usec_t value);
+
 bool admin_database_stats(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool admin_database_stats_totals(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool admin_database_stats_averages(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool show_stat_totals(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
+bool admin_latency_stats(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
+bool admin_protocol_stats(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
+bool admin_loop_stats(PgSocket *client)  _MUSTCHECK;
@@ -56,6 +56,51 @@ void fill_local_addr(PgSocket *sk, int fd, bool is_unix);
 void rescue_timers(void);
 void safe_evtimer_add(struct event *ev, struct timeval *tv);
 
+/*
+ * Hash index over objects that are also kept in other lists.
+ * Objects embed a struct List that is linked into a bucket.
+ */
+struct HashIndex {
+	struct List *buckets;
+	unsigned int size;	/* power of 2 */
+	unsigned int count;
+	uint32_t (*node_hash)(struct List *node);
+};
+
+void hashindex_init(struct HashIndex *idx, uint32_t (*node_hash)(struct List *node));
+void hashindex_destroy(struct HashIndex *idx);
+bool hashindex_insert(struct HashIndex *idx, struct List *node) _MUSTCHECK;
+void hashindex_remove(struct HashIndex *idx, struct List *node);
+struct List *hashindex_bucket(struct HashIndex *idx, uint32_t hash);
+
+/*
+ * Timer wheel for deadlines that are checked periodically.
+ * Nodes are sorted into slots by deadline, one slot per tick;
+ * deadlines further away than one revolution wait for later rounds.
+ */
+#define TIMERWHEEL_SLOTS	1024	/* power of 2 */
+
+struct TimerWheelNode {
+	struct List head;
+	usec_t deadline;
+};
+
+struct TimerWheel {
+	struct List slots[TIMERWHEEL_SLOTS];
+	usec_t tick;		/* slot width */
+	uint64_t last_tick;	/* last processed tick */
+	unsigned int count;
+};
+
+typedef void (*timerwheel_expire_f)(struct TimerWheelNode *node);
+
+void timerwheel_init(struct TimerWheel *w, usec_t tick);
+void timerwheel_node_init(struct TimerWheelNode *node);
+void timerwheel_add(struct TimerWheel *w, struct TimerWheelNode *node, usec_t deadline);
+void timerwheel_remove(struct TimerWheel *w, struct TimerWheelNode *node);
+void timerwheel_expire(struct TimerWheel *w, usec_t now, timerwheel_expire_f cb);
+#define timerwheel_node_armed(node) (!list_empty(&(node)->head))
+
 /* log truncated strings */
 #define safe_strcpy(dst, src, dstlen) do { \
 	size_t needed = strlcpy(dst, src, dstlen); \
@@ -0,0 +1,33 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+extern int cf_workers;
+extern int worker_id;
+
+#define workers_enabled() (cf_workers > 1)
+
+void workers_setup(void);
+void workers_signal(int sig);
+void workers_reap(void);
+
+int database_total_connections(PgDatabase *db);
+int user_total_connections(PgUser *user);
+int user_connection_excess(PgUser *user, int max) _MUSTCHECK;
+bool database_connect_token(PgDatabase *db, bool take) _MUSTCHECK;
+bool workers_connection_reserve(PgPool *pool) _MUSTCHECK;
+void workers_connection_release(PgPool *pool);
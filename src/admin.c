@@ -22,6 +22,7 @@
  */
 
 #include "bouncer.h"
+#include "scram.h"
 
 #include <usual/regex.h>
 #include <usual/netdb.h>
@@ -149,10 +150,8 @@ static int count_db_active(PgDatabase *db)
 	PgPool *pool;
 	int cnt = 0;
 
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db != db)
-			continue;
+	list_for_each(item, &db->pool_list) {
+		pool = container_of(item, PgPool, db_head);
 		cnt += pool_server_count(pool);
 	}
 	return cnt;
@@ -243,16 +242,37 @@ static bool fake_set(PgSocket *admin, const char *key, const char *val)
 	return got;
 }
 
+/*
+ * With workers each process has its own copy of the configuration and
+ * pause state.  Commands changing them are only accepted on the first
+ * worker, which passes them on to the others as signals.  Commands
+ * without a signal equivalent are refused.
+ */
+static const char *workers_refuse(bool forwarded)
+{
+	if (!workers_enabled())
+		return NULL;
+	if (!forwarded)
+		return "not supported with workers";
+	if (worker_id != 0)
+		return "only supported on the first worker (the Unix socket) with workers";
+	return NULL;
+}
+
 /* Command: SET [USER|POOL] key = val; */
 static bool admin_set(PgSocket *admin, const char *sect, const char *key, const char *val)
 {
 	char tmp[512];
+	const char *err;
 	bool ok;
 
 	if (fake_set(admin, key, val))
 		return true;
 
 	if (admin->admin_user) {
+		err = workers_refuse(false);
+		if (err)
+			return admin_error(admin, "SET %s", err);
 		ok = set_config_param(sect, key, val);
 		if (ok) {
 			PktBuf *buf = pktbuf_dynamic(256);
@@ -567,6 +587,8 @@ static bool admin_show_lists(PgSocket *admin, const char *arg)
 	SENDLIST("login_clients", statlist_count(&login_client_list));
 	SENDLIST("free_servers", slab_free_count(server_cache));
 	SENDLIST("used_servers", slab_active_count(server_cache));
+	SENDLIST("auth_queue", auth_jobs_queued());
+	SENDLIST("pam_queue", pam_queue_count());
 	{
 		int names, zones, qry, pend;
 		adns_info(adns, &names, &zones, &qry, &pend);
@@ -579,6 +601,76 @@ static bool admin_show_lists(PgSocket *admin, const char *arg)
 	return true;
 }
 
+/* Command: SHOW AUTH_CACHES */
+static bool admin_show_auth_caches(PgSocket *admin, const char *arg)
+{
+	PktBuf *buf;
+	int size, used;
+	uint64_t hits, misses;
+
+	buf = pktbuf_dynamic(256);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+	pktbuf_write_RowDescription(buf, "siiqq", "cache", "size", "used", "hits", "misses");
+	scram_key_cache_info(&size, &used, &hits, &misses);
+	pktbuf_write_DataRow(buf, "siiqq", "scram_keys", size, used, hits, misses);
+	pam_cache_info(&size, &used, &hits, &misses);
+	pktbuf_write_DataRow(buf, "siiqq", "pam", size, used, hits, misses);
+	hba_cache_info(parsed_hba, &size, &used, &hits, &misses);
+	pktbuf_write_DataRow(buf, "siiqq", "hba", size, used, hits, misses);
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
+
+/* Command: SHOW HBA */
+
+static const char *auth_method_name(int method)
+{
+	switch (method) {
+	case AUTH_TRUST:
+		return "trust";
+	case AUTH_PLAIN:
+		return "password";
+	case AUTH_MD5:
+		return "md5";
+	case AUTH_CERT:
+		return "cert";
+	case AUTH_PEER:
+		return "peer";
+	case AUTH_REJECT:
+		return "reject";
+	case AUTH_SCRAM_SHA_256:
+		return "scram-sha-256";
+	default:
+		return "unknown";
+	}
+}
+
+static void hba_rule_cb(void *arg, int linenr, const char *type, const char *addr,
+			int method, uint64_t hits)
+{
+	PktBuf *buf = arg;
+
+	pktbuf_write_DataRow(buf, "isssq", linenr, type, addr, auth_method_name(method), hits);
+}
+
+static bool admin_show_hba(PgSocket *admin, const char *arg)
+{
+	PktBuf *buf;
+
+	buf = pktbuf_dynamic(256);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+	pktbuf_write_RowDescription(buf, "isssq", "line", "type", "address", "method", "hits");
+	hba_walk_rules(parsed_hba, hba_rule_cb, buf);
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
+
 static void show_user_cb(void *arg, PgUser *user) {
 	PktBuf *buf = (PktBuf *) arg;
 	struct CfValue cv;
@@ -608,8 +700,8 @@ static bool admin_show_users(PgSocket *admin, const char *arg)
 	return true;
 }
 
-#define SKF_STD "sssssisiTTiiississ"
-#define SKF_DBG "sssssisiTTiiississiiiiiii"
+#define SKF_STD "sssssisiTTiiississqqqqqqs"
+#define SKF_DBG "sssssisiTTiiississqqqqqqsiiiiiii"
 
 static void socket_header(PktBuf *buf, bool debug)
 {
@@ -620,6 +712,10 @@ static void socket_header(PktBuf *buf, bool debug)
 				    "wait", "wait_us", "close_needed",
 				    "ptr", "link", "remote_pid", "tls",
 				    "application_name",
+				    "total_received", "total_sent",
+				    "total_query_count", "total_xact_count",
+				    "total_wait_time", "total_server_time",
+				    "tls_offload",
 				    /* debug follows */
 				    "recv_pos", "pkt_pos", "pkt_remain",
 				    "send_pos", "send_remain",
@@ -631,6 +727,28 @@ static void adr2txt(const PgAddr *adr, char *dst, unsigned dstlen)
 	pga_ntop(adr, dst, dstlen);
 }
 
+/* time linked to a server, including the current link */
+static usec_t client_server_time(PgSocket *sk, usec_t now)
+{
+	if (is_server_socket(sk) || !sk->link)
+		return sk->server_time;
+	return sk->server_time + now - sk->link_time;
+}
+
+static const char *tls_offload_str(PgSocket *sk)
+{
+	switch (sk->sbuf.ktls) {
+	case SBUF_KTLS_SEND | SBUF_KTLS_RECV:
+		return "ktls";
+	case SBUF_KTLS_SEND:
+		return "ktls-send";
+	case SBUF_KTLS_RECV:
+		return "ktls-recv";
+	default:
+		return "";
+	}
+}
+
 static void socket_row(PktBuf *buf, PgSocket *sk, const char *state, bool debug)
 {
 	int pkt_avail = 0, send_avail = 0;
@@ -683,6 +801,10 @@ static void socket_row(PktBuf *buf, PgSocket *sk, const char *state, bool debug)
 			     sk->close_needed,
 			     ptrbuf, linkbuf, remote_pid, infobuf,
 			     application_name ? application_name->str : "",
+			     sk->stats.client_bytes, sk->stats.server_bytes,
+			     sk->stats.query_count, sk->stats.xact_count,
+			     sk->stats.wait_time, client_server_time(sk, now),
+			     tls_offload_str(sk),
 			     /* debug */
 			     io ? io->recv_pos : 0,
 			     io ? io->parse_pos : 0,
@@ -728,6 +850,117 @@ static bool admin_show_clients(PgSocket *admin, const char *arg)
 	return true;
 }
 
+/* Command: SHOW TOP_CLIENTS[_BYTES|_QUERIES|_WAIT] */
+
+#define TOP_CLIENTS 20
+
+typedef uint64_t (*client_counter_f)(PgSocket *client, usec_t now);
+
+struct TopClient {
+	PgSocket *client;
+	const char *state;
+	uint64_t value;
+};
+
+static uint64_t top_by_server_time(PgSocket *client, usec_t now)
+{
+	return client_server_time(client, now);
+}
+
+static uint64_t top_by_bytes(PgSocket *client, usec_t now)
+{
+	return client->stats.client_bytes + client->stats.server_bytes;
+}
+
+static uint64_t top_by_queries(PgSocket *client, usec_t now)
+{
+	return client->stats.query_count;
+}
+
+static uint64_t top_by_wait(PgSocket *client, usec_t now)
+{
+	if (client->state == CL_WAITING && client->wait_start)
+		return client->stats.wait_time + now - client->wait_start;
+	return client->stats.wait_time;
+}
+
+/* keep top[] sorted, highest value first */
+static void top_client_add(struct TopClient *top, int *count, PgSocket *client,
+			   const char *state, uint64_t value)
+{
+	int i;
+
+	if (*count == TOP_CLIENTS && value <= top[TOP_CLIENTS - 1].value)
+		return;
+	if (*count < TOP_CLIENTS)
+		(*count)++;
+	for (i = *count - 1; i > 0 && top[i - 1].value < value; i--)
+		top[i] = top[i - 1];
+	top[i].client = client;
+	top[i].state = state;
+	top[i].value = value;
+}
+
+static void top_client_list(struct TopClient *top, int *count, struct StatList *list,
+			    const char *state, client_counter_f counter, usec_t now)
+{
+	struct List *item;
+	PgSocket *client;
+
+	statlist_for_each(item, list) {
+		client = container_of(item, PgSocket, head);
+		top_client_add(top, count, client, state, counter(client, now));
+	}
+}
+
+static bool show_top_clients(PgSocket *admin, client_counter_f counter)
+{
+	struct TopClient top[TOP_CLIENTS];
+	struct List *item;
+	PgPool *pool;
+	PktBuf *buf;
+	usec_t now = get_cached_time();
+	int count = 0;
+	int i;
+
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		top_client_list(top, &count, &pool->active_client_list, "active", counter, now);
+		top_client_list(top, &count, &pool->waiting_client_list, "waiting", counter, now);
+	}
+
+	buf = pktbuf_dynamic(256);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+	socket_header(buf, false);
+	for (i = 0; i < count; i++)
+		socket_row(buf, top[i].client, top[i].state, false);
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
+
+static bool admin_show_top_clients(PgSocket *admin, const char *arg)
+{
+	return show_top_clients(admin, top_by_server_time);
+}
+
+static bool admin_show_top_clients_bytes(PgSocket *admin, const char *arg)
+{
+	return show_top_clients(admin, top_by_bytes);
+}
+
+static bool admin_show_top_clients_queries(PgSocket *admin, const char *arg)
+{
+	return show_top_clients(admin, top_by_queries);
+}
+
+static bool admin_show_top_clients_wait(PgSocket *admin, const char *arg)
+{
+	return show_top_clients(admin, top_by_wait);
+}
+
 /* Command: SHOW SERVERS */
 static bool admin_show_servers(PgSocket *admin, const char *arg)
 {
@@ -843,20 +1076,21 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 		admin_error(admin, "no mem");
 		return true;
 	}
-	pktbuf_write_RowDescription(buf, "ssiiiiiiiiiisi",
+	pktbuf_write_RowDescription(buf, "ssiiiiiiiiiisiqq",
 				    "database", "user",
 				    "cl_active", "cl_waiting",
 				    "cl_cancel_req",
 				    "sv_active", "sv_idle",
 				    "sv_used", "sv_tested",
 				    "sv_login", "maxwait",
-				    "maxwait_us", "pool_mode", "pool_size");
+				    "maxwait_us", "pool_mode", "pool_size",
+				    "sv_tls_full", "sv_tls_resumed");
 	statlist_for_each(item, &pool_list) {
 		pool = container_of(item, PgPool, head);
 		waiter = first_socket(&pool->waiting_client_list);
 		max_wait = (waiter && waiter->query_start) ? now - waiter->query_start : 0;
 		pool_mode = pool_pool_mode(pool);
-		pktbuf_write_DataRow(buf, "ssiiiiiiiiiisi",
+		pktbuf_write_DataRow(buf, "ssiiiiiiiiiisiqq",
 				     pool->db->name, pool->user->name,
 				     statlist_count(&pool->active_client_list),
 				     statlist_count(&pool->waiting_client_list),
@@ -869,7 +1103,8 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 				     /* how long is the oldest client waited */
 				     (int)(max_wait / USEC),
 				     (int)(max_wait % USEC),
-				     cf_get_lookup(&cv), pool_pool_size(pool));
+				     cf_get_lookup(&cv), pool_pool_size(pool),
+				     pool->tls_full, pool->tls_resumed);
 	}
 	admin_flush(admin, buf, "SHOW");
 	return true;
@@ -885,6 +1120,15 @@ static void slab_stat_cb(void *arg, const char *slab_name,
 			     size, total - free, free, alloc);
 }
 
+/* hash index as slab-like row: bucket size, entries, unused buckets */
+static void hashindex_stat_row(PktBuf *buf, const char *name, const struct HashIndex *idx)
+{
+	unsigned size = sizeof(struct List);
+	unsigned free = idx->size > idx->count ? idx->size - idx->count : 0;
+	pktbuf_write_DataRow(buf, "siiii", name,
+			     size, idx->count, free, idx->size * size);
+}
+
 /* Command: SHOW MEM */
 static bool admin_show_mem(PgSocket *admin, const char *arg)
 {
@@ -898,6 +1142,9 @@ static bool admin_show_mem(PgSocket *admin, const char *arg)
 	pktbuf_write_RowDescription(buf, "siiii", "name",
 				    "size", "used", "free", "memtotal");
 	slab_stats(slab_stat_cb, buf);
+	hashindex_stat_row(buf, "database_index", &database_index);
+	hashindex_stat_row(buf, "pool_index", &pool_index);
+	hashindex_stat_row(buf, "cancel_index", &cancel_index);
 	admin_flush(admin, buf, "SHOW");
 	return true;
 }
@@ -998,13 +1245,20 @@ static bool admin_show_config(PgSocket *admin, const char *arg)
 /* Command: RELOAD */
 static bool admin_cmd_reload(PgSocket *admin, const char *arg)
 {
+	const char *err;
+
 	if (arg && *arg)
 		return syntax_error(admin);
 
 	if (!admin->admin_user)
 		return admin_error(admin, "admin access needed");
 
+	err = workers_refuse(true);
+	if (err)
+		return admin_error(admin, "RELOAD %s", err);
+
 	log_info("RELOAD command issued");
+	workers_signal(SIGHUP);
 	load_config();
 	if (!sbuf_tls_setup())
 		log_error("TLS configuration could not be reloaded, keeping old configuration");
@@ -1014,18 +1268,25 @@ static bool admin_cmd_reload(PgSocket *admin, const char *arg)
 /* Command: SHUTDOWN */
 static bool admin_cmd_shutdown(PgSocket *admin, const char *arg)
 {
+	const char *err;
+
 	if (arg && *arg)
 		return syntax_error(admin);
 
 	if (!admin->admin_user)
 		return admin_error(admin, "admin access needed");
 
+	err = workers_refuse(true);
+	if (err)
+		return admin_error(admin, "SHUTDOWN %s", err);
+
 	/*
 	 * note: new pooler expects unix socket file gone when it gets
 	 * event from fd.  Currently atexit() cleanup should be called
 	 * before closing open sockets.
 	 */
 	log_info("SHUTDOWN command issued");
+	workers_signal(SIGTERM);
 	cf_shutdown = 2;
 	event_base_loopbreak(pgb_event_base);
 
@@ -1049,15 +1310,24 @@ static void full_resume(void)
 /* Command: RESUME */
 static bool admin_cmd_resume(PgSocket *admin, const char *arg)
 {
+	const char *err;
+
 	if (!admin->admin_user)
 		return admin_error(admin, "admin access needed");
 
+	/* only RESUME of everything has a signal */
+	err = workers_refuse(!arg[0]);
+	if (err)
+		return admin_error(admin, "RESUME %s", err);
+
 	if (!arg[0]) {
 		log_info("RESUME command issued");
-		if (cf_pause_mode != P_NONE)
+		if (cf_pause_mode != P_NONE) {
+			workers_signal(SIGUSR2);
 			full_resume();
-		else
+		} else {
 			return admin_error(admin, "pooler is not paused/suspended");
+		}
 	} else {
 		PgDatabase *db = find_database(arg);
 		log_info("RESUME '%s' command issued", arg);
@@ -1079,6 +1349,10 @@ static bool admin_cmd_suspend(PgSocket *admin, const char *arg)
 	if (!admin->admin_user)
 		return admin_error(admin, "admin access needed");
 
+	/* SUSPEND is for online restart, which workers do not support */
+	if (workers_enabled())
+		return admin_error(admin, "SUSPEND %s", workers_refuse(false));
+
 	if (cf_pause_mode)
 		return admin_error(admin, "already suspended/paused");
 
@@ -1099,14 +1373,22 @@ static bool admin_cmd_suspend(PgSocket *admin, const char *arg)
 /* Command: PAUSE */
 static bool admin_cmd_pause(PgSocket *admin, const char *arg)
 {
+	const char *err;
+
 	if (!admin->admin_user)
 		return admin_error(admin, "admin access needed");
 
+	/* only PAUSE of everything has a signal */
+	err = workers_refuse(!arg[0]);
+	if (err)
+		return admin_error(admin, "PAUSE %s", err);
+
 	if (cf_pause_mode)
 		return admin_error(admin, "already suspended/paused");
 
 	if (!arg[0]) {
 		log_info("PAUSE command issued");
+		workers_signal(SIGUSR1);
 		cf_pause_mode = P_PAUSE;
 		admin->wait_for_response = true;
 	} else {
@@ -1118,6 +1400,7 @@ static bool admin_cmd_pause(PgSocket *admin, const char *arg)
 		if (db == admin->pool->db)
 			return admin_error(admin, "cannot pause admin db: %s", arg);
 		db->db_paused = true;
+		mark_database_active(db);
 		if (count_db_active(db) > 0)
 			admin->wait_for_response = true;
 		else
@@ -1227,10 +1510,9 @@ static bool admin_cmd_kill(PgSocket *admin, const char *arg)
 		return admin_error(admin, "cannot kill admin db: %s", arg);
 
 	db->db_paused = true;
-	statlist_for_each_safe(item, &pool_list, tmp) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db == db)
-			kill_pool(pool);
+	list_for_each_safe(item, &db->pool_list, tmp) {
+		pool = container_of(item, PgPool, db_head);
+		kill_pool(pool);
 	}
 
 	return admin_ready(admin, "KILL");
@@ -1254,6 +1536,7 @@ static bool admin_cmd_wait_close(PgSocket *admin, const char *arg)
 		       pool = container_of(item, PgPool, head);
 		       db = pool->db;
 		       db->db_wait_close = true;
+		       mark_database_active(db);
 		       active += count_db_active(db);
 	       }
 	       if (active > 0)
@@ -1270,6 +1553,7 @@ static bool admin_cmd_wait_close(PgSocket *admin, const char *arg)
 	       if (db == admin->pool->db)
 		       return admin_error(admin, "cannot wait in admin db: %s", arg);
 	       db->db_wait_close = true;
+	       mark_database_active(db);
 	       if (count_db_active(db) > 0)
 		       admin->wait_for_response = true;
 	       else
@@ -1328,9 +1612,10 @@ static bool admin_show_help(PgSocket *admin, const char *arg)
 		"SNOTICE", "C00000", "MConsole usage",
 		"D\n\tSHOW HELP|CONFIG|DATABASES"
 		"|POOLS|CLIENTS|SERVERS|USERS|VERSION\n"
-		"\tSHOW FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM\n"
-		"\tSHOW DNS_HOSTS|DNS_ZONES\n"
-		"\tSHOW STATS|STATS_TOTALS|STATS_AVERAGES|TOTALS\n"
+		"\tSHOW FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM|LOOP|AUTH_CACHES\n"
+		"\tSHOW TOP_CLIENTS|TOP_CLIENTS_BYTES|TOP_CLIENTS_QUERIES|TOP_CLIENTS_WAIT\n"
+		"\tSHOW DNS_HOSTS|DNS_ZONES|HBA\n"
+		"\tSHOW STATS|STATS_TOTALS|STATS_AVERAGES|TOTALS|LATENCY|PROTOCOL|QUERIES|CANCELS\n"
 		"\tSET key = arg\n"
 		"\tSET USER <user> = 'args'\n"
 		"\tSET POOL <user>.<db> = 'args'\n"
@@ -1387,15 +1672,47 @@ static bool admin_show_totals(PgSocket *admin, const char *arg)
 	return show_stat_totals(admin, &pool_list);
 }
 
+static bool admin_show_queries(PgSocket *admin, const char *arg)
+{
+	return admin_query_stats(admin);
+}
+
+static bool admin_show_latency(PgSocket *admin, const char *arg)
+{
+	return admin_latency_stats(admin, &pool_list);
+}
+
+static bool admin_show_loop(PgSocket *admin, const char *arg)
+{
+	return admin_loop_stats(admin);
+}
+
+static bool admin_show_protocol(PgSocket *admin, const char *arg)
+{
+	return admin_protocol_stats(admin, &pool_list);
+}
+
+static bool admin_show_cancels(PgSocket *admin, const char *arg)
+{
+	return admin_cancel_stats(admin);
+}
+
 
 static struct cmd_lookup show_map [] = {
+	{"auth_caches", admin_show_auth_caches},
+	{"cancels", admin_show_cancels},
 	{"clients", admin_show_clients},
 	{"config", admin_show_config},
 	{"databases", admin_show_databases},
 	{"fds", admin_show_fds},
+	{"hba", admin_show_hba},
 	{"help", admin_show_help},
+	{"latency", admin_show_latency},
 	{"lists", admin_show_lists},
+	{"loop", admin_show_loop},
 	{"pools", admin_show_pools},
+	{"protocol", admin_show_protocol},
+	{"queries", admin_show_queries},
 	{"servers", admin_show_servers},
 	{"sockets", admin_show_sockets},
 	{"active_sockets", admin_show_active_sockets},
@@ -1404,6 +1721,10 @@ static struct cmd_lookup show_map [] = {
 	{"stats_averages", admin_show_stats_averages},
 	{"users", admin_show_users},
 	{"version", admin_show_version},
+	{"top_clients", admin_show_top_clients},
+	{"top_clients_bytes", admin_show_top_clients_bytes},
+	{"top_clients_queries", admin_show_top_clients_queries},
+	{"top_clients_wait", admin_show_top_clients_wait},
 	{"totals", admin_show_totals},
 	{"mem", admin_show_mem},
 	{"dns_hosts", admin_show_dns_hosts},
@@ -0,0 +1,195 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Thread pool for CPU-heavy login work.
+ *
+ * TLS handshakes and SCRAM key derivation can take milliseconds of CPU
+ * each, and on the event loop a login storm delays every established
+ * connection by that much.  With auth_threads set, such steps are
+ * queued to a pool of threads.  The work callback runs in a thread and
+ * must only touch data in its job.  Finished jobs are handed back over
+ * a pipe, and their done callback runs in the event loop.
+ */
+
+#include "bouncer.h"
+
+int cf_auth_threads;
+
+#if defined(HAVE_PTHREAD_H) && !defined(WIN32)
+
+#include <pthread.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* both protected by queue_lock */
+static STATLIST(pending_job_list);
+static STATLIST(finished_job_list);
+
+/* a wakeup byte is in the pipe, protected by queue_lock */
+static bool wakeup_sent;
+
+static int wakeup_pipe[2] = { -1, -1 };
+static struct event wakeup_ev;
+static int thread_count;
+
+static void *auth_thread_main(void *arg)
+{
+	struct AuthJob *job;
+	struct List *item;
+	bool wake;
+	char c = 0;
+
+	while (true) {
+		pthread_mutex_lock(&queue_lock);
+		while (statlist_empty(&pending_job_list))
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		item = statlist_pop(&pending_job_list);
+		pthread_mutex_unlock(&queue_lock);
+
+		job = container_of(item, struct AuthJob, head);
+		job->work(job);
+
+		pthread_mutex_lock(&queue_lock);
+		statlist_append(&finished_job_list, &job->head);
+		wake = !wakeup_sent;
+		wakeup_sent = true;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (wake && write(wakeup_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			log_warning("auth thread: wakeup failed: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+/* run done callbacks of finished jobs */
+static void auth_wakeup_cb(evutil_socket_t fd, short flags, void *arg)
+{
+	struct StatList finished;
+	struct AuthJob *job;
+	struct List *item;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0) {}
+
+	statlist_init(&finished, "finished_auth_jobs");
+	pthread_mutex_lock(&queue_lock);
+	while ((item = statlist_pop(&finished_job_list)) != NULL)
+		statlist_append(&finished, item);
+	wakeup_sent = false;
+	pthread_mutex_unlock(&queue_lock);
+
+	while ((item = statlist_pop(&finished)) != NULL) {
+		job = container_of(item, struct AuthJob, head);
+		job->done(job);
+	}
+}
+
+void authpool_setup(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, err;
+
+	if (cf_auth_threads <= 0)
+		return;
+
+	if (pipe(wakeup_pipe) < 0)
+		die("auth threads: pipe failed: %s", strerror(errno));
+	if (!socket_set_nonblocking(wakeup_pipe[0], true) ||
+	    !socket_set_nonblocking(wakeup_pipe[1], true))
+		die("auth threads: cannot make pipe non-blocking: %s", strerror(errno));
+
+	event_assign(&wakeup_ev, pgb_event_base, wakeup_pipe[0], EV_READ | EV_PERSIST, auth_wakeup_cb, NULL);
+	if (event_add(&wakeup_ev, NULL) < 0)
+		die("auth threads: event_add failed: %s", strerror(errno));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < cf_auth_threads; i++) {
+		err = pthread_create(&thread, &attr, auth_thread_main, NULL);
+		if (err != 0)
+			die("failed to create auth thread: %s", strerror(err));
+		thread_count++;
+	}
+	pthread_attr_destroy(&attr);
+
+	log_info("started %d auth threads", thread_count);
+}
+
+bool auth_threads_enabled(void)
+{
+	return thread_count > 0;
+}
+
+/*
+ * Queue job for an auth thread.  Only valid if auth_threads_enabled(),
+ * the caller must keep the owner of the job waiting until done runs.
+ */
+void auth_job_submit(struct AuthJob *job, auth_job_cb work, auth_job_cb done)
+{
+	Assert(thread_count > 0);
+
+	list_init(&job->head);
+	job->work = work;
+	job->done = done;
+
+	pthread_mutex_lock(&queue_lock);
+	statlist_append(&pending_job_list, &job->head);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_cond_signal(&queue_cond);
+}
+
+/* jobs waiting for a thread */
+int auth_jobs_queued(void)
+{
+	int count;
+
+	pthread_mutex_lock(&queue_lock);
+	count = statlist_count(&pending_job_list);
+	pthread_mutex_unlock(&queue_lock);
+	return count;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+/* without threads all login work is done in the event loop */
+
+void authpool_setup(void)
+{
+	if (cf_auth_threads > 0)
+		log_warning("auth_threads is not supported on this platform, ignoring");
+}
+
+bool auth_threads_enabled(void)
+{
+	return false;
+}
+
+void auth_job_submit(struct AuthJob *job, auth_job_cb work, auth_job_cb done)
+{
+	fatal("auth threads are not supported");
+}
+
+int auth_jobs_queued(void)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Forwarding of cancel requests.
+ *
+ * A CancelRequest is a single 16-byte packet on a fresh connection that
+ * the server closes right after reading it, so there is no need for a
+ * pooled server connection with startup and authentication.  Each
+ * request gets a bare connection to the address of the server that runs
+ * the query.  Connections to one server address are limited by
+ * max_cancel_connections, the rest wait in a queue for that address.
+ */
+
+#include "bouncer.h"
+
+#include <usual/slab.h>
+
+/* address of the server socket, as seen by getpeername() */
+union CancelAddr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct sockaddr_un sun;
+};
+
+/* cancel traffic to one server address */
+struct CancelHost {
+	struct List head;		/* entry in cancel_host_list */
+	union CancelAddr addr;
+	socklen_t addr_len;
+
+	struct StatList active_list;	/* connections in progress */
+	struct StatList queue;		/* requests waiting for a free slot */
+	bool starting;			/* start_queued() is running */
+
+	uint64_t sent_count;		/* requests delivered to the server */
+	uint64_t failed_count;		/* requests that could not be sent */
+	usec_t total_time;		/* accept to send, for sent requests */
+};
+
+struct CancelConn {
+	struct List head;		/* entry in one of the lists of host, or justfree */
+	SBuf sbuf;
+	struct CancelHost *host;
+	PgSocket *req;			/* CL_CANCEL client, NULL if detached */
+	uint8_t key[BACKENDKEY_LEN];	/* server cancel key */
+	usec_t start_time;		/* when the request was accepted */
+	bool connecting;
+};
+
+static STATLIST(cancel_host_list);
+static STATLIST(justfree_cancel_list);
+static struct Slab *cancel_cache;
+
+static void start_queued(struct CancelHost *host);
+
+void cancel_setup(void)
+{
+	cancel_cache = slab_create("cancel_cache", sizeof(struct CancelConn), 0, NULL, USUAL_ALLOC);
+	if (!cancel_cache)
+		fatal("cannot create cancel cache");
+}
+
+static struct CancelHost *find_host(const union CancelAddr *addr, socklen_t addr_len)
+{
+	struct List *item;
+	struct CancelHost *host;
+
+	statlist_for_each(item, &cancel_host_list) {
+		host = container_of(item, struct CancelHost, head);
+		if (host->addr_len == addr_len && memcmp(&host->addr, addr, addr_len) == 0)
+			return host;
+	}
+
+	host = calloc(1, sizeof(*host));
+	if (!host)
+		return NULL;
+	list_init(&host->head);
+	statlist_init(&host->active_list, "cancel_active_list");
+	statlist_init(&host->queue, "cancel_queue");
+	memcpy(&host->addr, addr, addr_len);
+	host->addr_len = addr_len;
+	statlist_append(&cancel_host_list, &host->head);
+	return host;
+}
+
+static const char *host_str(const struct CancelHost *host, char *dst, int dstlen)
+{
+	PgAddr pga;
+
+	if (host->addr.sa.sa_family != AF_UNIX) {
+		memset(&pga, 0, sizeof(pga));
+		pga_copy(&pga, &host->addr.sa);
+		return pga_str(&pga, dst, dstlen);
+	}
+
+	/* abstract socket names start with a zero byte */
+	if (host->addr.sun.sun_path[0] == '\0' && host->addr_len > offsetof(struct sockaddr_un, sun_path))
+		snprintf(dst, dstlen, "@%s", host->addr.sun.sun_path + 1);
+	else
+		snprintf(dst, dstlen, "%s", host->addr.sun.sun_path);
+	return dst;
+}
+
+/* request is done, successfully or not */
+static void finish_cancel(struct CancelConn *cc, bool sent, const char *reason)
+{
+	struct CancelHost *host = cc->host;
+	PgSocket *req = cc->req;
+	char buf[PGADDR_BUF + 64];
+
+	Assert(cc->connecting);
+
+	if (!sbuf_close(&cc->sbuf))
+		log_noise("sbuf_close failed");
+
+	cc->connecting = false;
+	statlist_remove(&host->active_list, &cc->head);
+
+	if (sent) {
+		host->sent_count++;
+		host->total_time += get_cached_time() - cc->start_time;
+	} else {
+		host->failed_count++;
+		log_warning("cancel request to %s failed: %s",
+			    host_str(host, buf, sizeof(buf)), reason);
+	}
+
+	/* the client that sent the request may be gone already */
+	if (req) {
+		cc->req = NULL;
+		req->cancel_conn = NULL;
+		change_client_state(req, CL_JUSTFREE);
+	}
+
+	/* sbuf callbacks may still look at the sbuf, free it later */
+	statlist_append(&justfree_cancel_list, &cc->head);
+
+	start_queued(host);
+}
+
+static bool cancel_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
+{
+	struct CancelConn *cc = container_of(sbuf, struct CancelConn, sbuf);
+	uint8_t pkt[16];
+	PktBuf tmp;
+
+	switch (evtype) {
+	case SBUF_EV_CONNECT_OK:
+		pktbuf_static(&tmp, pkt, sizeof(pkt));
+		pktbuf_write_CancelRequest(&tmp, cc->key);
+		if (sbuf_answer(&cc->sbuf, pkt, pktbuf_written(&tmp)))
+			finish_cancel(cc, true, NULL);
+		else
+			finish_cancel(cc, false, "send failed");
+		break;
+	case SBUF_EV_CONNECT_FAILED:
+		finish_cancel(cc, false, "connect failed");
+		break;
+	default:
+		/* the connection is closed right after sending */
+		log_warning("cancel_proto: unexpected event %d", evtype);
+		finish_cancel(cc, false, "unexpected event");
+		break;
+	}
+	return false;
+}
+
+static void launch_cancel(struct CancelConn *cc)
+{
+	struct CancelHost *host = cc->host;
+
+	cc->connecting = true;
+	statlist_append(&host->active_list, &cc->head);
+
+	/* callbacks may run and finish the request before this returns */
+	sbuf_init(&cc->sbuf, cancel_proto);
+	if (!sbuf_connect(&cc->sbuf, &host->addr.sa, host->addr_len,
+			  cf_server_connect_timeout / USEC))
+		log_noise("failed to launch cancel connection");
+}
+
+/* launch queued requests while the host has free slots */
+static void start_queued(struct CancelHost *host)
+{
+	struct CancelConn *cc;
+	struct List *item;
+
+	/* a request finishing inside launch_cancel() must not recurse */
+	if (host->starting)
+		return;
+	host->starting = true;
+
+	while (cf_max_cancel_connections <= 0 ||
+	       statlist_count(&host->active_list) < cf_max_cancel_connections) {
+		item = statlist_pop(&host->queue);
+		if (!item)
+			break;
+		cc = container_of(item, struct CancelConn, head);
+		launch_cancel(cc);
+	}
+
+	host->starting = false;
+}
+
+/*
+ * Send the cancel key of server to its address on a connection of its
+ * own.  req is a CL_CANCEL client, it is moved to CL_JUSTFREE once the
+ * request was sent or failed.  Returns false if the request could not
+ * be started at all, req is left as it is then.
+ */
+bool forward_cancel_request(PgSocket *req, PgSocket *server)
+{
+	union CancelAddr addr;
+	socklen_t addr_len = sizeof(addr);
+	struct CancelHost *host;
+	struct CancelConn *cc;
+
+	Assert(req->state == CL_CANCEL);
+
+	memset(&addr, 0, sizeof(addr));
+	if (getpeername(sbuf_socket(&server->sbuf), &addr.sa, &addr_len) < 0) {
+		log_warning("forward_cancel_request: getpeername: %s", strerror(errno));
+		return false;
+	}
+
+	host = find_host(&addr, addr_len);
+	if (!host)
+		return false;
+
+	cc = slab_alloc(cancel_cache);
+	if (!cc)
+		return false;
+	list_init(&cc->head);
+	cc->connecting = false;
+	cc->host = host;
+	cc->req = req;
+	cc->start_time = get_cached_time();
+	memcpy(cc->key, server->cancel_key, BACKENDKEY_LEN);
+	req->cancel_conn = cc;
+
+	statlist_append(&host->queue, &cc->head);
+	start_queued(host);
+	return true;
+}
+
+/* req is going away, let its request finish without it */
+void cancel_request_detach(PgSocket *req)
+{
+	struct CancelConn *cc = req->cancel_conn;
+
+	if (!cc)
+		return;
+	cc->req = NULL;
+	req->cancel_conn = NULL;
+}
+
+void reuse_just_freed_cancels(void)
+{
+	struct List *item, *tmp;
+	struct CancelConn *cc;
+
+	statlist_for_each_safe(item, &justfree_cancel_list, tmp) {
+		cc = container_of(item, struct CancelConn, head);
+		statlist_remove(&justfree_cancel_list, &cc->head);
+		slab_free(cancel_cache, cc);
+	}
+}
+
+void cancel_cleanup(void)
+{
+	struct List *item, *tmp;
+	struct CancelHost *host;
+	struct CancelConn *cc;
+
+	statlist_for_each_safe(item, &cancel_host_list, tmp) {
+		host = container_of(item, struct CancelHost, head);
+		while ((item = statlist_pop(&host->active_list)) != NULL) {
+			cc = container_of(item, struct CancelConn, head);
+			if (!sbuf_close(&cc->sbuf))
+				log_noise("sbuf_close failed");
+			slab_free(cancel_cache, cc);
+		}
+		while ((item = statlist_pop(&host->queue)) != NULL) {
+			cc = container_of(item, struct CancelConn, head);
+			slab_free(cancel_cache, cc);
+		}
+		statlist_remove(&cancel_host_list, &host->head);
+		free(host);
+	}
+
+	reuse_just_freed_cancels();
+	slab_destroy(cancel_cache);
+	cancel_cache = NULL;
+}
+
+/* Command: SHOW CANCELS */
+bool admin_cancel_stats(PgSocket *admin)
+{
+	struct List *item;
+	struct CancelHost *host;
+	PktBuf *buf;
+	char addr[PGADDR_BUF + 64];
+	usec_t avg_time;
+
+	buf = pktbuf_dynamic(256);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "siiqqq", "addr", "active", "waiting",
+				    "sent", "failed", "avg_time");
+	statlist_for_each(item, &cancel_host_list) {
+		host = container_of(item, struct CancelHost, head);
+		avg_time = host->sent_count ? host->total_time / host->sent_count : 0;
+		pktbuf_write_DataRow(buf, "siiqqq",
+				     host_str(host, addr, sizeof(addr)),
+				     statlist_count(&host->active_list),
+				     statlist_count(&host->queue),
+				     host->sent_count, host->failed_count,
+				     avg_time);
+	}
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
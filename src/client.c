@@ -595,6 +595,91 @@ static bool decide_startup_pool(PgSocket *client, PktHdr *pkt)
 	return set_pool(client, dbname, username, NULL, false);
 }
 
+/* SCRAM key derivation of a login, running in an auth thread */
+struct ClientKeyJob {
+	struct AuthJob job;
+	PgSocket *client;
+	usec_t connect_time;
+	struct ScramKeyJob *keys;
+	bool password_ok;
+};
+
+static void client_key_work(struct AuthJob *aj)
+{
+	struct ClientKeyJob *job = container_of(aj, struct ClientKeyJob, job);
+
+	job->password_ok = scram_key_job_run(job->keys);
+}
+
+static void client_key_done(struct AuthJob *aj)
+{
+	struct ClientKeyJob *job = container_of(aj, struct ClientKeyJob, job);
+	PgSocket *client = job->client;
+
+	/* the client may be gone, or the socket reused */
+	if (client->state == CL_LOGIN && client->connect_time == job->connect_time) {
+		if (!job->password_ok) {
+			/* wrong keys are not cached, the login would derive them again */
+			disconnect_client(client, true, "password authentication failed");
+		} else {
+			/* process the packet again, the keys are in the cache now */
+			client->auth_job_done = true;
+			sbuf_continue(&client->sbuf);
+		}
+	}
+
+	scram_key_job_free(job->keys);
+	free(job);
+}
+
+/*
+ * Hand the slow part of checking the password to an auth thread.
+ * provided_passwd is NULL for SCRAM authentication, where the stored
+ * password is used.  Returns true if the current packet will be
+ * processed again when the thread is done.
+ */
+static bool offload_scram_keys(PgSocket *client, const char *provided_passwd)
+{
+	PgUser *user = client->login_user;
+	const char *real_passwd;
+	struct ClientKeyJob *job;
+	struct ScramKeyJob *keys;
+
+	if (client->auth_job_done) {
+		client->auth_job_done = false;
+		return false;
+	}
+
+	if (!auth_threads_enabled() || user->mock_auth)
+		return false;
+
+	real_passwd = user_password(user, client_database(client));
+	if (!*real_passwd)
+		return false;
+	if (!provided_passwd && get_password_type(real_passwd) != PASSWORD_TYPE_PLAINTEXT)
+		return false;
+	if (provided_passwd && get_password_type(real_passwd) != PASSWORD_TYPE_SCRAM_SHA_256)
+		return false;
+
+	keys = scram_key_job_new(user->name, provided_passwd, real_passwd);
+	if (!keys)
+		return false;
+
+	job = calloc(1, sizeof(*job));
+	if (!job || !sbuf_pause(&client->sbuf)) {
+		/* do it inline then */
+		free(job);
+		scram_key_job_free(keys);
+		return false;
+	}
+
+	job->client = client;
+	job->connect_time = client->connect_time;
+	job->keys = keys;
+	auth_job_submit(&job->job, client_key_work, client_key_done);
+	return true;
+}
+
 static bool scram_client_first(PgSocket *client, uint32_t datalen, const uint8_t *data)
 {
 	char *ibuf;
@@ -811,6 +896,8 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 					return false;
 				if (!mbuf_get_bytes(&pkt->data, length, &data))
 					return false;
+				if (offload_scram_keys(client, NULL))
+					return false;
 				if (!scram_client_first(client, length, data)) {
 					disconnect_client(client, true, "SASL authentication failed");
 					return false;
@@ -864,6 +951,10 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 					return false;
 				}
 
+				if (client->client_auth_type == AUTH_PLAIN &&
+				    offload_scram_keys(client, provided_passwd))
+					return false;
+
 				if (check_client_passwd(client, provided_passwd)) {
 					if (!finish_client_login(client))
 						return false;
@@ -898,6 +989,7 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 {
 	SBuf *sbuf = &client->sbuf;
 	int rfq_delta = 0;
+	bool track_prepared = false;
 
 	switch (pkt->type) {
 
@@ -951,12 +1043,14 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 	/* update stats */
 	if (!client->query_start) {
 		client->pool->stats.query_count++;
+		client->stats.query_count++;
 		client->query_start = get_cached_time();
 	}
 
 	/* remember timestamp of the first query in a transaction */
 	if (!client->xact_start) {
 		client->pool->stats.xact_count++;
+		client->stats.xact_count++;
 		client->xact_start = client->query_start;
 	}
 
@@ -967,17 +1061,40 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 	if (!find_server(client))
 		return false;
 
+	switch (pkt->type) {
+	case 'P':
+	case 'B':
+	case 'D':
+	case 'C':
+		track_prepared = prepare_tracking(client);
+		/* rewritten packets must not overtake the data before them */
+		if (track_prepared && !sbuf_flush(sbuf))
+			return false;
+		break;
+	}
+
 	/* postpone rfq change until certain that client will not be paused */
 	if (rfq_delta) {
 		client->expect_rfq_count += rfq_delta;
+		if (!prepare_server_sync(client->link)) {
+			disconnect_client(client, true, "out of memory");
+			return false;
+		}
 	}
 
 	client->pool->stats.client_bytes += pkt->len;
+	client->stats.client_bytes += pkt->len;
+	proto_stats_add(client->pool, client, pkt);
+	if (pkt->type == 'Q' || pkt->type == 'P')
+		query_stats_add(client, pkt);
 
 	/* tag the server as dirty */
 	client->link->ready = false;
 	client->link->idle_tx = false;
 
+	if (track_prepared)
+		return prepare_client_packet(client, pkt);
+
 	/* forward the packet */
 	sbuf_prepare_send(sbuf, &client->link->sbuf, pkt->len);
 
@@ -1070,9 +1187,11 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 		/* client is not interested in it */
 		break;
 	case SBUF_EV_PKT_CALLBACK:
-		/* unused ATM */
+		/* large packet with prepared statement */
+		res = prepare_client_fetch(client, data);
 		break;
 	case SBUF_EV_TLS_READY:
+		stats_client_tls(sbuf_tls_session_reused(&client->sbuf));
 		sbuf_continue(&client->sbuf);
 		res = true;
 		break;
@@ -46,6 +46,8 @@ struct HBAName {
 
 struct HBARule {
 	struct List node;
+	int rule_nr;		/* position among rules, first match wins */
+	int linenr;
 	enum RuleType rule_type;
 	int rule_method;
 	int rule_af;
@@ -53,10 +55,70 @@ struct HBARule {
 	uint8_t rule_mask[16];
 	struct HBAName db_name;
 	struct HBAName user_name;
+	uint64_t hit_count;	/* logins decided by this rule */
+};
+
+/* numbers of rules, in rule order */
+struct RuleList {
+	int *nrs;
+	int count;
+	int alloc;
+};
+
+/* rules found by an exact key, a masked address or a name */
+struct RuleBucket {
+	struct List node;	/* entry in HBA.bucket_list */
+	struct RuleList rules;
+	unsigned int keylen;
+	uint8_t key[FLEX_ARRAY];
+};
+
+struct NameIndex {
+	struct CBTree *buckets;		/* name -> rules that list it */
+	struct RuleList wild;		/* rules for all or sameuser */
 };
 
+/* remembered result of hba_eval() */
+struct HBACacheEntry {
+	struct List node;	/* entry in HBA.cache_lru, most recent first */
+	struct HBARule *rule;	/* NULL if no rule matched */
+	unsigned int keylen;
+	uint8_t key[FLEX_ARRAY];
+};
+
+#define HBA_CACHE_SIZE	1024
+
+/* longest cache key: family, tls, address, database and user name */
+#define HBA_CACHE_KEYLEN	(2 + 16 + MAX_DBNAME + MAX_USERNAME)
+
 struct HBA {
 	struct List rules;
+
+	/*
+	 * Rules compiled by hba_compile().  Each index gives, for a login,
+	 * all rules that can match it in rule order, and hba_eval() checks
+	 * the shortest of those lists.  If compiling failed, all rules are
+	 * checked.
+	 */
+	bool compiled;
+	int rule_count;
+	struct HBARule **rule_array;		/* by rule_nr */
+	struct List bucket_list;		/* all RuleBuckets, for freeing */
+	struct CBTree *addr_buckets;		/* (family, prefix length, masked address) */
+	uint8_t inet4_lens[33];			/* prefix lengths in use, longest first */
+	int inet4_len_count;
+	uint8_t inet6_lens[129];
+	int inet6_len_count;
+	struct RuleList local_rules;
+	struct RuleList other_addr_rules;	/* masks that are not a prefix */
+	struct NameIndex db_index;
+	struct NameIndex user_index;
+
+	struct CBTree *cache;
+	struct List cache_lru;
+	int cache_used;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
 };
 
 /*
@@ -529,6 +591,7 @@ static bool parse_line(struct HBA *hba, struct TokParser *tp, int linenr, const
 		return false;
 	}
 	rule->rule_type = rtype;
+	rule->linenr = linenr;
 
 	if (!parse_names(&rule->db_name, tp, true, parent_filename))
 		goto failed;
@@ -609,6 +672,213 @@ failed:
 	return false;
 }
 
+/*
+ * Compile rules into indexes.
+ */
+
+static bool rule_list_add(struct RuleList *list, int nr)
+{
+	int *tmp;
+	int alloc;
+
+	if (list->count == list->alloc) {
+		alloc = list->alloc ? list->alloc * 2 : 4;
+		tmp = realloc(list->nrs, alloc * sizeof(*tmp));
+		if (!tmp)
+			return false;
+		list->nrs = tmp;
+		list->alloc = alloc;
+	}
+	list->nrs[list->count++] = nr;
+	return true;
+}
+
+static size_t bucket_key(void *ctx, void *obj, const void **ptr_p)
+{
+	struct RuleBucket *bucket = obj;
+	*ptr_p = bucket->key;
+	return bucket->keylen;
+}
+
+static struct RuleBucket *get_bucket(struct HBA *hba, struct CBTree *tree, const void *key, unsigned int keylen)
+{
+	struct RuleBucket *bucket;
+
+	bucket = cbtree_lookup(tree, key, keylen);
+	if (bucket)
+		return bucket;
+
+	bucket = calloc(1, offsetof(struct RuleBucket, key) + keylen);
+	if (!bucket)
+		return NULL;
+	list_init(&bucket->node);
+	bucket->keylen = keylen;
+	memcpy(bucket->key, key, keylen);
+	if (!cbtree_insert(tree, bucket)) {
+		free(bucket);
+		return NULL;
+	}
+	list_append(&hba->bucket_list, &bucket->node);
+	return bucket;
+}
+
+/* prefix length of mask, -1 if it is not a prefix */
+static int mask_prefix_len(const uint8_t *mask, int bytes)
+{
+	int i, bits = 0;
+	uint8_t m;
+
+	for (i = 0; i < bytes && mask[i] == 255; i++)
+		bits += 8;
+	if (i == bytes)
+		return bits;
+
+	for (m = mask[i]; m & 0x80; m <<= 1)
+		bits++;
+	if (m)
+		return -1;
+	for (i++; i < bytes; i++) {
+		if (mask[i])
+			return -1;
+	}
+	return bits;
+}
+
+/* key of a prefix: family, length and the address masked to it */
+static unsigned int addr_key(uint8_t *key, int af, int bits, const uint8_t *addr)
+{
+	int i, bytes = af == AF_INET ? 4 : 16;
+
+	key[0] = af == AF_INET ? 4 : 6;
+	key[1] = bits;
+	for (i = 0; i < bytes; i++, bits -= 8) {
+		if (bits >= 8)
+			key[2 + i] = addr[i];
+		else if (bits > 0)
+			key[2 + i] = addr[i] & (255 << (8 - bits));
+		else
+			key[2 + i] = 0;
+	}
+	return 2 + bytes;
+}
+
+struct NameIndexCtx {
+	struct HBA *hba;
+	struct NameIndex *idx;
+	int nr;
+};
+
+static bool index_name(struct NameIndexCtx *ctx, const struct StrSetNode *node)
+{
+	struct RuleBucket *bucket;
+
+	bucket = get_bucket(ctx->hba, ctx->idx->buckets, node->s_val, node->s_len);
+	return bucket && rule_list_add(&bucket->rules, ctx->nr);
+}
+
+static bool index_name_cb(void *arg, void *obj)
+{
+	return index_name(arg, obj);
+}
+
+static bool index_names(struct HBA *hba, struct NameIndex *idx, struct HBAName *hname, int nr)
+{
+	struct StrSet *set = hname->name_set;
+	struct NameIndexCtx ctx = { hba, idx, nr };
+	unsigned int i;
+
+	/* all and sameuser can match any name */
+	if (hname->flags)
+		return rule_list_add(&idx->wild, nr);
+	if (!set)
+		return true;
+
+	if (set->cbtree)
+		return cbtree_walk(set->cbtree, index_name_cb, &ctx);
+	for (i = 0; i < set->count; i++) {
+		if (!index_name(&ctx, set->nodes[i]))
+			return false;
+	}
+	return true;
+}
+
+static size_t cache_entry_key(void *ctx, void *obj, const void **ptr_p)
+{
+	struct HBACacheEntry *entry = obj;
+	*ptr_p = entry->key;
+	return entry->keylen;
+}
+
+static bool hba_compile(struct HBA *hba)
+{
+	bool inet4_used[33] = { false };
+	bool inet6_used[129] = { false };
+	struct RuleBucket *bucket;
+	struct HBARule *rule;
+	struct List *el;
+	uint8_t key[18];
+	int i, bits, nr = 0;
+
+	list_for_each(el, &hba->rules)
+		hba->rule_count++;
+
+	hba->rule_array = calloc(hba->rule_count + 1, sizeof(*hba->rule_array));
+	hba->addr_buckets = cbtree_create(bucket_key, NULL, NULL, NULL);
+	hba->db_index.buckets = cbtree_create(bucket_key, NULL, NULL, NULL);
+	hba->user_index.buckets = cbtree_create(bucket_key, NULL, NULL, NULL);
+	hba->cache = cbtree_create(cache_entry_key, NULL, NULL, NULL);
+	if (!hba->rule_array || !hba->addr_buckets || !hba->db_index.buckets ||
+	    !hba->user_index.buckets || !hba->cache)
+		return false;
+
+	list_for_each(el, &hba->rules) {
+		rule = container_of(el, struct HBARule, node);
+		rule->rule_nr = nr;
+		hba->rule_array[nr] = rule;
+
+		if (rule->rule_type == RULE_LOCAL) {
+			if (!rule_list_add(&hba->local_rules, nr))
+				return false;
+		} else {
+			/* a rule with a bad mask never matches, leave it to match_inet */
+			bits = -1;
+			if (!bad_mask(rule))
+				bits = mask_prefix_len(rule->rule_mask, rule->rule_af == AF_INET ? 4 : 16);
+			if (bits < 0) {
+				if (!rule_list_add(&hba->other_addr_rules, nr))
+					return false;
+			} else {
+				bucket = get_bucket(hba, hba->addr_buckets, key,
+						    addr_key(key, rule->rule_af, bits, rule->rule_addr));
+				if (!bucket || !rule_list_add(&bucket->rules, nr))
+					return false;
+				if (rule->rule_af == AF_INET)
+					inet4_used[bits] = true;
+				else
+					inet6_used[bits] = true;
+			}
+		}
+
+		if (!index_names(hba, &hba->db_index, &rule->db_name, nr))
+			return false;
+		if (!index_names(hba, &hba->user_index, &rule->user_name, nr))
+			return false;
+		nr++;
+	}
+
+	for (i = 32; i >= 0; i--) {
+		if (inet4_used[i])
+			hba->inet4_lens[hba->inet4_len_count++] = i;
+	}
+	for (i = 128; i >= 0; i--) {
+		if (inet6_used[i])
+			hba->inet6_lens[hba->inet6_len_count++] = i;
+	}
+
+	hba->compiled = true;
+	return true;
+}
+
 struct HBA *hba_load_rules(const char *fn)
 {
 	struct HBA *hba = NULL;
@@ -621,11 +891,13 @@ struct HBA *hba_load_rules(const char *fn)
 
 	init_parser(&tp);
 
-	hba = malloc(sizeof *hba);
+	hba = calloc(1, sizeof *hba);
 	if (!hba)
 		goto out;
 
 	list_init(&hba->rules);
+	list_init(&hba->bucket_list);
+	list_init(&hba->cache_lru);
 
 	f = fopen(fn, "r");
 	if (!f) {
@@ -645,6 +917,8 @@ struct HBA *hba_load_rules(const char *fn)
 			continue;
 		}
 	}
+	if (!hba_compile(hba))
+		log_warning("hba: no mem for rule index, checking all rules");
 out:
 	free_parser(&tp);
 	free(ln);
@@ -653,10 +927,13 @@ out:
 	return hba;
 }
 
+
 void hba_free(struct HBA *hba)
 {
 	struct List *el, *tmp;
 	struct HBARule *rule;
+	struct RuleBucket *bucket;
+	struct HBACacheEntry *entry;
 	if (!hba)
 		return;
 	list_for_each_safe(el, &hba->rules, tmp) {
@@ -664,6 +941,28 @@ void hba_free(struct HBA *hba)
 		list_del(&rule->node);
 		rule_free(rule);
 	}
+	list_for_each_safe(el, &hba->bucket_list, tmp) {
+		bucket = container_of(el, struct RuleBucket, node);
+		free(bucket->rules.nrs);
+		free(bucket);
+	}
+	list_for_each_safe(el, &hba->cache_lru, tmp) {
+		entry = container_of(el, struct HBACacheEntry, node);
+		free(entry);
+	}
+	if (hba->addr_buckets)
+		cbtree_destroy(hba->addr_buckets);
+	if (hba->db_index.buckets)
+		cbtree_destroy(hba->db_index.buckets);
+	if (hba->user_index.buckets)
+		cbtree_destroy(hba->user_index.buckets);
+	if (hba->cache)
+		cbtree_destroy(hba->cache);
+	free(hba->db_index.wild.nrs);
+	free(hba->user_index.wild.nrs);
+	free(hba->local_rules.nrs);
+	free(hba->other_addr_rules.nrs);
+	free(hba->rule_array);
 	free(hba);
 }
 
@@ -701,47 +1000,287 @@ static bool match_inet6(const struct HBARule *rule, PgAddr *addr)
 		(src[2] & mask[2]) == base[2] && (src[3] & mask[3]) == base[3];
 }
 
-int hba_eval(struct HBA *hba, PgAddr *addr, bool is_tls, const char *dbname, const char *username)
+static bool rule_match(struct HBARule *rule, PgAddr *addr, bool is_tls,
+		       const char *dbname, unsigned int dbnamelen,
+		       const char *username, unsigned int unamelen)
 {
+	/* match address */
+	if (pga_is_unix(addr)) {
+		if (rule->rule_type != RULE_LOCAL)
+			return false;
+	} else if (rule->rule_type == RULE_LOCAL) {
+		return false;
+	} else if (rule->rule_type == RULE_HOSTSSL && !is_tls) {
+		return false;
+	} else if (rule->rule_type == RULE_HOSTNOSSL && is_tls) {
+		return false;
+	} else if (rule->rule_af == AF_INET) {
+		if (!match_inet4(rule, addr))
+			return false;
+	} else if (rule->rule_af == AF_INET6) {
+		if (!match_inet6(rule, addr))
+			return false;
+	} else {
+		return false;
+	}
+
+	/* match db & user */
+	if (!name_match(&rule->db_name, dbname, dbnamelen, username))
+		return false;
+	if (!name_match(&rule->user_name, username, unamelen, dbname))
+		return false;
+
+	return true;
+}
+
+/*
+ * Rules that can match a login, from one index.  Each list is in rule
+ * order, together they are walked in rule order.
+ */
+#define MAX_CANDIDATE_LISTS	(129 + 1)
+
+struct Candidates {
+	const struct RuleList *lists[MAX_CANDIDATE_LISTS];
+	int pos[MAX_CANDIDATE_LISTS];
+	int list_count;
+	int rule_count;
+};
+
+static void candidates_add(struct Candidates *c, const struct RuleList *list)
+{
+	if (list->count == 0)
+		return;
+	c->lists[c->list_count] = list;
+	c->pos[c->list_count] = 0;
+	c->list_count++;
+	c->rule_count += list->count;
+}
+
+/* next rule number in rule order, -1 at the end */
+static int candidates_next(struct Candidates *c)
+{
+	int i, best = -1;
+
+	for (i = 0; i < c->list_count; i++) {
+		if (c->pos[i] >= c->lists[i]->count)
+			continue;
+		if (best < 0 || c->lists[i]->nrs[c->pos[i]] < c->lists[best]->nrs[c->pos[best]])
+			best = i;
+	}
+	if (best < 0)
+		return -1;
+	return c->lists[best]->nrs[c->pos[best]++];
+}
+
+static void addr_candidates(struct HBA *hba, struct Candidates *c, PgAddr *addr)
+{
+	const uint8_t *src, *lens;
+	struct RuleBucket *bucket;
+	uint8_t key[18];
+	int i, af, len_count;
+
+	c->list_count = c->rule_count = 0;
+
+	if (pga_is_unix(addr)) {
+		candidates_add(c, &hba->local_rules);
+		return;
+	}
+
+	af = pga_family(addr);
+	if (af == AF_INET) {
+		src = (const uint8_t *)&addr->sin.sin_addr.s_addr;
+		lens = hba->inet4_lens;
+		len_count = hba->inet4_len_count;
+	} else if (af == AF_INET6) {
+		src = addr->sin6.sin6_addr.s6_addr;
+		lens = hba->inet6_lens;
+		len_count = hba->inet6_len_count;
+	} else {
+		return;
+	}
+
+	for (i = 0; i < len_count; i++) {
+		bucket = cbtree_lookup(hba->addr_buckets, key, addr_key(key, af, lens[i], src));
+		if (bucket)
+			candidates_add(c, &bucket->rules);
+	}
+	candidates_add(c, &hba->other_addr_rules);
+}
+
+static void name_candidates(struct NameIndex *idx, struct Candidates *c, const char *name, unsigned int namelen)
+{
+	struct RuleBucket *bucket;
+
+	c->list_count = c->rule_count = 0;
+
+	bucket = cbtree_lookup(idx->buckets, name, namelen);
+	if (bucket)
+		candidates_add(c, &bucket->rules);
+	candidates_add(c, &idx->wild);
+}
+
+static struct HBARule *find_rule(struct HBA *hba, PgAddr *addr, bool is_tls,
+				 const char *dbname, unsigned int dbnamelen,
+				 const char *username, unsigned int unamelen)
+{
+	struct Candidates by_addr, by_db, by_user, *c;
+	struct HBARule *rule;
+	struct List *el;
+	int nr;
+
+	if (!hba->compiled) {
+		list_for_each(el, &hba->rules) {
+			rule = container_of(el, struct HBARule, node);
+			if (rule_match(rule, addr, is_tls, dbname, dbnamelen, username, unamelen))
+				return rule;
+		}
+		return NULL;
+	}
+
+	/* every index has all rules that match, check the shortest */
+	addr_candidates(hba, &by_addr, addr);
+	name_candidates(&hba->db_index, &by_db, dbname, dbnamelen);
+	name_candidates(&hba->user_index, &by_user, username, unamelen);
+	c = &by_addr;
+	if (by_db.rule_count < c->rule_count)
+		c = &by_db;
+	if (by_user.rule_count < c->rule_count)
+		c = &by_user;
+
+	while ((nr = candidates_next(c)) >= 0) {
+		rule = hba->rule_array[nr];
+		if (rule_match(rule, addr, is_tls, dbname, dbnamelen, username, unamelen))
+			return rule;
+	}
+	return NULL;
+}
+
+/* cache key of a login, 0 if it does not fit */
+static unsigned int cache_key(uint8_t *key, PgAddr *addr, bool is_tls,
+			      const char *dbname, unsigned int dbnamelen,
+			      const char *username, unsigned int unamelen)
+{
+	unsigned int len = 0;
+
+	if (dbnamelen >= MAX_DBNAME || unamelen >= MAX_USERNAME)
+		return 0;
+
+	key[len++] = pga_family(addr);
+	key[len++] = is_tls;
+	if (pga_family(addr) == AF_INET) {
+		memcpy(key + len, &addr->sin.sin_addr.s_addr, 4);
+		len += 4;
+	} else if (pga_family(addr) == AF_INET6) {
+		memcpy(key + len, addr->sin6.sin6_addr.s6_addr, 16);
+		len += 16;
+	}
+	memcpy(key + len, dbname, dbnamelen + 1);
+	len += dbnamelen + 1;
+	memcpy(key + len, username, unamelen + 1);
+	len += unamelen + 1;
+	return len;
+}
+
+static void cache_store(struct HBA *hba, const uint8_t *key, unsigned int keylen, struct HBARule *rule)
+{
+	struct HBACacheEntry *entry;
 	struct List *el;
+
+	/* drop the least recently used entry */
+	if (hba->cache_used >= HBA_CACHE_SIZE) {
+		el = list_last(&hba->cache_lru);
+		entry = container_of(el, struct HBACacheEntry, node);
+		cbtree_delete(hba->cache, entry->key, entry->keylen);
+		list_del(&entry->node);
+		free(entry);
+		hba->cache_used--;
+	}
+
+	entry = malloc(offsetof(struct HBACacheEntry, key) + keylen);
+	if (!entry)
+		return;
+	list_init(&entry->node);
+	entry->rule = rule;
+	entry->keylen = keylen;
+	memcpy(entry->key, key, keylen);
+	if (!cbtree_insert(hba->cache, entry)) {
+		free(entry);
+		return;
+	}
+	list_prepend(&hba->cache_lru, &entry->node);
+	hba->cache_used++;
+}
+
+int hba_eval(struct HBA *hba, PgAddr *addr, bool is_tls, const char *dbname, const char *username)
+{
+	struct HBACacheEntry *entry;
 	struct HBARule *rule;
 	unsigned int dbnamelen = strlen(dbname);
 	unsigned int unamelen = strlen(username);
+	uint8_t key[HBA_CACHE_KEYLEN];
+	unsigned int keylen = 0;
 
 	if (!hba)
 		return AUTH_REJECT;
 
+	if (hba->compiled)
+		keylen = cache_key(key, addr, is_tls, dbname, dbnamelen, username, unamelen);
+	if (keylen > 0) {
+		entry = cbtree_lookup(hba->cache, key, keylen);
+		if (entry) {
+			hba->cache_hits++;
+			list_del(&entry->node);
+			list_prepend(&hba->cache_lru, &entry->node);
+			rule = entry->rule;
+			goto found;
+		}
+		hba->cache_misses++;
+	}
+
+	rule = find_rule(hba, addr, is_tls, dbname, dbnamelen, username, unamelen);
+	if (keylen > 0)
+		cache_store(hba, key, keylen, rule);
+found:
+	if (!rule)
+		return AUTH_REJECT;
+	rule->hit_count++;
+	return rule->rule_method;
+}
+
+void hba_walk_rules(struct HBA *hba, hba_walk_rule_f cb, void *arg)
+{
+	static const char *type_names[] = { "local", "host", "hostssl", "hostnossl" };
+	struct HBARule *rule;
+	struct List *el;
+	char addr[INET6_ADDRSTRLEN + 8];
+	char mask[INET6_ADDRSTRLEN];
+	int bits;
+
+	if (!hba)
+		return;
+
 	list_for_each(el, &hba->rules) {
 		rule = container_of(el, struct HBARule, node);
-
-		/* match address */
-		if (pga_is_unix(addr)) {
-			if (rule->rule_type != RULE_LOCAL)
-				continue;
-		} else if (rule->rule_type == RULE_LOCAL) {
-			continue;
-		} else if (rule->rule_type == RULE_HOSTSSL && !is_tls) {
-			continue;
-		} else if (rule->rule_type == RULE_HOSTNOSSL && is_tls) {
-			continue;
-		} else if (rule->rule_af == AF_INET) {
-			if (!match_inet4(rule, addr))
-				continue;
-		} else if (rule->rule_af == AF_INET6) {
-			if (!match_inet6(rule, addr))
-				continue;
+		if (rule->rule_type == RULE_LOCAL) {
+			addr[0] = '\0';
 		} else {
-			continue;
+			inet_ntop(rule->rule_af, rule->rule_addr, addr, sizeof(addr));
+			bits = mask_prefix_len(rule->rule_mask, rule->rule_af == AF_INET ? 4 : 16);
+			if (bits >= 0) {
+				snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr), "/%d", bits);
+			} else {
+				inet_ntop(rule->rule_af, rule->rule_mask, mask, sizeof(mask));
+				snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr), " %s", mask);
+			}
 		}
-
-		/* match db & user */
-		if (!name_match(&rule->db_name, dbname, dbnamelen, username))
-			continue;
-		if (!name_match(&rule->user_name, username, unamelen, dbname))
-			continue;
-
-		/* rule matches */
-		return rule->rule_method;
+		cb(arg, rule->linenr, type_names[rule->rule_type], addr, rule->rule_method, rule->hit_count);
 	}
-	return AUTH_REJECT;
+}
+
+void hba_cache_info(struct HBA *hba, int *size, int *used, uint64_t *hits, uint64_t *misses)
+{
+	*size = hba && hba->compiled ? HBA_CACHE_SIZE : 0;
+	*used = hba ? hba->cache_used : 0;
+	*hits = hba ? hba->cache_hits : 0;
+	*misses = hba ? hba->cache_misses : 0;
 }
@@ -175,17 +175,12 @@ static void per_loop_activate(PgPool *pool)
 {
 	struct List *item, *tmp;
 	PgSocket *client;
-	int sv_tested, sv_used;
-
-	/* if there is a cancel request waiting, open a new connection */
-	if (!statlist_empty(&pool->cancel_req_list)) {
-		launch_new_connection(pool);
-		return;
-	}
+	int sv_tested, sv_used, sv_login;
 
 	/* see if any server have been freed */
 	sv_tested = statlist_count(&pool->tested_server_list);
 	sv_used = statlist_count(&pool->used_server_list);
+	sv_login = statlist_count(&pool->new_server_list);
 	statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
 		client = container_of(item, PgSocket, head);
 		if (!statlist_empty(&pool->idle_server_list)) {
@@ -205,10 +200,15 @@ static void per_loop_activate(PgPool *pool)
 			/* ask for more connections to be tested */
 			launch_recheck(pool);
 			--sv_used;
+		} else if (sv_login > 0) {
+			/* login in progress will serve it */
+			--sv_login;
 		} else {
-			/* not enough connections */
+			/* not enough connections, stop when no more can be launched */
+			int launching = statlist_count(&pool->new_server_list);
 			launch_new_connection(pool);
-			break;
+			if (statlist_count(&pool->new_server_list) <= launching)
+				break;
 		}
 	}
 }
@@ -299,164 +299,434 @@ static int per_loop_wait_close(PgPool *pool)
 	return count;
 }
 
+/* per_loop_maint() results over all visited pools */
+struct LoopMaint {
+	int active_count;
+	int waiting_count;
+	bool partial_pause;
+	bool partial_wait;
+	bool force_suspend;
+};
+
+static void per_loop_pool(PgPool *pool, struct LoopMaint *lm)
+{
+	switch (cf_pause_mode) {
+	case P_NONE:
+		if (pool->db->db_paused) {
+			lm->partial_pause = true;
+			lm->active_count += per_loop_pause(pool);
+		} else {
+			per_loop_activate(pool);
+		}
+		break;
+	case P_PAUSE:
+		lm->active_count += per_loop_pause(pool);
+		break;
+	case P_SUSPEND:
+		lm->active_count += per_loop_suspend(pool, lm->force_suspend);
+		break;
+	}
+
+	if (pool->db->db_wait_close) {
+		lm->partial_wait = true;
+		lm->waiting_count += per_loop_wait_close(pool);
+	}
+}
+
+/* does the pool need a look on the next loop too */
+static bool pool_still_active(PgPool *pool)
+{
+	if (pool->db->admin)
+		return false;
+	if (pool->db->db_paused)
+		return true;
+	if (pool->db->db_wait_close && per_loop_wait_close(pool) > 0)
+		return true;
+	return !statlist_empty(&pool->waiting_client_list);
+}
+
 /*
  * this function is called for each event loop.
+ *
+ * Without global pause only pools in active_pool_list are visited:
+ * those with waiting clients, and those of paused or WAIT_CLOSE
+ * databases.
  */
 void per_loop_maint(void)
 {
-	struct List *item;
+	struct List *item, *tmp;
 	PgPool *pool;
-	int active_count = 0;
-	int waiting_count = 0;
-	bool partial_pause = false;
-	bool partial_wait = false;
-	bool force_suspend = false;
+	struct LoopMaint lm;
+
+	memset(&lm, 0, sizeof(lm));
 
 	if (cf_pause_mode == P_SUSPEND && cf_suspend_timeout > 0) {
 		usec_t stime = get_cached_time() - g_suspend_start;
 		if (stime >= cf_suspend_timeout)
-			force_suspend = true;
+			lm.force_suspend = true;
 	}
 
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db->admin)
-			continue;
-		switch (cf_pause_mode) {
-		case P_NONE:
-			if (pool->db->db_paused) {
-				partial_pause = true;
-				active_count += per_loop_pause(pool);
-			} else {
-				per_loop_activate(pool);
-			}
-			break;
-		case P_PAUSE:
-			active_count += per_loop_pause(pool);
-			break;
-		case P_SUSPEND:
-			active_count += per_loop_suspend(pool, force_suspend);
-			break;
+	if (cf_pause_mode == P_NONE) {
+		statlist_for_each_safe(item, &active_pool_list, tmp) {
+			pool = container_of(item, PgPool, active_head);
+			if (!pool->db->admin)
+				per_loop_pool(pool, &lm);
+			if (!pool_still_active(pool))
+				statlist_remove(&active_pool_list, &pool->active_head);
 		}
-
-		if (pool->db->db_wait_close) {
-			partial_wait = true;
-			waiting_count += per_loop_wait_close(pool);
+	} else {
+		statlist_for_each(item, &pool_list) {
+			pool = container_of(item, PgPool, head);
+			if (pool->db->admin)
+				continue;
+			per_loop_pool(pool, &lm);
 		}
 	}
 
 	switch (cf_pause_mode) {
 	case P_SUSPEND:
-		if (force_suspend) {
+		if (lm.force_suspend) {
 			close_client_list(&login_client_list, "suspend_timeout");
 		} else {
-			active_count += statlist_count(&login_client_list);
+			lm.active_count += statlist_count(&login_client_list);
 		}
 		/* fallthrough */
 	case P_PAUSE:
-		if (!active_count)
+		if (!lm.active_count)
 			admin_pause_done();
 		break;
 	case P_NONE:
-		if (partial_pause && !active_count)
+		if (lm.partial_pause && !lm.active_count)
 			admin_pause_done();
 		break;
 	}
 
-	if (partial_wait && !waiting_count)
+	if (lm.partial_wait && !lm.waiting_count)
 		admin_wait_close_done();
 }
 
-/* maintaining clients in pool */
-static void pool_client_maint(PgPool *pool)
+/*
+ * Per-socket timeouts.
+ *
+ * Each client and server is armed in a timer wheel with the earliest
+ * moment one of its timeouts could fire.  The timestamps the timeouts
+ * are measured from only move forward, so the deadline is a lower
+ * bound: when it passes, the socket is checked and either acted on or
+ * armed again for the new deadline.  Full maintenance then only visits
+ * sockets whose deadline has passed instead of every socket.
+ */
+static struct TimerWheel socket_timeouts;
+
+/* timeout settings the armed deadlines were computed with */
+static struct {
+	usec_t client_login_timeout;
+	usec_t client_idle_timeout;
+	usec_t query_timeout;
+	usec_t query_wait_timeout;
+	usec_t idle_transaction_timeout;
+	usec_t server_connect_timeout;
+	usec_t server_idle_timeout;
+	usec_t server_lifetime;
+	usec_t server_check_delay;
+	int server_fast_close;
+} armed_settings;
+
+static void min_deadline(usec_t *deadline, usec_t t)
+{
+	if (*deadline == 0 || t < *deadline)
+		*deadline = t;
+}
+
+/* earliest time the socket needs a look, 0 if no timeout applies */
+static usec_t socket_deadline(PgSocket *sk)
+{
+	usec_t deadline = 0;
+	usec_t start;
+
+	if (sk->state != CL_LOGIN && sk->pool && sk->pool->db->admin)
+		return 0;
+
+	switch (sk->state) {
+	case CL_LOGIN:
+		if (cf_client_login_timeout > 0)
+			min_deadline(&deadline, sk->connect_time + cf_client_login_timeout);
+		break;
+	case CL_ACTIVE:
+		if (cf_client_idle_timeout > 0)
+			min_deadline(&deadline, sk->request_time + cf_client_idle_timeout);
+		break;
+	case CL_WAITING:
+	case CL_WAITING_LOGIN:
+		start = sk->query_start ? sk->query_start : sk->request_time;
+		if (cf_query_timeout > 0)
+			min_deadline(&deadline, start + cf_query_timeout);
+		if (cf_query_wait_timeout > 0)
+			min_deadline(&deadline, start + cf_query_wait_timeout);
+		if (cf_client_login_timeout > 0 && sk->wait_for_welcome)
+			min_deadline(&deadline, sk->connect_time + cf_client_login_timeout);
+		break;
+	case SV_LOGIN:
+		if (cf_server_connect_timeout > 0)
+			min_deadline(&deadline, sk->connect_time + cf_server_connect_timeout);
+		break;
+	case SV_IDLE:
+		if (cf_server_check_query && *cf_server_check_query)
+			min_deadline(&deadline, sk->request_time + cf_server_check_delay);
+		/* fallthrough */
+	case SV_USED:
+	case SV_TESTED:
+		if (sk->close_needed || (sk->state != SV_TESTED && !sk->ready))
+			min_deadline(&deadline, get_cached_time());
+		if (cf_server_idle_timeout > 0)
+			min_deadline(&deadline, sk->request_time + cf_server_idle_timeout);
+		min_deadline(&deadline, sk->connect_time + cf_server_lifetime);
+		break;
+	case SV_ACTIVE:
+		if (cf_server_fast_close && sk->close_needed)
+			min_deadline(&deadline, get_cached_time());
+		if (cf_query_timeout > 0 && sk->link)
+			min_deadline(&deadline, sk->link->request_time + cf_query_timeout);
+		if (cf_idle_transaction_timeout > 0)
+			min_deadline(&deadline, sk->request_time + cf_idle_transaction_timeout);
+		break;
+	default:
+		break;
+	}
+	return deadline;
+}
+
+/* (re)compute socket deadline, called on state change */
+void socket_timeout_arm(PgSocket *sk)
+{
+	usec_t deadline;
+
+	/* sockets may be created before janitor_setup() during takeover */
+	if (!socket_timeouts.tick)
+		timerwheel_init(&socket_timeouts, full_maint_period.tv_usec);
+
+	deadline = socket_deadline(sk);
+	if (deadline)
+		timerwheel_add(&socket_timeouts, &sk->timeout, deadline);
+	else
+		timerwheel_remove(&socket_timeouts, &sk->timeout);
+}
+
+static void check_client_timeouts(PgSocket *client)
 {
-	struct List *item, *tmp;
 	usec_t now = get_cached_time();
-	PgSocket *client;
 	usec_t age;
 
-	/* force client_idle_timeout */
-	if (cf_client_idle_timeout > 0) {
-		statlist_for_each_safe(item, &pool->active_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_ACTIVE);
-			if (client->link)
-				continue;
-			if (now - client->request_time > cf_client_idle_timeout)
-				disconnect_client(client, true, "client_idle_timeout");
+	switch (client->state) {
+	case CL_LOGIN:
+		/* client_login_timeout */
+		age = now - client->connect_time;
+		if (cf_client_login_timeout > 0 && age > cf_client_login_timeout)
+			disconnect_client(client, true, "client_login_timeout");
+		break;
+	case CL_ACTIVE:
+		/* force client_idle_timeout */
+		if (client->link)
+			break;
+		if (cf_client_idle_timeout > 0 && now - client->request_time > cf_client_idle_timeout)
+			disconnect_client(client, true, "client_idle_timeout");
+		break;
+	case CL_WAITING:
+	case CL_WAITING_LOGIN:
+		/* force timeouts for waiting queries */
+		if (client->query_start == 0) {
+			age = now - client->request_time;
+		} else {
+			age = now - client->query_start;
 		}
-	}
 
-	/* force timeouts for waiting queries */
-	if (cf_query_timeout > 0 || cf_query_wait_timeout > 0) {
-		statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_WAITING || client->state == CL_WAITING_LOGIN);
-			if (client->query_start == 0) {
-				age = now - client->request_time;
-				/* log_warning("query_start==0"); */
-			} else {
-				age = now - client->query_start;
-			}
-
-			if (cf_query_timeout > 0 && age > cf_query_timeout) {
-				disconnect_client(client, true, "query_timeout");
-			} else if (cf_query_wait_timeout > 0 && age > cf_query_wait_timeout) {
-				disconnect_client(client, true, "query_wait_timeout");
-			}
+		if (cf_query_timeout > 0 && age > cf_query_timeout) {
+			disconnect_client(client, true, "query_timeout");
+			break;
+		} else if (cf_query_wait_timeout > 0 && age > cf_query_wait_timeout) {
+			disconnect_client(client, true, "query_wait_timeout");
+			break;
 		}
-	}
 
-	/* apply client_login_timeout to clients waiting for welcome pkt */
-	if (cf_client_login_timeout > 0 && !pool->welcome_msg_ready) {
-		statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			if (!client->wait_for_welcome)
-				continue;
+		/* apply client_login_timeout to clients waiting for welcome pkt */
+		if (cf_client_login_timeout > 0 && !client->pool->welcome_msg_ready && client->wait_for_welcome) {
 			age = now - client->connect_time;
 			if (age > cf_client_login_timeout)
 				disconnect_client(client, true, "client_login_timeout (server down)");
 		}
+		break;
+	default:
+		break;
 	}
 }
 
-static void check_unused_servers(PgPool *pool, struct StatList *slist, bool idle_test)
+static void check_unused_server(PgSocket *server)
 {
+	PgPool *pool = server->pool;
 	usec_t now = get_cached_time();
-	struct List *item, *tmp;
 	usec_t idle, age;
-	PgSocket *server;
-
-	/* disconnect idle servers if needed */
-	statlist_for_each_safe(item, slist, tmp) {
-		server = container_of(item, PgSocket, head);
 
-		age = now - server->connect_time;
-		idle = now - server->request_time;
-
-		if (server->close_needed) {
-			disconnect_server(server, true, "database configuration changed");
-		} else if (server->state == SV_IDLE && !server->ready) {
-			disconnect_server(server, true, "SV_IDLE server got dirty");
-		} else if (server->state == SV_USED && !server->ready) {
-			disconnect_server(server, true, "SV_USED server got dirty");
-		} else if (cf_server_idle_timeout > 0 && idle > cf_server_idle_timeout
-			   && (pool_min_pool_size(pool) == 0 || pool_connected_server_count(pool) > pool_min_pool_size(pool))) {
-			disconnect_server(server, true, "server idle timeout");
-		} else if (age >= cf_server_lifetime) {
-			if (life_over(server)) {
-				disconnect_server(server, true, "server lifetime over");
-				pool->last_lifetime_disconnect = now;
-			}
-		} else if (cf_pause_mode == P_PAUSE) {
-			disconnect_server(server, true, "pause mode");
-		} else if (idle_test && *cf_server_check_query) {
-			if (idle > cf_server_check_delay)
-				change_server_state(server, SV_USED);
+	age = now - server->connect_time;
+	idle = now - server->request_time;
+
+	if (server->close_needed) {
+		disconnect_server(server, true, "database configuration changed");
+	} else if (server->state == SV_IDLE && !server->ready) {
+		disconnect_server(server, true, "SV_IDLE server got dirty");
+	} else if (server->state == SV_USED && !server->ready) {
+		disconnect_server(server, true, "SV_USED server got dirty");
+	} else if (cf_server_idle_timeout > 0 && idle > cf_server_idle_timeout
+		   && (pool_min_pool_size(pool) == 0 || pool_connected_server_count(pool) > pool_min_pool_size(pool))) {
+		disconnect_server(server, true, "server idle timeout");
+	} else if (age >= cf_server_lifetime) {
+		if (life_over(server)) {
+			disconnect_server(server, true, "server lifetime over");
+			pool->last_lifetime_disconnect = now;
 		}
+	} else if (cf_pause_mode == P_PAUSE) {
+		disconnect_server(server, true, "pause mode");
+	} else if (server->state == SV_IDLE && *cf_server_check_query) {
+		if (idle > cf_server_check_delay)
+			change_server_state(server, SV_USED);
 	}
 }
 
+static void check_active_server(PgSocket *server)
+{
+	usec_t now = get_cached_time();
+	usec_t age_client, age_server;
+
+	/* disconnect close_needed active servers if server_fast_close is set */
+	if (cf_server_fast_close && server->ready && server->close_needed) {
+		disconnect_server(server, true, "database configuration changed");
+		return;
+	}
+
+	/* handle query_timeout and idle_transaction_timeout */
+	if (server->ready)
+		return;
+
+	/*
+	 * Note the different age calculations:
+	 * query_timeout counts from the last request
+	 * of the client (the client started the
+	 * query), idle_transaction_timeout counts
+	 * from the last request of the server (the
+	 * server sent the idle information).
+	 */
+	age_client = now - server->link->request_time;
+	age_server = now - server->request_time;
+
+	if (cf_query_timeout > 0 && age_client > cf_query_timeout) {
+		disconnect_server(server, true, "query timeout");
+	} else if (cf_idle_transaction_timeout > 0 &&
+		   server->idle_tx &&
+		   age_server > cf_idle_transaction_timeout)
+	{
+		disconnect_server(server, true, "idle transaction timeout");
+	}
+}
+
+static void check_server_timeouts(PgSocket *server)
+{
+	usec_t now = get_cached_time();
+
+	switch (server->state) {
+	case SV_IDLE:
+	case SV_USED:
+	case SV_TESTED:
+		/* find and disconnect idle servers */
+		check_unused_server(server);
+		break;
+	case SV_ACTIVE:
+		check_active_server(server);
+		break;
+	case SV_LOGIN:
+		/* find connections that got connect, but could not log in */
+		if (cf_server_connect_timeout > 0 && now - server->connect_time > cf_server_connect_timeout)
+			disconnect_server(server, true, "connect timeout");
+		break;
+	default:
+		break;
+	}
+}
+
+static void socket_timeout(struct TimerWheelNode *node)
+{
+	PgSocket *sk = container_of(node, PgSocket, timeout);
+	usec_t deadline, next;
+
+	if (is_server_socket(sk))
+		check_server_timeouts(sk);
+	else
+		check_client_timeouts(sk);
+
+	/* a state change has re-armed it already */
+	if (timerwheel_node_armed(&sk->timeout))
+		return;
+
+	/* nothing fired, look again when the new deadline passes */
+	deadline = socket_deadline(sk);
+	if (!deadline)
+		return;
+	next = get_cached_time() + socket_timeouts.tick;
+	timerwheel_add(&socket_timeouts, &sk->timeout, deadline > next ? deadline : next);
+}
+
+static void rearm_socket_list(struct StatList *list)
+{
+	struct List *item;
+	PgSocket *sk;
+
+	statlist_for_each(item, list) {
+		sk = container_of(item, PgSocket, head);
+		socket_timeout_arm(sk);
+	}
+}
+
+/* settings changed by RELOAD or SET, recompute all deadlines */
+static void rearm_socket_timeouts(void)
+{
+	struct List *item;
+	PgPool *pool;
+
+	armed_settings.client_login_timeout = cf_client_login_timeout;
+	armed_settings.client_idle_timeout = cf_client_idle_timeout;
+	armed_settings.query_timeout = cf_query_timeout;
+	armed_settings.query_wait_timeout = cf_query_wait_timeout;
+	armed_settings.idle_transaction_timeout = cf_idle_transaction_timeout;
+	armed_settings.server_connect_timeout = cf_server_connect_timeout;
+	armed_settings.server_idle_timeout = cf_server_idle_timeout;
+	armed_settings.server_lifetime = cf_server_lifetime;
+	armed_settings.server_check_delay = cf_server_check_delay;
+	armed_settings.server_fast_close = cf_server_fast_close;
+
+	rearm_socket_list(&login_client_list);
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		rearm_socket_list(&pool->active_client_list);
+		rearm_socket_list(&pool->waiting_client_list);
+		rearm_socket_list(&pool->active_server_list);
+		rearm_socket_list(&pool->idle_server_list);
+		rearm_socket_list(&pool->used_server_list);
+		rearm_socket_list(&pool->tested_server_list);
+		rearm_socket_list(&pool->new_server_list);
+	}
+}
+
+static bool timeout_settings_changed(void)
+{
+	return armed_settings.client_login_timeout != cf_client_login_timeout
+	    || armed_settings.client_idle_timeout != cf_client_idle_timeout
+	    || armed_settings.query_timeout != cf_query_timeout
+	    || armed_settings.query_wait_timeout != cf_query_wait_timeout
+	    || armed_settings.idle_transaction_timeout != cf_idle_transaction_timeout
+	    || armed_settings.server_connect_timeout != cf_server_connect_timeout
+	    || armed_settings.server_idle_timeout != cf_server_idle_timeout
+	    || armed_settings.server_lifetime != cf_server_lifetime
+	    || armed_settings.server_check_delay != cf_server_check_delay
+	    || armed_settings.server_fast_close != cf_server_fast_close;
+}
+
 /*
  * Check pool size, close conns if too many.  Makes pooler
  * react faster to the case when admin decreased pool size.
@@ -492,95 +762,6 @@ static void check_pool_size(PgPool *pool)
 	}
 }
 
-/* maintain servers in a pool */
-static void pool_server_maint(PgPool *pool)
-{
-	struct List *item, *tmp;
-	usec_t now = get_cached_time();
-	PgSocket *server;
-
-	/* find and disconnect idle servers */
-	check_unused_servers(pool, &pool->used_server_list, 0);
-	check_unused_servers(pool, &pool->tested_server_list, 0);
-	check_unused_servers(pool, &pool->idle_server_list, 1);
-
-	/* disconnect close_needed active servers if server_fast_close is set */
-	if (cf_server_fast_close) {
-		statlist_for_each_safe(item, &pool->active_server_list, tmp) {
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_ACTIVE);
-			if (server->ready && server->close_needed)
-				disconnect_server(server, true, "database configuration changed");
-		}
-	}
-
-	/* handle query_timeout and idle_transaction_timeout */
-	if (cf_query_timeout > 0 || cf_idle_transaction_timeout > 0) {
-		statlist_for_each_safe(item, &pool->active_server_list, tmp) {
-			usec_t age_client, age_server;
-
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_ACTIVE);
-			if (server->ready)
-				continue;
-
-			/*
-			 * Note the different age calculations:
-			 * query_timeout counts from the last request
-			 * of the client (the client started the
-			 * query), idle_transaction_timeout counts
-			 * from the last request of the server (the
-			 * server sent the idle information).
-			 */
-			age_client = now - server->link->request_time;
-			age_server = now - server->request_time;
-
-			if (cf_query_timeout > 0 && age_client > cf_query_timeout) {
-				disconnect_server(server, true, "query timeout");
-			} else if (cf_idle_transaction_timeout > 0 &&
-				   server->idle_tx &&
-				   age_server > cf_idle_transaction_timeout)
-			{
-				disconnect_server(server, true, "idle transaction timeout");
-			}
-		}
-	}
-
-	/* find connections that got connect, but could not log in */
-	if (cf_server_connect_timeout > 0) {
-		statlist_for_each_safe(item, &pool->new_server_list, tmp) {
-			usec_t age;
-
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_LOGIN);
-
-			age = now - server->connect_time;
-			if (age > cf_server_connect_timeout)
-				disconnect_server(server, true, "connect timeout");
-		}
-	}
-
-	check_pool_size(pool);
-}
-
-static void cleanup_client_logins(void)
-{
-	struct List *item, *tmp;
-	PgSocket *client;
-	usec_t age;
-	usec_t now = get_cached_time();
-
-	if (cf_client_login_timeout <= 0)
-		return;
-
-	statlist_for_each_safe(item, &login_client_list, tmp) {
-		client = container_of(item, PgSocket, head);
-		age = now - client->connect_time;
-		if (age > cf_client_login_timeout)
-			disconnect_client(client, true, "client_login_timeout");
-	}
-}
-
 static void cleanup_inactive_autodatabases(void)
 {
 	struct List *item, *tmp;
@@ -606,7 +787,7 @@ static void cleanup_inactive_autodatabases(void)
 }
 
 /* full-scale maintenance, done only occasionally */
-static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
+static void full_maint(void)
 {
 	struct List *item, *tmp;
 	PgPool *pool;
@@ -621,12 +802,15 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 	if (cf_pause_mode == P_SUSPEND)
 		return;
 
+	if (timeout_settings_changed())
+		rearm_socket_timeouts();
+	timerwheel_expire(&socket_timeouts, get_cached_time(), socket_timeout);
+
 	statlist_for_each_safe(item, &pool_list, tmp) {
 		pool = container_of(item, PgPool, head);
 		if (pool->db->admin)
 			continue;
-		pool_server_maint(pool);
-		pool_client_maint(pool);
+		check_pool_size(pool);
 
 		/* is autodb active? */
 		if (pool->db->db_auto && pool->db->inactive_time == 0) {
@@ -642,6 +826,7 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 			if (db->active_stamp == seq)
 				continue;
 			db->inactive_time = get_cached_time();
+			metrics_forget(&db->head);
 			statlist_remove(&database_list, &db->head);
 			statlist_append(&autodatabase_idle_list, &db->head);
 		}
@@ -649,8 +834,6 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 
 	cleanup_inactive_autodatabases();
 
-	cleanup_client_logins();
-
 	if (cf_shutdown == 1 && get_active_server_count() == 0) {
 		log_info("server connections dropped, exiting");
 		cf_shutdown = 2;
@@ -661,9 +844,22 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 	adns_zone_cache_maint(adns);
 }
 
+static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
+{
+	usec_t start;
+
+	loop_stats_wake();
+	start = get_time_usec();
+	full_maint();
+	loop_stats_record(LOOP_JANITOR, get_time_usec() - start);
+}
+
 /* first-time initialization */
 void janitor_setup(void)
 {
+	if (!socket_timeouts.tick)
+		timerwheel_init(&socket_timeouts, full_maint_period.tv_usec);
+
 	/* launch maintenance */
 	event_assign(&full_maint_ev, pgb_event_base, -1, EV_PERSIST, do_full_maint, NULL);
 	event_add(&full_maint_ev, &full_maint_period);
@@ -686,8 +882,14 @@ void kill_pool(PgPool *pool)
 	pktbuf_free(pool->welcome_msg);
 
 	list_del(&pool->map_head);
+	list_del(&pool->db_head);
+	if (!list_empty(&pool->active_head))
+		statlist_remove(&active_pool_list, &pool->active_head);
+	hashindex_remove(&pool_index, &pool->hash_head);
+	metrics_forget(&pool->head);
 	statlist_remove(&pool_list, &pool->head);
 	varcache_clean(&pool->orig_vars);
+	stats_free_latency(pool);
 	slab_free(pool_cache, pool);
 }
 
@@ -698,10 +900,9 @@ void kill_database(PgDatabase *db)
 
 	log_warning("dropping database '%s' as it does not exist anymore or inactive auto-database", db->name);
 
-	statlist_for_each_safe(item, &pool_list, tmp) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db == db)
-			kill_pool(pool);
+	list_for_each_safe(item, &db->pool_list, tmp) {
+		pool = container_of(item, PgPool, db_head);
+		kill_pool(pool);
 	}
 
 	aatree_destroy(&db->user_passwds);
@@ -711,9 +912,12 @@ void kill_database(PgDatabase *db)
 	if (db->forced_user)
 		slab_free(user_cache, db->forced_user);
 	free(db->connect_query);
+	query_stats_free(db);
+	hashindex_remove(&database_index, &db->hash_head);
 	if (db->inactive_time) {
 		statlist_remove(&autodatabase_idle_list, &db->head);
 	} else {
+		metrics_forget(&db->head);
 		statlist_remove(&database_list, &db->head);
 	}
 	slab_free(db_cache, db);
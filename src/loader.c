@@ -159,6 +159,8 @@ bool parse_database(void *base, const char *name, const char *connstr)
 	int min_pool_size = -1;
 	int res_pool_size = -1;
 	int max_db_connections = -1;
+	int max_concurrent_logins = -1;
+	int connect_rate = -1;
 	int dbname_ofs;
 	int pool_mode = POOL_INHERIT;
 
@@ -237,6 +239,10 @@ bool parse_database(void *base, const char *name, const char *connstr)
 			res_pool_size = atoi(val);
 		} else if (strcmp("max_db_connections", key) == 0) {
 			max_db_connections = atoi(val);
+		} else if (strcmp("max_concurrent_logins", key) == 0) {
+			max_concurrent_logins = atoi(val);
+		} else if (strcmp("server_connect_rate", key) == 0) {
+			connect_rate = atoi(val);
 		} else if (strcmp("pool_mode", key) == 0) {
 			if (!cf_set_lookup(&cv, val)) {
 				log_error("invalid pool mode: %s", val);
@@ -300,6 +306,8 @@ bool parse_database(void *base, const char *name, const char *connstr)
 	db->res_pool_size = res_pool_size;
 	db->pool_mode = pool_mode;
 	db->max_db_connections = max_db_connections;
+	db->max_concurrent_logins = max_concurrent_logins;
+	db->connect_rate = connect_rate;
 	free(db->connect_query);
 	db->connect_query = connect_query;
 
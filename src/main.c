@@ -93,9 +93,12 @@ char *cf_unix_socket_group;
 
 int cf_pool_mode = POOL_SESSION;
 
+static char *cf_event_backend;
+
 /* sbuf config */
 int cf_sbuf_len;
 int cf_sbuf_loopcnt;
+int cf_splice_threshold;
 int cf_so_reuseport;
 int cf_tcp_socket_buffer;
 int cf_tcp_defer_accept;
@@ -115,6 +118,9 @@ char *cf_auth_file;
 char *cf_auth_hba_file;
 char *cf_auth_user;
 char *cf_auth_query;
+int cf_scram_key_cache_size;
+int cf_pam_workers;
+usec_t cf_pam_cache_ttl;
 
 int cf_max_client_conn;
 int cf_default_pool_size;
@@ -147,6 +153,11 @@ usec_t cf_server_lifetime;
 usec_t cf_server_idle_timeout;
 usec_t cf_server_connect_timeout;
 usec_t cf_server_login_retry;
+usec_t cf_server_login_retry_max;
+int cf_max_concurrent_logins;
+int cf_max_cancel_connections;
+int cf_server_connect_rate;
+int cf_server_connect_burst;
 usec_t cf_query_timeout;
 usec_t cf_query_wait_timeout;
 usec_t cf_client_idle_timeout;
@@ -177,6 +188,10 @@ char *cf_client_tls_key_file;
 char *cf_client_tls_ciphers;
 char *cf_client_tls_dheparams;
 char *cf_client_tls_ecdhecurve;
+int cf_client_tls_ktls;
+int cf_client_tls_session_tickets;
+int cf_client_tls_session_cache_size;
+usec_t cf_client_tls_session_lifetime;
 
 int cf_server_tls_sslmode;
 char *cf_server_tls_protocols;
@@ -184,6 +199,8 @@ char *cf_server_tls_ca_file;
 char *cf_server_tls_cert_file;
 char *cf_server_tls_key_file;
 char *cf_server_tls_ciphers;
+int cf_server_tls_ktls;
+int cf_server_tls_session_cache;
 
 /*
  * config file description
@@ -232,6 +249,7 @@ CF_ABS("application_name_add_host", CF_INT, cf_application_name_add_host, 0, "0"
 CF_ABS("auth_file", CF_STR, cf_auth_file, 0, NULL),
 CF_ABS("auth_hba_file", CF_STR, cf_auth_hba_file, 0, ""),
 CF_ABS("auth_query", CF_STR, cf_auth_query, 0, "SELECT usename, passwd FROM pg_shadow WHERE usename=$1"),
+CF_ABS("auth_threads", CF_INT, cf_auth_threads, CF_NO_RELOAD, "0"),
 CF_ABS("auth_type", CF_LOOKUP(auth_type_map), cf_auth_type, 0, "md5"),
 CF_ABS("auth_user", CF_STR, cf_auth_user, 0, NULL),
 CF_ABS("autodb_idle_timeout", CF_TIME_USEC, cf_autodb_idle_timeout, 0, "3600"),
@@ -243,7 +261,11 @@ CF_ABS("client_tls_ciphers", CF_STR, cf_client_tls_ciphers, 0, "fast"),
 CF_ABS("client_tls_dheparams", CF_STR, cf_client_tls_dheparams, 0, "auto"),
 CF_ABS("client_tls_ecdhcurve", CF_STR, cf_client_tls_ecdhecurve, 0, "auto"),
 CF_ABS("client_tls_key_file", CF_STR, cf_client_tls_key_file, 0, ""),
+CF_ABS("client_tls_ktls", CF_INT, cf_client_tls_ktls, 0, "0"),
 CF_ABS("client_tls_protocols", CF_STR, cf_client_tls_protocols, 0, "secure"),
+CF_ABS("client_tls_session_cache_size", CF_INT, cf_client_tls_session_cache_size, 0, "0"),
+CF_ABS("client_tls_session_lifetime", CF_TIME_USEC, cf_client_tls_session_lifetime, 0, "7200"),
+CF_ABS("client_tls_session_tickets", CF_INT, cf_client_tls_session_tickets, 0, "0"),
 CF_ABS("client_tls_sslmode", CF_LOOKUP(sslmode_map), cf_client_tls_sslmode, 0, "disable"),
 CF_ABS("conffile", CF_STR, cf_config_file, 0, NULL),
 CF_ABS("default_pool_size", CF_INT, cf_default_pool_size, 0, "20"),
@@ -251,6 +273,7 @@ CF_ABS("disable_pqexec", CF_INT, cf_disable_pqexec, CF_NO_RELOAD, "0"),
 CF_ABS("dns_max_ttl", CF_TIME_USEC, cf_dns_max_ttl, 0, "15"),
 CF_ABS("dns_nxdomain_ttl", CF_TIME_USEC, cf_dns_nxdomain_ttl, 0, "15"),
 CF_ABS("dns_zone_check_period", CF_TIME_USEC, cf_dns_zone_check_period, 0, "0"),
+CF_ABS("event_backend", CF_STR, cf_event_backend, CF_NO_RELOAD, "auto"),
 CF_ABS("idle_transaction_timeout", CF_TIME_USEC, cf_idle_transaction_timeout, 0, "0"),
 CF_ABS("ignore_startup_parameters", CF_STR, cf_ignore_startup_params, 0, ""),
 CF_ABS("job_name", CF_STR, cf_jobname, CF_NO_RELOAD, "pgbouncer"),
@@ -262,27 +285,39 @@ CF_ABS("log_disconnections", CF_INT, cf_log_disconnections, 0, "1"),
 CF_ABS("log_pooler_errors", CF_INT, cf_log_pooler_errors, 0, "1"),
 CF_ABS("log_stats", CF_INT, cf_log_stats, 0, "1"),
 CF_ABS("logfile", CF_STR, cf_logfile, 0, ""),
+CF_ABS("max_cancel_connections", CF_INT, cf_max_cancel_connections, 0, "10"),
 CF_ABS("max_client_conn", CF_INT, cf_max_client_conn, 0, "100"),
+CF_ABS("max_concurrent_logins", CF_INT, cf_max_concurrent_logins, 0, "1"),
 CF_ABS("max_db_connections", CF_INT, cf_max_db_connections, 0, "0"),
 CF_ABS("max_packet_size", CF_UINT, cf_max_packet_size, 0, "2147483647"),
+CF_ABS("max_prepared_statements", CF_INT, cf_max_prepared_statements, 0, "0"),
 CF_ABS("max_user_connections", CF_INT, cf_max_user_connections, 0, "0"),
+CF_ABS("metrics_listen_addr", CF_STR, cf_metrics_listen_addr, CF_NO_RELOAD, ""),
+CF_ABS("metrics_port", CF_INT, cf_metrics_port, CF_NO_RELOAD, "9127"),
 CF_ABS("min_pool_size", CF_INT, cf_min_pool_size, 0, "0"),
+CF_ABS("pam_cache_ttl", CF_TIME_USEC, cf_pam_cache_ttl, 0, "0"),
+CF_ABS("pam_workers", CF_INT, cf_pam_workers, CF_NO_RELOAD, "1"),
 CF_ABS("pidfile", CF_STR, cf_pidfile, CF_NO_RELOAD, ""),
 CF_ABS("pkt_buf", CF_INT, cf_sbuf_len, CF_NO_RELOAD, "4096"),
 CF_ABS("pool_mode", CF_LOOKUP(pool_mode_map), cf_pool_mode, 0, "session"),
 CF_ABS("query_timeout", CF_TIME_USEC, cf_query_timeout, 0, "0"),
+CF_ABS("query_stats_size", CF_INT, cf_query_stats_size, 0, "0"),
 CF_ABS("query_wait_timeout", CF_TIME_USEC, cf_query_wait_timeout, 0, "120"),
 CF_ABS("reserve_pool_size", CF_INT, cf_res_pool_size, 0, "0"),
 CF_ABS("reserve_pool_timeout", CF_TIME_USEC, cf_res_pool_timeout, 0, "5"),
 CF_ABS("resolv_conf", CF_STR, cf_resolv_conf, CF_NO_RELOAD, ""),
 CF_ABS("sbuf_loopcnt", CF_INT, cf_sbuf_loopcnt, 0, "5"),
+CF_ABS("scram_key_cache_size", CF_INT, cf_scram_key_cache_size, 0, "1000"),
 CF_ABS("server_check_delay", CF_TIME_USEC, cf_server_check_delay, 0, "30"),
 CF_ABS("server_check_query", CF_STR, cf_server_check_query, 0, "select 1"),
+CF_ABS("server_connect_burst", CF_INT, cf_server_connect_burst, 0, "0"),
+CF_ABS("server_connect_rate", CF_INT, cf_server_connect_rate, 0, "0"),
 CF_ABS("server_connect_timeout", CF_TIME_USEC, cf_server_connect_timeout, 0, "15"),
 CF_ABS("server_fast_close", CF_INT, cf_server_fast_close, 0, "0"),
 CF_ABS("server_idle_timeout", CF_TIME_USEC, cf_server_idle_timeout, 0, "600"),
 CF_ABS("server_lifetime", CF_TIME_USEC, cf_server_lifetime, 0, "3600"),
 CF_ABS("server_login_retry", CF_TIME_USEC, cf_server_login_retry, 0, "15"),
+CF_ABS("server_login_retry_max", CF_TIME_USEC, cf_server_login_retry_max, 0, "0"),
 CF_ABS("server_reset_query", CF_STR, cf_server_reset_query, 0, "DISCARD ALL"),
 CF_ABS("server_reset_query_always", CF_INT, cf_server_reset_query_always, 0, "0"),
 CF_ABS("server_round_robin", CF_INT, cf_server_round_robin, 0, "0"),
@@ -290,12 +325,15 @@ CF_ABS("server_tls_ca_file", CF_STR, cf_server_tls_ca_file, 0, ""),
 CF_ABS("server_tls_cert_file", CF_STR, cf_server_tls_cert_file, 0, ""),
 CF_ABS("server_tls_ciphers", CF_STR, cf_server_tls_ciphers, 0, "fast"),
 CF_ABS("server_tls_key_file", CF_STR, cf_server_tls_key_file, 0, ""),
+CF_ABS("server_tls_ktls", CF_INT, cf_server_tls_ktls, 0, "0"),
 CF_ABS("server_tls_protocols", CF_STR, cf_server_tls_protocols, 0, "secure"),
+CF_ABS("server_tls_session_cache", CF_INT, cf_server_tls_session_cache, 0, "0"),
 CF_ABS("server_tls_sslmode", CF_LOOKUP(sslmode_map), cf_server_tls_sslmode, 0, "disable"),
 #ifdef WIN32
 CF_ABS("service_name", CF_STR, cf_jobname, CF_NO_RELOAD, NULL), /* alias for job_name */
 #endif
 CF_ABS("so_reuseport", CF_INT, cf_so_reuseport, CF_NO_RELOAD, "0"),
+CF_ABS("splice_threshold", CF_INT, cf_splice_threshold, 0, "0"),
 CF_ABS("stats_period", CF_INT, cf_stats_period, 0, "60"),
 CF_ABS("stats_users", CF_STR, cf_stats_users, 0, ""),
 CF_ABS("suspend_timeout", CF_TIME_USEC, cf_suspend_timeout, 0, "10"),
@@ -318,6 +356,9 @@ CF_ABS("unix_socket_mode", CF_INT, cf_unix_socket_mode, CF_NO_RELOAD, "0777"),
 CF_ABS("user", CF_STR, cf_username, CF_NO_RELOAD, NULL),
 #endif
 CF_ABS("verbose", CF_INT, cf_verbose, 0, NULL),
+#ifndef WIN32
+CF_ABS("workers", CF_INT, cf_workers, CF_NO_RELOAD, "1"),
+#endif
 
 {NULL}
 };
@@ -450,6 +491,7 @@ static struct event ev_sigint;
 static void handle_sigterm(evutil_socket_t sock, short flags, void *arg)
 {
 	log_info("got SIGTERM, fast exit");
+	workers_signal(SIGTERM);
 	/* pidfile cleanup happens via atexit() */
 	exit(1);
 }
@@ -457,6 +499,7 @@ static void handle_sigterm(evutil_socket_t sock, short flags, void *arg)
 static void handle_sigint(evutil_socket_t sock, short flags, void *arg)
 {
 	log_info("got SIGINT, shutting down");
+	workers_signal(SIGINT);
 	sd_notify(0, "STOPPING=1");
 	if (cf_reboot)
 		die("takeover was in progress, going down immediately");
@@ -472,8 +515,11 @@ static struct event ev_sigusr1;
 static struct event ev_sigusr2;
 static struct event ev_sighup;
 
+static struct event ev_sigchld;
+
 static void handle_sigusr1(int sock, short flags, void *arg)
 {
+	workers_signal(SIGUSR1);
 	if (cf_pause_mode == P_NONE) {
 		log_info("got SIGUSR1, pausing all activity");
 		cf_pause_mode = P_PAUSE;
@@ -484,6 +530,7 @@ static void handle_sigusr1(int sock, short flags, void *arg)
 
 static void handle_sigusr2(int sock, short flags, void *arg)
 {
+	workers_signal(SIGUSR2);
 	switch (cf_pause_mode) {
 	case P_SUSPEND:
 		log_info("got SIGUSR2, continuing from SUSPEND");
@@ -508,12 +555,18 @@ static void handle_sigusr2(int sock, short flags, void *arg)
 static void handle_sighup(int sock, short flags, void *arg)
 {
 	log_info("got SIGHUP, re-reading config");
+	workers_signal(SIGHUP);
 	sd_notify(0, "RELOADING=1");
 	load_config();
 	if (!sbuf_tls_setup())
 		log_error("TLS configuration could not be reloaded, keeping old configuration");
 	sd_notify(0, "READY=1");
 }
+
+static void handle_sigchld(int sock, short flags, void *arg)
+{
+	workers_reap();
+}
 #endif
 
 static void signal_setup(void)
@@ -546,6 +599,13 @@ static void signal_setup(void)
 	err = evsignal_add(&ev_sighup, NULL);
 	if (err < 0)
 		fatal_perror("evsignal_add");
+
+	if (workers_enabled() && worker_id == 0) {
+		evsignal_assign(&ev_sigchld, pgb_event_base, SIGCHLD, handle_sigchld, NULL);
+		err = evsignal_add(&ev_sigchld, NULL);
+		if (err < 0)
+			fatal_perror("evsignal_add");
+	}
 #endif
 	evsignal_assign(&ev_sigterm, pgb_event_base, SIGTERM, handle_sigterm, NULL);
 	err = evsignal_add(&ev_sigterm, NULL);
@@ -743,25 +803,81 @@ static bool check_old_process_unix(void)
 	return true;
 }
 
+/*
+ * Create a libevent base using the method from event_backend.
+ * epoll_changelist is epoll with EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST:
+ * event changes are collected and applied once per loop iteration,
+ * so a socket switching between waiting for reads and writes in one
+ * iteration costs one epoll_ctl() or none instead of two.  io_uring
+ * waits with epoll, sbuf_uring_setup() sets up the rest.
+ */
+static struct event_base *create_event_base(void)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	const char **methods;
+	const char *method = cf_event_backend;
+	bool found = false;
+	int i;
+
+	cfg = event_config_new();
+	if (!cfg)
+		return NULL;
+
+	if (strcmp(method, "epoll_changelist") == 0) {
+		method = "epoll";
+		event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	} else if (strcmp(method, "io_uring") == 0) {
+		method = "epoll";
+	}
+
+	if (strcmp(method, "auto") != 0) {
+		methods = event_get_supported_methods();
+		for (i = 0; methods && methods[i]; i++) {
+			if (strcmp(methods[i], method) == 0)
+				found = true;
+			else
+				event_config_avoid_method(cfg, methods[i]);
+		}
+		if (!found)
+			die("event_backend %s is not supported by libevent", cf_event_backend);
+	}
+
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	return base;
+}
+
 static void main_loop_once(void)
 {
 	int err;
 
 	reset_time_cache();
+	loop_stats_begin();
 
-	err = event_base_loop(pgb_event_base, EVLOOP_ONCE);
+	/* do not wait if io_uring calls were left over */
+	err = event_base_loop(pgb_event_base, sbuf_uring_pending() ? EVLOOP_NONBLOCK : EVLOOP_ONCE);
+	sbuf_uring_flush();
+	loop_stats_dispatched();
 	if (err < 0) {
 		if (errno != EINTR)
 			log_warning("event_loop failed: %s", strerror(errno));
 	}
 	pam_poll();
+	loop_stats_phase(LOOP_PAM);
 	per_loop_maint();
+	loop_stats_phase(LOOP_MAINT);
 	reuse_just_freed_objects();
+	loop_stats_phase(LOOP_REUSE);
 	rescue_timers();
+	loop_stats_phase(LOOP_TIMERS);
 	per_loop_pooler_maint();
+	loop_stats_phase(LOOP_POOLER);
 
 	if (adns)
 		adns_per_loop(adns);
+	loop_stats_phase(LOOP_DNS);
+	loop_stats_end();
 }
 
 static void takeover_part1(void)
@@ -770,7 +886,9 @@ static void takeover_part1(void)
 	struct event_base *evtmp;
 
 	evtmp = pgb_event_base;
-	pgb_event_base = event_base_new();
+	pgb_event_base = create_event_base();
+	if (!pgb_event_base)
+		die("event base setup failed");
 
 	if (!cf_unix_socket_dir || !*cf_unix_socket_dir)
 		die("cannot reboot if unix dir not configured");
@@ -818,6 +936,7 @@ static void cleanup(void)
 	adns = NULL;
 
 	admin_cleanup();
+	metrics_cleanup();
 	objects_cleanup();
 	sbuf_cleanup();
 
@@ -832,6 +951,8 @@ static void cleanup(void)
 	xfree(&cf_username);
 	xfree(&cf_config_file);
 	xfree(&cf_listen_addr);
+	xfree(&cf_event_backend);
+	xfree(&cf_metrics_listen_addr);
 	xfree(&cf_unix_socket_dir);
 	xfree(&cf_unix_socket_group);
 	xfree(&cf_auth_file);
@@ -990,24 +1111,32 @@ int main(int argc, char *argv[])
 	 * go_daemon() so that output goes to log file */
 	check_limits();
 
+	/* fork workers before any event base or thread exists */
+	workers_setup();
+
 	/* initialize subsystems, order important */
 	srandom(time(NULL) ^ getpid());
-	if (!(pgb_event_base = event_base_new()))
-		die("event_base_new() failed");
+	if (!(pgb_event_base = create_event_base()))
+		die("event base setup failed");
+	if (strcmp(cf_event_backend, "io_uring") == 0 && !sbuf_uring_setup())
+		die("event_backend io_uring is not available");
 	dns_setup();
 	signal_setup();
 	janitor_setup();
 	stats_setup();
 
 	pam_init();
+	authpool_setup();
 
 	if (did_takeover) {
 		takeover_finish();
 	} else {
 		pooler_setup();
 	}
+	metrics_setup();
 
-	write_pidfile();
+	if (worker_id == 0)
+		write_pidfile();
 
 	log_info("process up: %s, libevent %s (%s), adns: %s, tls: %s", PACKAGE_STRING,
 		 event_get_version(), event_base_get_method(pgb_event_base), adns_get_backend(),
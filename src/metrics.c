@@ -0,0 +1,802 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Metrics in OpenMetrics text format over plain HTTP.
+ *
+ * The listener is served from the main event loop.  The response is
+ * produced row by row into a fixed buffer of the connection each time
+ * the socket becomes writable, so a scrape of many pools neither builds
+ * the whole response in memory nor holds up the loop for long.
+ *
+ * Between two buffers the connection keeps a cursor into the database
+ * or pool list, metrics_forget() moves it along when the element under
+ * it leaves the list.
+ */
+
+#include "bouncer.h"
+
+#include <usual/netdb.h>
+#include <usual/safeio.h>
+#include <usual/slab.h>
+
+char *cf_metrics_listen_addr;
+int cf_metrics_port;
+
+#define METRICS_MAX_CONNS	8
+#define METRICS_BUF_SIZE	16384
+#define METRICS_ROW_MAX		1024	/* a sample with escaped names fits */
+#define METRICS_REQ_MAX		2048
+#define METRICS_MAX_SLABS	64
+#define METRICS_BUFS_PER_CALL	4	/* then let other events run */
+
+enum MetricSource {
+	SRC_GLOBAL,
+	SRC_DATABASE,
+	SRC_POOL,
+	SRC_USER,
+	SRC_SLAB,
+};
+
+enum MetricId {
+	M_BUILD,
+	M_DATABASES,
+	M_USERS,
+	M_POOLS,
+	M_CLIENTS_USED,
+	M_CLIENTS_LOGIN,
+	M_SERVERS_USED,
+	M_DB_POOL_SIZE,
+	M_DB_MAX_CONN,
+	M_DB_CUR_CONN,
+	M_DB_PAUSED,
+	M_DB_DISABLED,
+	M_POOL_CL_ACTIVE,
+	M_POOL_CL_WAITING,
+	M_POOL_CL_CANCEL,
+	M_POOL_SV_ACTIVE,
+	M_POOL_SV_IDLE,
+	M_POOL_SV_USED,
+	M_POOL_SV_TESTED,
+	M_POOL_SV_LOGIN,
+	M_POOL_MAXWAIT,
+	M_POOL_XACTS,
+	M_POOL_QUERIES,
+	M_POOL_RECEIVED,
+	M_POOL_SENT,
+	M_POOL_XACT_TIME,
+	M_POOL_QUERY_TIME,
+	M_POOL_WAIT_TIME,
+	M_USER_CUR_CONN,
+	M_USER_MAX_CONN,
+	M_SLAB_USED,
+	M_SLAB_FREE,
+	M_SLAB_BYTES,
+};
+
+struct MetricFamily {
+	enum MetricId id;
+	enum MetricSource source;
+	const char *name;
+	const char *type;
+	const char *help;
+	bool seconds;		/* value is in usec, written as seconds */
+};
+
+static const struct MetricFamily families[] = {
+	{ M_BUILD, SRC_GLOBAL, "pgbouncer_build", "info", "Version of pgbouncer", false },
+	{ M_DATABASES, SRC_GLOBAL, "pgbouncer_databases", "gauge", "Configured databases", false },
+	{ M_USERS, SRC_GLOBAL, "pgbouncer_users", "gauge", "Known users", false },
+	{ M_POOLS, SRC_GLOBAL, "pgbouncer_pools", "gauge", "Pools", false },
+	{ M_CLIENTS_USED, SRC_GLOBAL, "pgbouncer_clients", "gauge", "Client connections", false },
+	{ M_CLIENTS_LOGIN, SRC_GLOBAL, "pgbouncer_login_clients", "gauge", "Clients in login phase", false },
+	{ M_SERVERS_USED, SRC_GLOBAL, "pgbouncer_servers", "gauge", "Server connections", false },
+
+	{ M_DB_POOL_SIZE, SRC_DATABASE, "pgbouncer_database_pool_size", "gauge", "Maximum server connections per pool", false },
+	{ M_DB_MAX_CONN, SRC_DATABASE, "pgbouncer_database_max_connections", "gauge", "Maximum server connections of the database, 0 is unlimited", false },
+	{ M_DB_CUR_CONN, SRC_DATABASE, "pgbouncer_database_current_connections", "gauge", "Server connections of the database", false },
+	{ M_DB_PAUSED, SRC_DATABASE, "pgbouncer_database_paused", "gauge", "Database is paused", false },
+	{ M_DB_DISABLED, SRC_DATABASE, "pgbouncer_database_disabled", "gauge", "Database is disabled", false },
+
+	{ M_POOL_CL_ACTIVE, SRC_POOL, "pgbouncer_pool_client_active_connections", "gauge", "Clients linked to a server or idle", false },
+	{ M_POOL_CL_WAITING, SRC_POOL, "pgbouncer_pool_client_waiting_connections", "gauge", "Clients waiting for a server", false },
+	{ M_POOL_CL_CANCEL, SRC_POOL, "pgbouncer_pool_client_cancel_connections", "gauge", "Cancel requests being forwarded", false },
+	{ M_POOL_SV_ACTIVE, SRC_POOL, "pgbouncer_pool_server_active_connections", "gauge", "Servers linked to a client", false },
+	{ M_POOL_SV_IDLE, SRC_POOL, "pgbouncer_pool_server_idle_connections", "gauge", "Servers ready for use", false },
+	{ M_POOL_SV_USED, SRC_POOL, "pgbouncer_pool_server_used_connections", "gauge", "Servers waiting for a check", false },
+	{ M_POOL_SV_TESTED, SRC_POOL, "pgbouncer_pool_server_testing_connections", "gauge", "Servers running reset or check query", false },
+	{ M_POOL_SV_LOGIN, SRC_POOL, "pgbouncer_pool_server_login_connections", "gauge", "Servers logging in", false },
+	{ M_POOL_MAXWAIT, SRC_POOL, "pgbouncer_pool_client_maxwait_seconds", "gauge", "Wait time of the oldest waiting client", true },
+	{ M_POOL_XACTS, SRC_POOL, "pgbouncer_pool_transactions", "counter", "Transactions pooled", false },
+	{ M_POOL_QUERIES, SRC_POOL, "pgbouncer_pool_queries", "counter", "Queries pooled", false },
+	{ M_POOL_RECEIVED, SRC_POOL, "pgbouncer_pool_received_bytes", "counter", "Bytes received from clients", false },
+	{ M_POOL_SENT, SRC_POOL, "pgbouncer_pool_sent_bytes", "counter", "Bytes sent to clients", false },
+	{ M_POOL_XACT_TIME, SRC_POOL, "pgbouncer_pool_transaction_seconds", "counter", "Time spent in transactions", true },
+	{ M_POOL_QUERY_TIME, SRC_POOL, "pgbouncer_pool_query_seconds", "counter", "Time spent in queries", true },
+	{ M_POOL_WAIT_TIME, SRC_POOL, "pgbouncer_pool_client_wait_seconds", "counter", "Time clients waited for a server", true },
+
+	{ M_USER_CUR_CONN, SRC_USER, "pgbouncer_user_current_connections", "gauge", "Server connections of the user", false },
+	{ M_USER_MAX_CONN, SRC_USER, "pgbouncer_user_max_connections", "gauge", "Maximum server connections of the user, 0 is unlimited", false },
+
+	{ M_SLAB_USED, SRC_SLAB, "pgbouncer_memory_used_objects", "gauge", "Objects in use in the cache", false },
+	{ M_SLAB_FREE, SRC_SLAB, "pgbouncer_memory_free_objects", "gauge", "Free objects in the cache", false },
+	{ M_SLAB_BYTES, SRC_SLAB, "pgbouncer_memory_bytes", "gauge", "Memory allocated by the cache", false },
+};
+
+#define FAMILY_COUNT	((int)(sizeof(families) / sizeof(families[0])))
+
+struct MetricsSlab {
+	char name[32];
+	unsigned size;
+	unsigned free;
+	unsigned total;
+};
+
+struct MetricsListener {
+	struct List head;		/* entry in listener_list */
+	int fd;
+	struct event ev;
+};
+
+struct MetricsConn {
+	struct List head;		/* entry in conn_list */
+	int fd;
+	struct event ev;
+	bool writing;			/* request is read, sending response */
+	bool done;			/* all of the response is in out */
+
+	/* cursor of the response */
+	int family;			/* index in families[] */
+	bool family_started;		/* HELP and TYPE are written */
+	struct StatList *list;		/* database or pool list */
+	struct List *item;		/* element of next row, NULL at end */
+	int index;			/* next row of array based sources */
+
+	/* taken when first needed, users are not freed while running */
+	PgUser **users;
+	int user_count;
+	bool users_taken;
+	struct MetricsSlab *slabs;
+	int slab_count;
+
+	int req_len;
+	char req[METRICS_REQ_MAX];
+	int out_pos;
+	int out_len;
+	char out[METRICS_BUF_SIZE];
+};
+
+static STATLIST(listener_list);
+static STATLIST(conn_list);
+
+static struct event ev_retry;
+static struct timeval retry_period = {5, 0};
+static struct timeval conn_timeout = {10, 0};
+
+static void metrics_accept(evutil_socket_t sock, short flags, void *arg);
+static void metrics_conn_cb(evutil_socket_t sock, short flags, void *arg);
+
+/*
+ * Output helpers.  Rows are only started with METRICS_ROW_MAX free,
+ * vsnprintf() truncation is a safety net only.
+ */
+
+static void out_printf(struct MetricsConn *mc, const char *fmt, ...) _PRINTF(2, 3);
+static void out_printf(struct MetricsConn *mc, const char *fmt, ...)
+{
+	va_list ap;
+	int avail = sizeof(mc->out) - mc->out_len;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(mc->out + mc->out_len, avail, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		mc->out_len += (n < avail) ? n : avail - 1;
+}
+
+/* label value with \, " and newline escaped */
+static void out_label(struct MetricsConn *mc, bool first, const char *key, const char *val)
+{
+	char buf[2 * MAX_USERNAME + 1];
+	char *dst = buf;
+
+	for (; *val && dst < buf + sizeof(buf) - 2; val++) {
+		if (*val == '\\' || *val == '"') {
+			*dst++ = '\\';
+			*dst++ = *val;
+		} else if (*val == '\n') {
+			*dst++ = '\\';
+			*dst++ = 'n';
+		} else {
+			*dst++ = *val;
+		}
+	}
+	*dst = '\0';
+	out_printf(mc, "%s%s=\"%s\"", first ? "{" : ",", key, buf);
+}
+
+/*
+ * Cursor
+ */
+
+static void advance_item(struct MetricsConn *mc)
+{
+	mc->item = mc->item->next;
+	if (mc->item == &mc->list->head)
+		mc->item = NULL;
+}
+
+/* item is about to leave its list */
+void metrics_forget(struct List *item)
+{
+	struct List *el;
+	struct MetricsConn *mc;
+
+	statlist_for_each(el, &conn_list) {
+		mc = container_of(el, struct MetricsConn, head);
+		if (mc->item == item)
+			advance_item(mc);
+	}
+}
+
+static void take_user(void *arg, PgUser *user)
+{
+	struct MetricsConn *mc = arg;
+
+	if (mc->users && mc->user_count < user_tree.count)
+		mc->users[mc->user_count++] = user;
+}
+
+static void take_slab(void *arg, const char *slab_name,
+		      unsigned size, unsigned free, unsigned total)
+{
+	struct MetricsConn *mc = arg;
+	struct MetricsSlab *slab;
+
+	if (mc->slab_count >= METRICS_MAX_SLABS)
+		return;
+	slab = &mc->slabs[mc->slab_count++];
+	snprintf(slab->name, sizeof(slab->name), "%s", slab_name);
+	slab->size = size;
+	slab->free = free;
+	slab->total = total;
+}
+
+static void start_family(struct MetricsConn *mc, const struct MetricFamily *f)
+{
+	mc->index = 0;
+	mc->list = NULL;
+	mc->item = NULL;
+
+	switch (f->source) {
+	case SRC_DATABASE:
+	case SRC_POOL:
+		mc->list = (f->source == SRC_DATABASE) ? &database_list : &pool_list;
+		if (statlist_count(mc->list) > 0)
+			mc->item = mc->list->head.next;
+		break;
+	case SRC_USER:
+		if (!mc->users_taken) {
+			mc->users_taken = true;
+			mc->users = calloc(user_tree.count + 1, sizeof(PgUser *));
+			walk_users(take_user, mc);
+		}
+		break;
+	case SRC_SLAB:
+		if (!mc->slabs) {
+			mc->slabs = calloc(METRICS_MAX_SLABS, sizeof(struct MetricsSlab));
+			if (mc->slabs)
+				slab_stats(take_slab, mc);
+		}
+		break;
+	case SRC_GLOBAL:
+		break;
+	}
+}
+
+static bool have_row(struct MetricsConn *mc, const struct MetricFamily *f)
+{
+	switch (f->source) {
+	case SRC_GLOBAL:
+		return mc->index == 0;
+	case SRC_DATABASE:
+	case SRC_POOL:
+		return mc->item != NULL;
+	case SRC_USER:
+		return mc->index < mc->user_count;
+	case SRC_SLAB:
+		return mc->index < mc->slab_count;
+	}
+	return false;
+}
+
+static uint64_t global_value(enum MetricId id)
+{
+	switch (id) {
+	case M_BUILD:
+		return 1;
+	case M_DATABASES:
+		return statlist_count(&database_list);
+	case M_USERS:
+		return user_tree.count;
+	case M_POOLS:
+		return statlist_count(&pool_list);
+	case M_CLIENTS_USED:
+		return slab_active_count(client_cache);
+	case M_CLIENTS_LOGIN:
+		return statlist_count(&login_client_list);
+	case M_SERVERS_USED:
+		return slab_active_count(server_cache);
+	default:
+		return 0;
+	}
+}
+
+static uint64_t database_value(enum MetricId id, PgDatabase *db)
+{
+	switch (id) {
+	case M_DB_POOL_SIZE:
+		return db->pool_size >= 0 ? db->pool_size : cf_default_pool_size;
+	case M_DB_MAX_CONN:
+		return database_max_connections(db);
+	case M_DB_CUR_CONN:
+		return db->connection_count;
+	case M_DB_PAUSED:
+		return db->db_paused;
+	case M_DB_DISABLED:
+		return db->db_disabled;
+	default:
+		return 0;
+	}
+}
+
+static uint64_t pool_value(enum MetricId id, PgPool *pool)
+{
+	PgSocket *waiter;
+
+	switch (id) {
+	case M_POOL_CL_ACTIVE:
+		return statlist_count(&pool->active_client_list);
+	case M_POOL_CL_WAITING:
+		return statlist_count(&pool->waiting_client_list);
+	case M_POOL_CL_CANCEL:
+		return statlist_count(&pool->cancel_req_list);
+	case M_POOL_SV_ACTIVE:
+		return statlist_count(&pool->active_server_list);
+	case M_POOL_SV_IDLE:
+		return statlist_count(&pool->idle_server_list);
+	case M_POOL_SV_USED:
+		return statlist_count(&pool->used_server_list);
+	case M_POOL_SV_TESTED:
+		return statlist_count(&pool->tested_server_list);
+	case M_POOL_SV_LOGIN:
+		return statlist_count(&pool->new_server_list);
+	case M_POOL_MAXWAIT:
+		waiter = first_socket(&pool->waiting_client_list);
+		if (waiter && waiter->query_start)
+			return get_cached_time() - waiter->query_start;
+		return 0;
+	case M_POOL_XACTS:
+		return pool->stats.xact_count;
+	case M_POOL_QUERIES:
+		return pool->stats.query_count;
+	case M_POOL_RECEIVED:
+		return pool->stats.client_bytes;
+	case M_POOL_SENT:
+		return pool->stats.server_bytes;
+	case M_POOL_XACT_TIME:
+		return pool->stats.xact_time;
+	case M_POOL_QUERY_TIME:
+		return pool->stats.query_time;
+	case M_POOL_WAIT_TIME:
+		return pool->stats.wait_time;
+	default:
+		return 0;
+	}
+}
+
+static void write_row(struct MetricsConn *mc, const struct MetricFamily *f)
+{
+	const char *suffix = "";
+	PgDatabase *db;
+	PgPool *pool;
+	PgUser *user;
+	struct MetricsSlab *slab;
+	uint64_t value = 0;
+
+	if (strcmp(f->type, "counter") == 0)
+		suffix = "_total";
+	else if (strcmp(f->type, "info") == 0)
+		suffix = "_info";
+	out_printf(mc, "%s%s", f->name, suffix);
+
+	switch (f->source) {
+	case SRC_GLOBAL:
+		if (f->id == M_BUILD) {
+			out_label(mc, true, "version", PACKAGE_VERSION);
+			out_printf(mc, "}");
+		}
+		value = global_value(f->id);
+		mc->index++;
+		break;
+	case SRC_DATABASE:
+		db = container_of(mc->item, PgDatabase, head);
+		out_label(mc, true, "database", db->name);
+		out_printf(mc, "}");
+		value = database_value(f->id, db);
+		advance_item(mc);
+		break;
+	case SRC_POOL:
+		pool = container_of(mc->item, PgPool, head);
+		out_label(mc, true, "database", pool->db->name);
+		out_label(mc, false, "user", pool->user->name);
+		out_printf(mc, "}");
+		value = pool_value(f->id, pool);
+		advance_item(mc);
+		break;
+	case SRC_USER:
+		user = mc->users[mc->index++];
+		out_label(mc, true, "user", user->name);
+		out_printf(mc, "}");
+		if (f->id == M_USER_CUR_CONN)
+			value = user->connection_count;
+		else
+			value = user_max_connections(user);
+		break;
+	case SRC_SLAB:
+		slab = &mc->slabs[mc->index++];
+		out_label(mc, true, "cache", slab->name);
+		out_printf(mc, "}");
+		if (f->id == M_SLAB_USED)
+			value = slab->total - slab->free;
+		else if (f->id == M_SLAB_FREE)
+			value = slab->free;
+		else
+			value = (uint64_t)slab->total * slab->size;
+		break;
+	}
+
+	if (f->seconds)
+		out_printf(mc, " %" PRIu64 ".%06" PRIu64 "\n", value / USEC, value % USEC);
+	else
+		out_printf(mc, " %" PRIu64 "\n", value);
+}
+
+/* fill the output buffer with as many rows as fit */
+static void fill_rows(struct MetricsConn *mc)
+{
+	const struct MetricFamily *f;
+
+	while (mc->family < FAMILY_COUNT) {
+		if (mc->out_len + METRICS_ROW_MAX > (int)sizeof(mc->out))
+			return;
+
+		f = &families[mc->family];
+		if (!mc->family_started) {
+			mc->family_started = true;
+			out_printf(mc, "# TYPE %s %s\n# HELP %s %s.\n",
+				   f->name, f->type, f->name, f->help);
+			start_family(mc, f);
+		} else if (have_row(mc, f)) {
+			write_row(mc, f);
+		} else {
+			mc->family++;
+			mc->family_started = false;
+		}
+	}
+
+	out_printf(mc, "# EOF\n");
+	mc->done = true;
+}
+
+/*
+ * HTTP
+ */
+
+static void close_conn(struct MetricsConn *mc)
+{
+	event_del(&mc->ev);
+	safe_close(mc->fd);
+	statlist_remove(&conn_list, &mc->head);
+	free(mc->users);
+	free(mc->slabs);
+	free(mc);
+}
+
+static void start_response(struct MetricsConn *mc, const char *status)
+{
+	mc->writing = true;
+	out_printf(mc, "HTTP/1.0 %s\r\nConnection: close\r\n", status);
+	if (strcmp(status, "200 OK") == 0) {
+		out_printf(mc, "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n\r\n");
+	} else {
+		out_printf(mc, "Content-Type: text/plain\r\n\r\n%s\n", status);
+		mc->done = true;
+	}
+
+	event_del(&mc->ev);
+	event_assign(&mc->ev, pgb_event_base, mc->fd, EV_WRITE | EV_PERSIST, metrics_conn_cb, mc);
+	if (event_add(&mc->ev, &conn_timeout) < 0)
+		log_warning("metrics: event_add failed: %s", strerror(errno));
+}
+
+/* returns false if the request is not complete yet or conn was closed */
+static bool read_request(struct MetricsConn *mc)
+{
+	ssize_t n;
+
+	n = safe_recv(mc->fd, mc->req + mc->req_len, sizeof(mc->req) - 1 - mc->req_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	if (n <= 0) {
+		close_conn(mc);
+		return false;
+	}
+	mc->req_len += n;
+	mc->req[mc->req_len] = '\0';
+
+	if (!strstr(mc->req, "\r\n\r\n") && !strstr(mc->req, "\n\n")) {
+		if (mc->req_len < (int)sizeof(mc->req) - 1)
+			return false;
+		start_response(mc, "431 Request Header Fields Too Large");
+		return true;
+	}
+
+	if (strncmp(mc->req, "GET ", 4) != 0)
+		start_response(mc, "405 Method Not Allowed");
+	else if (strncmp(mc->req + 4, "/metrics ", 9) == 0 || strncmp(mc->req + 4, "/ ", 2) == 0)
+		start_response(mc, "200 OK");
+	else
+		start_response(mc, "404 Not Found");
+	return true;
+}
+
+static void write_response(struct MetricsConn *mc)
+{
+	ssize_t n;
+	int bufs = 0;
+
+	for (;;) {
+		if (mc->out_pos == mc->out_len) {
+			if (mc->done) {
+				close_conn(mc);
+				return;
+			}
+			if (bufs++ >= METRICS_BUFS_PER_CALL)
+				return;
+			mc->out_pos = mc->out_len = 0;
+			fill_rows(mc);
+		}
+
+		n = safe_send(mc->fd, mc->out + mc->out_pos, mc->out_len - mc->out_pos, 0);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				close_conn(mc);
+			return;
+		}
+		mc->out_pos += n;
+	}
+}
+
+static void metrics_conn_cb(evutil_socket_t sock, short flags, void *arg)
+{
+	struct MetricsConn *mc = arg;
+
+	if (flags & EV_TIMEOUT) {
+		log_debug("metrics: connection timed out");
+		close_conn(mc);
+		return;
+	}
+
+	if (!mc->writing && !read_request(mc))
+		return;
+	write_response(mc);
+}
+
+static void metrics_accept(evutil_socket_t sock, short flags, void *arg)
+{
+	struct MetricsListener *ml = arg;
+	struct MetricsConn *mc;
+	int fd;
+
+	for (;;) {
+		fd = safe_accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+				return;
+			/* probably fd limit, try again later */
+			log_warning("metrics: accept() failed: %s", strerror(errno));
+			event_del(&ml->ev);
+			safe_evtimer_add(&ev_retry, &retry_period);
+			return;
+		}
+
+		if (statlist_count(&conn_list) >= METRICS_MAX_CONNS) {
+			log_noise("metrics: too many connections");
+			safe_close(fd);
+			continue;
+		}
+
+		mc = calloc(1, sizeof(*mc));
+		if (!mc || !tune_socket(fd, false)) {
+			free(mc);
+			safe_close(fd);
+			continue;
+		}
+		list_init(&mc->head);
+		mc->fd = fd;
+		statlist_append(&conn_list, &mc->head);
+
+		event_assign(&mc->ev, pgb_event_base, fd, EV_READ | EV_PERSIST, metrics_conn_cb, mc);
+		if (event_add(&mc->ev, &conn_timeout) < 0) {
+			log_warning("metrics: event_add failed: %s", strerror(errno));
+			close_conn(mc);
+		}
+	}
+}
+
+/*
+ * Listening sockets
+ */
+
+static bool add_listener(const struct addrinfo *ai)
+{
+	struct MetricsListener *ml;
+	char buf[128];
+	const char *errpos;
+	int sock, val = 1;
+
+	errpos = "socket";
+	sock = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (sock < 0)
+		goto failed;
+
+	errpos = "setsockopt";
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
+		goto failed;
+#ifdef IPV6_V6ONLY
+	if (ai->ai_family == AF_INET6 &&
+	    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val)) < 0)
+		goto failed;
+#endif
+
+	errpos = "bind";
+	if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0)
+		goto failed;
+
+	errpos = "tune_socket";
+	if (!tune_socket(sock, false))
+		goto failed;
+
+	errpos = "listen";
+	if (listen(sock, METRICS_MAX_CONNS) < 0)
+		goto failed;
+
+	errpos = "calloc";
+	ml = calloc(1, sizeof(*ml));
+	if (!ml)
+		goto failed;
+	list_init(&ml->head);
+	ml->fd = sock;
+	event_assign(&ml->ev, pgb_event_base, sock, EV_READ | EV_PERSIST, metrics_accept, ml);
+	if (event_add(&ml->ev, NULL) < 0) {
+		free(ml);
+		errpos = "event_add";
+		goto failed;
+	}
+	statlist_append(&listener_list, &ml->head);
+
+	log_info("metrics listening on %s", sa2str(ai->ai_addr, buf, sizeof(buf)));
+	return true;
+
+failed:
+	log_warning("metrics: cannot listen on %s: %s(): %s",
+		    sa2str(ai->ai_addr, buf, sizeof(buf)), errpos, strerror(errno));
+	if (sock >= 0)
+		safe_close(sock);
+	return false;
+}
+
+static bool parse_metrics_addr(void *arg, const char *addr)
+{
+	static const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *ai, *gaires = NULL;
+	char service[64];
+	int res;
+
+	if (!*addr)
+		return true;
+	if (strcmp(addr, "*") == 0)
+		addr = NULL;
+	/* every worker serves the metrics of its own pools */
+	snprintf(service, sizeof(service), "%d", cf_metrics_port + worker_id);
+
+	res = getaddrinfo(addr, service, &hints, &gaires);
+	if (res != 0) {
+		log_warning("metrics: getaddrinfo('%s', '%s') = %s [%d]",
+			    addr ? addr : "*", service, gai_strerror(res), res);
+		return true;
+	}
+	for (ai = gaires; ai; ai = ai->ai_next)
+		add_listener(ai);
+	freeaddrinfo(gaires);
+	return true;
+}
+
+static void start_listeners(void)
+{
+	struct List *el;
+	struct MetricsListener *ml;
+
+	if (statlist_count(&listener_list) > 0) {
+		/* resume after accept() failure */
+		statlist_for_each(el, &listener_list) {
+			ml = container_of(el, struct MetricsListener, head);
+			if (event_add(&ml->ev, NULL) < 0)
+				log_warning("metrics: event_add failed: %s", strerror(errno));
+		}
+		return;
+	}
+
+	if (!parse_word_list(cf_metrics_listen_addr, parse_metrics_addr, NULL))
+		log_warning("metrics: failed to parse metrics_listen_addr: %s", cf_metrics_listen_addr);
+
+	/* the port may still be held by the old process after takeover */
+	if (statlist_count(&listener_list) == 0)
+		safe_evtimer_add(&ev_retry, &retry_period);
+}
+
+static void retry_listen(evutil_socket_t sock, short flags, void *arg)
+{
+	start_listeners();
+}
+
+void metrics_setup(void)
+{
+	if (!cf_metrics_listen_addr || !*cf_metrics_listen_addr)
+		return;
+
+	evtimer_assign(&ev_retry, pgb_event_base, retry_listen, NULL);
+	start_listeners();
+}
+
+void metrics_cleanup(void)
+{
+	struct List *el, *tmp;
+	struct MetricsListener *ml;
+	struct MetricsConn *mc;
+
+	statlist_for_each_safe(el, &conn_list, tmp) {
+		mc = container_of(el, struct MetricsConn, head);
+		close_conn(mc);
+	}
+	while ((el = statlist_pop(&listener_list)) != NULL) {
+		ml = container_of(el, struct MetricsListener, head);
+		event_del(&ml->ev);
+		safe_close(ml->fd);
+		free(ml);
+	}
+	if (cf_metrics_listen_addr && *cf_metrics_listen_addr)
+		event_del(&ev_retry);
+}
@@ -27,11 +27,25 @@
 #include <usual/err.h>
 #include <usual/safeio.h>
 #include <usual/slab.h>
+#include <usual/hashing/memhash.h>
 
 /* those items will be allocated as needed, never freed */
 STATLIST(database_list);
 STATLIST(pool_list);
 
+/* pools that per_loop_maint() needs to look at */
+STATLIST(active_pool_list);
+
+/*
+ * Lookup indexes for the lists above.  database_index contains also
+ * the databases in autodatabase_idle_list.
+ */
+struct HashIndex database_index;
+struct HashIndex pool_index;
+
+/* logged in clients by cancel key */
+struct HashIndex cancel_index;
+
 /* All locally defined users (in auth_file) are kept here. */
 struct AATree user_tree;
 
@@ -86,6 +100,8 @@ static void construct_client(void *obj)
 
 	memset(client, 0, sizeof(PgSocket));
 	list_init(&client->head);
+	list_init(&client->cancel_head);
+	timerwheel_node_init(&client->timeout);
 	sbuf_init(&client->sbuf, client_proto);
 	client->state = CL_FREE;
 }
@@ -96,6 +112,9 @@ static void construct_server(void *obj)
 
 	memset(server, 0, sizeof(PgSocket));
 	list_init(&server->head);
+	list_init(&server->db_evict_head);
+	list_init(&server->user_evict_head);
+	timerwheel_node_init(&server->timeout);
 	sbuf_init(&server->sbuf, server_proto);
 	server->state = SV_FREE;
 }
@@ -108,11 +127,48 @@ static int user_node_cmp(uintptr_t userptr, struct AANode *node)
 	return strcmp(name, user->name);
 }
 
+static uint32_t database_name_hash(const char *name)
+{
+	return memhash(name, strlen(name));
+}
+
+static uint32_t database_node_hash(struct List *node)
+{
+	PgDatabase *db = container_of(node, PgDatabase, hash_head);
+	return database_name_hash(db->name);
+}
+
+static uint32_t pool_key_hash(const PgDatabase *db, const PgUser *user)
+{
+	const void *key[2] = { db, user };
+	return memhash(key, sizeof(key));
+}
+
+static uint32_t pool_node_hash(struct List *node)
+{
+	PgPool *pool = container_of(node, PgPool, hash_head);
+	return pool_key_hash(pool->db, pool->user);
+}
+
+static uint32_t cancel_key_hash(const uint8_t *key)
+{
+	return memhash(key, BACKENDKEY_LEN);
+}
+
+static uint32_t cancel_node_hash(struct List *node)
+{
+	PgSocket *client = container_of(node, PgSocket, cancel_head);
+	return cancel_key_hash(client->cancel_key);
+}
+
 /* initialization before config loading */
 void init_objects(void)
 {
 	aatree_init(&user_tree, user_node_cmp, NULL);
 	aatree_init(&pam_user_tree, user_node_cmp, NULL);
+	hashindex_init(&database_index, database_node_hash);
+	hashindex_init(&pool_index, pool_node_hash);
+	hashindex_init(&cancel_index, cancel_node_hash);
 	user_cache = slab_create("user_cache", sizeof(PgUser), 0, NULL, USUAL_ALLOC);
 	db_cache = slab_create("db_cache", sizeof(PgDatabase), 0, NULL, USUAL_ALLOC);
 	pool_cache = slab_create("pool_cache", sizeof(PgPool), 0, NULL, USUAL_ALLOC);
@@ -133,6 +189,7 @@ void init_caches(void)
 	server_cache = slab_create("server_cache", sizeof(PgSocket), 0, construct_server, USUAL_ALLOC);
 	client_cache = slab_create("client_cache", sizeof(PgSocket), 0, construct_client, USUAL_ALLOC);
 	iobuf_cache = slab_create("iobuf_cache", IOBUF_SIZE, 0, do_iobuf_reset, USUAL_ALLOC);
+	cancel_setup();
 }
 
 /* state change means moving between lists */
@@ -164,6 +221,7 @@ void change_client_state(PgSocket *client, SocketState newstate)
 		break;
 	case CL_CANCEL:
 		statlist_remove(&pool->cancel_req_list, &client->head);
+		cancel_request_detach(client);
 		break;
 	default:
 		fatal("bad cur client state: %d", client->state);
@@ -171,6 +229,12 @@ void change_client_state(PgSocket *client, SocketState newstate)
 
 	client->state = newstate;
 
+	/* cancel key is not valid anymore */
+	if ((newstate == CL_JUSTFREE || newstate == CL_FREE) && !list_empty(&client->cancel_head))
+		hashindex_remove(&cancel_index, &client->cancel_head);
+
+	socket_timeout_arm(client);
+
 	/* put to new location */
 	switch (client->state) {
 	case CL_FREE:
@@ -187,6 +251,7 @@ void change_client_state(PgSocket *client, SocketState newstate)
 	case CL_WAITING_LOGIN:
 		client->wait_start = get_cached_time();
 		statlist_append(&pool->waiting_client_list, &client->head);
+		mark_pool_active(pool);
 		break;
 	case CL_ACTIVE:
 		statlist_append(&pool->active_client_list, &client->head);
@@ -199,11 +264,56 @@ void change_client_state(PgSocket *client, SocketState newstate)
 	}
 }
 
+/*
+ * Servers that may be evicted are also kept in per-database and
+ * per-user lists.  Servers are appended when they enter the state,
+ * so the oldest candidate is always near the head.
+ */
+static void evict_list_remove(PgSocket *server)
+{
+	PgPool *pool = server->pool;
+
+	switch (server->state) {
+	case SV_USED:
+	case SV_TESTED:
+	case SV_IDLE:
+		statlist_remove(&pool->db->evict_list, &server->db_evict_head);
+		statlist_remove(&pool->user->evict_list, &server->user_evict_head);
+		break;
+	case SV_ACTIVE:
+		statlist_remove(&pool->user->active_list, &server->user_evict_head);
+		break;
+	default:
+		break;
+	}
+}
+
+static void evict_list_add(PgSocket *server)
+{
+	PgPool *pool = server->pool;
+
+	switch (server->state) {
+	case SV_USED:
+	case SV_TESTED:
+	case SV_IDLE:
+		statlist_append(&pool->db->evict_list, &server->db_evict_head);
+		statlist_append(&pool->user->evict_list, &server->user_evict_head);
+		break;
+	case SV_ACTIVE:
+		statlist_append(&pool->user->active_list, &server->user_evict_head);
+		break;
+	default:
+		break;
+	}
+}
+
 /* state change means moving between lists */
 void change_server_state(PgSocket *server, SocketState newstate)
 {
 	PgPool *pool = server->pool;
 
+	evict_list_remove(server);
+
 	/* remove from old location */
 	switch (server->state) {
 	case SV_FREE:
@@ -232,6 +342,9 @@ void change_server_state(PgSocket *server, SocketState newstate)
 
 	server->state = newstate;
 
+	evict_list_add(server);
+	socket_timeout_arm(server);
+
 	/* put to new location */
 	switch (server->state) {
 	case SV_FREE:
@@ -295,6 +408,13 @@ static void put_in_order(struct List *newitem, struct StatList *list,
 	int res;
 	struct List *item;
 
+	/* objects from config file usually come in order */
+	item = statlist_last(list);
+	if (item && cmpfn(item, newitem) < 0) {
+		statlist_append(list, newitem);
+		return;
+	}
+
 	statlist_for_each(item, list) {
 		res = cmpfn(item, newitem);
 		if (res == 0) {
@@ -319,12 +439,19 @@ PgDatabase *add_database(const char *name)
 			return NULL;
 
 		list_init(&db->head);
+		list_init(&db->hash_head);
+		list_init(&db->pool_list);
+		statlist_init(&db->evict_list, "evict_list");
 		aatree_init(&db->user_passwds, user_passwd_node_cmp, user_passwd_free);
 		if (strlcpy(db->name, name, sizeof(db->name)) >= sizeof(db->name)) {
 			log_warning("too long db name: %s", name);
 			slab_free(db_cache, db);
 			return NULL;
 		}
+		if (!hashindex_insert(&database_index, &db->hash_head)) {
+			slab_free(db_cache, db);
+			return NULL;
+		}
 		put_in_order(&db->head, &database_list, cmp_database);
 	}
 
@@ -361,6 +488,8 @@ PgUser *add_user(const char *name, const char *passwd)
 			return NULL;
 
 		list_init(&user->pool_list);
+		statlist_init(&user->evict_list, "evict_list");
+		statlist_init(&user->active_list, "active_list");
 		safe_strcpy(user->name, name, sizeof(user->name));
 
 		aatree_insert(&user_tree, (uintptr_t)user->name, &user->tree_node);
@@ -384,6 +513,8 @@ PgUser *add_pam_user(const char *name, const char *passwd)
 		if (!user)
 			return NULL;
 		list_init(&user->pool_list);
+		statlist_init(&user->evict_list, "evict_list");
+		statlist_init(&user->active_list, "active_list");
 		safe_strcpy(user->name, name, sizeof(user->name));
 
 		aatree_insert(&pam_user_tree, (uintptr_t)user->name, &user->tree_node);
@@ -403,6 +534,8 @@ PgUser *force_user(PgDatabase *db, const char *name, const char *passwd)
 		if (!user)
 			return NULL;
 		list_init(&user->pool_list);
+		statlist_init(&user->evict_list, "evict_list");
+		statlist_init(&user->active_list, "active_list");
 		user->pool_mode = POOL_INHERIT;
 	}
 	safe_strcpy(user->name, name, sizeof(user->name));
@@ -414,22 +547,22 @@ PgUser *force_user(PgDatabase *db, const char *name, const char *passwd)
 /* find an existing database */
 PgDatabase *find_database(const char *name)
 {
-	struct List *item, *tmp;
+	struct List *item, *bucket;
 	PgDatabase *db;
-	statlist_for_each(item, &database_list) {
-		db = container_of(item, PgDatabase, head);
-		if (strcmp(db->name, name) == 0)
-			return db;
-	}
-	/* also trying to find in idle autodatabases list */
-	statlist_for_each_safe(item, &autodatabase_idle_list, tmp) {
-		db = container_of(item, PgDatabase, head);
-		if (strcmp(db->name, name) == 0) {
+
+	bucket = hashindex_bucket(&database_index, database_name_hash(name));
+	list_for_each(item, bucket) {
+		db = container_of(item, PgDatabase, hash_head);
+		if (strcmp(db->name, name) != 0)
+			continue;
+
+		/* move back from idle autodatabases list */
+		if (db->inactive_time) {
 			db->inactive_time = 0;
 			statlist_remove(&autodatabase_idle_list, &db->head);
 			put_in_order(&db->head, &database_list, cmp_database);
-			return db;
 		}
+		return db;
 	}
 	return NULL;
 }
@@ -472,6 +605,9 @@ static PgPool *new_pool(PgDatabase *db, PgUser *user)
 
 	list_init(&pool->head);
 	list_init(&pool->map_head);
+	list_init(&pool->db_head);
+	list_init(&pool->active_head);
+	list_init(&pool->hash_head);
 
 	pool->user = user;
 	pool->db = db;
@@ -487,26 +623,36 @@ static PgPool *new_pool(PgDatabase *db, PgUser *user)
 	statlist_init(&pool->new_server_list, "new_server_list");
 	statlist_init(&pool->cancel_req_list, "cancel_req_list");
 
+	if (!hashindex_insert(&pool_index, &pool->hash_head)) {
+		slab_free(pool_cache, pool);
+		return NULL;
+	}
+
 	list_append(&user->pool_list, &pool->map_head);
+	list_append(&db->pool_list, &pool->db_head);
 
 	/* keep pools in db/user order to make stats faster */
 	put_in_order(&pool->head, &pool_list, cmp_pool);
 
+	if (db->db_paused || db->db_wait_close)
+		mark_pool_active(pool);
+
 	return pool;
 }
 
 /* find pool object, create if needed */
 PgPool *get_pool(PgDatabase *db, PgUser *user)
 {
-	struct List *item;
+	struct List *item, *bucket;
 	PgPool *pool;
 
 	if (!db || !user)
 		return NULL;
 
-	list_for_each(item, &user->pool_list) {
-		pool = container_of(item, PgPool, map_head);
-		if (pool->db == db)
+	bucket = hashindex_bucket(&pool_index, pool_key_hash(db, user));
+	list_for_each(item, bucket) {
+		pool = container_of(item, PgPool, hash_head);
+		if (pool->db == db && pool->user == user)
 			return pool;
 	}
 
@@ -527,12 +673,17 @@ static void pause_client(PgSocket *client)
 /* wake client from wait */
 void activate_client(PgSocket *client)
 {
+	usec_t wait_time;
+
 	Assert(client->state == CL_WAITING || client->state == CL_WAITING_LOGIN);
 
 	Assert(client->wait_start > 0);
 
 	/* acount for time client spent waiting for server */
-	client->pool->stats.wait_time += (get_cached_time() - client->wait_start);
+	wait_time = get_cached_time() - client->wait_start;
+	client->pool->stats.wait_time += wait_time;
+	client->stats.wait_time += wait_time;
+	stats_record_latency(client->pool, LATENCY_WAIT, wait_time);
 
 	slog_debug(client, "activate_client");
 	change_client_state(client, CL_ACTIVE);
@@ -641,7 +792,9 @@ bool find_server(PgSocket *client)
 	if (server) {
 		client->link = server;
 		server->link = client;
+		client->link_time = get_cached_time();
 		change_server_state(server, SV_ACTIVE);
+		probe4(server__link, client, server, pool->db->name, pool->user->name);
 		if (varchange) {
 			server->setting_vars = true;
 			server->ready = false;
@@ -717,6 +870,14 @@ bool life_over(PgSocket *server)
 	return false;
 }
 
+/* client lets go of its server, count the time it was held */
+static void unlink_server(PgSocket *client, PgSocket *server)
+{
+	client->server_time += get_cached_time() - client->link_time;
+	client->link = NULL;
+	server->link = NULL;
+}
+
 /* connecting/active -> idle, unlink if needed */
 bool release_server(PgSocket *server)
 {
@@ -724,12 +885,13 @@ bool release_server(PgSocket *server)
 	SocketState newstate = SV_IDLE;
 
 	Assert(server->ready);
+	probe2(server__release, server, server->link);
 
 	/* remove from old list */
 	switch (server->state) {
 	case SV_ACTIVE:
-		server->link->link = NULL;
-		server->link = NULL;
+		unlink_server(server->link, server);
+		prepare_server_release(server);
 
 		if (*cf_server_reset_query && (cf_server_reset_query_always ||
 					       pool_pool_mode(pool) == POOL_SESSION))
@@ -750,6 +912,7 @@ bool release_server(PgSocket *server)
 	case SV_LOGIN:
 		pool->last_login_failed = false;
 		pool->last_connect_failed = false;
+		pool->login_failures = 0;
 		break;
 	default:
 		fatal("bad server state: %d", server->state);
@@ -782,6 +945,31 @@ bool release_server(PgSocket *server)
 	return true;
 }
 
+/*
+ * Delay before the next login attempt after a failure.  Without
+ * server_login_retry_max it is always server_login_retry, otherwise
+ * it doubles on each consecutive failure up to the maximum, with
+ * random jitter so that pools do not retry in lockstep.
+ */
+static void set_login_retry_delay(PgPool *pool)
+{
+	usec_t delay = cf_server_login_retry;
+	int shift;
+
+	if (cf_server_login_retry_max > cf_server_login_retry) {
+		shift = pool->login_failures < 16 ? pool->login_failures : 16;
+		delay = cf_server_login_retry << shift;
+		if (delay > cf_server_login_retry_max)
+			delay = cf_server_login_retry_max;
+		/* somewhere between half and full delay, never below the base */
+		delay = delay / 2 + random() % (delay / 2 + 1);
+		if (delay < cf_server_login_retry)
+			delay = cf_server_login_retry;
+	}
+	pool->login_retry_delay = delay;
+	pool->login_failures++;
+}
+
 /*
  * close server connection
  *
@@ -805,6 +993,8 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 	va_end(ap);
 	reason = buf;
 
+	probe2(server__disconnect, server, reason);
+
 	if (cf_log_disconnections)
 		slog_info(server, "closing because: %s (age=%" PRIu64 "s)", reason,
 			  (now - server->connect_time) / USEC);
@@ -814,8 +1004,7 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 		PgSocket *client = server->link;
 
 		if (client) {
-			client->link = NULL;
-			server->link = NULL;
+			unlink_server(client, server);
 			/*
 			 * Send reason to client if it is already
 			 * logged in, otherwise send generic message.
@@ -832,25 +1021,10 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 	case SV_IDLE:
 		break;
 	case SV_LOGIN:
-		/*
-		 * usually disconnect means problems in startup phase,
-		 * except when sending cancel packet
-		 */
-		if (!server->ready)
-		{
-			server->pool->last_login_failed = true;
-			server->pool->last_connect_failed = true;
-		}
-		else
-		{
-			/*
-			 * We did manage to connect and used the connection for query
-			 * cancellation, so to the best of our knowledge we can connect to
-			 * the server, reset last_connect_failed accordingly.
-			 */
-			server->pool->last_connect_failed = false;
-			send_term = false;
-		}
+		/* disconnect means problems in startup phase */
+		server->pool->last_login_failed = true;
+		server->pool->last_connect_failed = true;
+		set_login_retry_delay(server->pool);
 		break;
 	default:
 		fatal("bad server state: %d", server->state);
@@ -871,9 +1045,11 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 	}
 
 	free_scram_state(&server->scram_state);
+	free_server_prepared(server);
 
 	server->pool->db->connection_count--;
 	server->pool->user->connection_count--;
+	workers_connection_release(server->pool);
 
 	change_server_state(server, SV_JUSTFREE);
 	if (!sbuf_close(&server->sbuf))
@@ -902,6 +1078,8 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 		reason = buf;
 	}
 
+	probe2(client__disconnect, client, reason);
+
 	if (cf_log_disconnections && reason)
 		slog_info(client, "closing because: %s (age=%" PRIu64 "s)", reason,
 			  (now - client->connect_time) / USEC);
@@ -912,8 +1090,7 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 		if (client->link) {
 			PgSocket *server = client->link;
 			if (!server->ready) {
-				server->link = NULL;
-				client->link = NULL;
+				unlink_server(client, server);
 				/*
 				 * This can happen if the client
 				 * connection is normally closed while
@@ -928,8 +1105,7 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 				disconnect_server(server, true, "client disconnect while server was not ready");
 			} else if (!sbuf_is_empty(&server->sbuf)) {
 				/* ->ready may be set before all is sent */
-				server->link = NULL;
-				client->link = NULL;
+				unlink_server(client, server);
 				disconnect_server(server, true, "client disconnect before everything was sent to the server");
 			} else {
 				/* retval does not matter here */
@@ -954,6 +1130,7 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 	}
 
 	free_scram_state(&client->scram_state);
+	free_client_prepared(client);
 	if (client->login_user && client->login_user->mock_auth) {
 		free(client->login_user);
 		client->login_user = NULL;
@@ -1124,34 +1301,32 @@ cleanup:
 	free(host_copy);
 }
 
-PgSocket *compare_connections_by_time(PgSocket *lhs, PgSocket *rhs)
+/*
+ * Pick the oldest server from a db or user evict_list.  Testing
+ * connections are only taken if nobody's waiting in their pool.
+ */
+static PgSocket *oldest_evictable(struct StatList *list, bool by_db)
 {
-	if (!lhs)
-		return rhs;
-	if (!rhs)
-		return lhs;
-	return lhs->request_time < rhs->request_time ? lhs : rhs;
+	struct List *item;
+	PgSocket *server;
+
+	statlist_for_each(item, list) {
+		if (by_db)
+			server = container_of(item, PgSocket, db_evict_head);
+		else
+			server = container_of(item, PgSocket, user_evict_head);
+		if (server->state == SV_IDLE || statlist_empty(&server->pool->waiting_client_list))
+			return server;
+	}
+	return NULL;
 }
 
 /* evict the single most idle connection from among all pools to make room in the db */
 bool evict_connection(PgDatabase *db)
 {
-	struct List *item;
-	PgPool *pool;
-	PgSocket *oldest_connection = NULL;
-
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db != db)
-			continue;
-		oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->idle_server_list));
-		/* only evict testing connections if nobody's waiting */
-		if (statlist_empty(&pool->waiting_client_list)) {
-			oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->used_server_list));
-			oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->tested_server_list));
-		}
-	}
+	PgSocket *oldest_connection;
 
+	oldest_connection = oldest_evictable(&db->evict_list, true);
 	if (oldest_connection) {
 		disconnect_server(oldest_connection, true, "evicted");
 		return true;
@@ -1178,22 +1353,9 @@ static bool evict_idle_pool_connection(PgPool *pool)
 /* evict the single most idle connection from among all pools to make room in the user */
 bool evict_idle_user_connection(PgUser *user)
 {
-	struct List *item;
-	PgPool *pool;
-	PgSocket *oldest_connection = NULL;
-
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->user != user)
-			continue;
-		oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->idle_server_list));
-		/* only evict testing connections if nobody's waiting */
-		if (statlist_empty(&pool->waiting_client_list)) {
-			oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->used_server_list));
-			oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->tested_server_list));
-		}
-	}
+	PgSocket *oldest_connection;
 
+	oldest_connection = oldest_evictable(&user->evict_list, false);
 	if (oldest_connection) {
 		disconnect_server(oldest_connection, true, "evicted");
 		return true;
@@ -1205,17 +1367,11 @@ bool evict_idle_user_connection(PgUser *user)
 static bool evict_active_user_connection(PgUser *user)
 {
 	struct List *item;
-	PgPool *pool;
-	PgSocket *oldest_connection = NULL;
-
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->user != user)
-			continue;
-		oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->active_server_list));
-	}
+	PgSocket *oldest_connection;
 
-	if (oldest_connection) {
+	item = statlist_first(&user->active_list);
+	if (item) {
+		oldest_connection = container_of(item, PgSocket, user_evict_head);
 		disconnect_server(oldest_connection, true, "evicted");
 		return true;
 	}
@@ -1225,11 +1381,15 @@ static bool evict_active_user_connection(PgUser *user)
 static void enforce_user_connection_limit(PgUser *user)
 {
 	int max = user_max_connections(user);
+	int excess;
+
 	/* no limit to enforce if user is allocated unlimited connections */
 	if (max <= 0)
 		return;
 
-	while (user->connection_count > max) {
+	/* with workers, only this worker's share, see user_connection_excess() */
+	excess = user_connection_excess(user, max);
+	while (excess-- > 0) {
 		if (evict_idle_user_connection(user))
 			continue;
 		if (evict_active_user_connection(user))
@@ -1309,7 +1469,8 @@ void launch_new_connection(PgPool *pool)
 	int max;
 
 	/* allow only small number of connection attempts at a time */
-	if (!statlist_empty(&pool->new_server_list)) {
+	max = database_max_concurrent_logins(pool->db);
+	if (statlist_count(&pool->new_server_list) >= (pool->last_connect_failed ? 1 : max)) {
 		log_debug("launch_new_connection: already progress");
 		return;
 	}
@@ -1317,21 +1478,15 @@ void launch_new_connection(PgPool *pool)
 	/* if server bounces, don't retry too fast */
 	if (pool->last_connect_failed) {
 		usec_t now = get_cached_time();
-		if (now - pool->last_connect_time < cf_server_login_retry) {
+		if (now - pool->last_connect_time < pool->login_retry_delay) {
 			log_debug("launch_new_connection: last failed, not launching new connection yet, still waiting %" PRIu64 " s",
-				  (cf_server_login_retry - (now - pool->last_connect_time)) / USEC);
+				  (pool->login_retry_delay - (now - pool->last_connect_time)) / USEC);
 			return;
 		}
 	}
 
 	max = pool_server_count(pool);
 
-	/* when a cancel request is queued allow connections up to twice the pool size */
-	if (!statlist_empty(&pool->cancel_req_list) && max < (2 * pool_pool_size(pool))) {
-		log_debug("launch_new_connection: bypass pool limitations for cancel request");
-		goto force_new;
-	}
-
 	/* is it allowed to add servers? */
 	if (max >= pool_pool_size(pool) && pool->welcome_msg_ready) {
 		/* should we use reserve pool? */
@@ -1351,17 +1506,28 @@ void launch_new_connection(PgPool *pool)
 	}
 
 allow_new:
+	/*
+	 * Spread out connection storms over time.  Only check here, so
+	 * that a rate limited database does not evict connections below
+	 * for a launch that cannot happen.
+	 */
+	if (!database_connect_token(pool->db, false)) {
+		log_debug("launch_new_connection: database '%s' connect rate limit reached",
+			  pool->db->name);
+		return;
+	}
+
 	max = database_max_connections(pool->db);
 	if (max > 0) {
 		/* try to evict unused connections first */
-		while (pool->db->connection_count >= max) {
+		while (database_total_connections(pool->db) >= max) {
 			if (!evict_connection(pool->db)) {
 				break;
 			}
 		}
-		if (pool->db->connection_count >= max) {
+		if (database_total_connections(pool->db) >= max) {
 			log_debug("launch_new_connection: database '%s' full (%d >= %d)",
-				  pool->db->name, pool->db->connection_count, max);
+				  pool->db->name, database_total_connections(pool->db), max);
 			return;
 		}
 	}
@@ -1384,23 +1550,38 @@ allow_new:
 	max = user_max_connections(pool->user);
 	if (max > 0) {
 		/* try to evict unused connection first */
-		while (pool->user->connection_count >= max) {
+		while (user_total_connections(pool->user) >= max) {
 			if (!evict_idle_user_connection(pool->user)) {
 				break;
 			}
 		}
-		if (pool->user->connection_count >= max) {
+		if (user_total_connections(pool->user) >= max) {
 			log_debug("launch_new_connection: user '%s' full (%d >= %d)",
-				  pool->user->name, pool->user->connection_count, max);
+				  pool->user->name, user_total_connections(pool->user), max);
 			return;
 		}
 	}
 
-force_new:
+	/* other workers may have taken the last connections meanwhile */
+	if (!workers_connection_reserve(pool)) {
+		log_debug("launch_new_connection: database '%s' or user '%s' full over all workers",
+			  pool->db->name, pool->user->name);
+		return;
+	}
+
+	/* other workers may have taken the token meanwhile */
+	if (!database_connect_token(pool->db, true)) {
+		log_debug("launch_new_connection: database '%s' connect rate limit reached",
+			  pool->db->name);
+		workers_connection_release(pool);
+		return;
+	}
+
 	/* get free conn object */
 	server = slab_alloc(server_cache);
 	if (!server) {
 		log_debug("launch_new_connection: no memory");
+		workers_connection_release(pool);
 		return;
 	}
 
@@ -1413,6 +1594,7 @@ force_new:
 	pool->db->connection_count++;
 	pool->user->connection_count++;
 
+	probe3(server__launch, server, pool->db->name, pool->user->name);
 	dns_connect(server);
 }
 
@@ -1446,6 +1628,7 @@ PgSocket *accept_client(int sock, bool is_unix)
 		return NULL;
 	}
 
+	probe3(client__accept, client, sock, is_unix);
 	return client;
 }
 
@@ -1492,38 +1675,42 @@ bool finish_client_login(PgSocket *client)
 		return false;
 
 	slog_debug(client, "logged in");
+	probe3(client__login, client, client->db->name, client->login_user->name);
 
 	return true;
 }
 
+/* make client findable by its cancel key, once the key is final */
+void register_cancel_key(PgSocket *client)
+{
+	if (!list_empty(&client->cancel_head))
+		hashindex_remove(&cancel_index, &client->cancel_head);
+	if (!hashindex_insert(&cancel_index, &client->cancel_head))
+		slog_warning(client, "no memory for cancel key, cancel requests will fail");
+}
+
 /* client->cancel_key has requested client key */
 void accept_cancel_request(PgSocket *req)
 {
-	struct List *pitem, *citem;
+	struct List *item, *bucket;
 	PgPool *pool = NULL;
 	PgSocket *server = NULL, *client, *main_client = NULL;
 
 	Assert(req->state == CL_LOGIN);
 
 	/* find real client this is for */
-	statlist_for_each(pitem, &pool_list) {
-		pool = container_of(pitem, PgPool, head);
-		statlist_for_each(citem, &pool->active_client_list) {
-			client = container_of(citem, PgSocket, head);
-			if (memcmp(client->cancel_key, req->cancel_key, 8) == 0) {
-				main_client = client;
-				goto found;
-			}
-		}
-		statlist_for_each(citem, &pool->waiting_client_list) {
-			client = container_of(citem, PgSocket, head);
-			if (memcmp(client->cancel_key, req->cancel_key, 8) == 0) {
-				main_client = client;
-				goto found;
-			}
+	bucket = hashindex_bucket(&cancel_index, cancel_key_hash(req->cancel_key));
+	list_for_each(item, bucket) {
+		client = container_of(item, PgSocket, cancel_head);
+		if (client->state != CL_ACTIVE && client->state != CL_WAITING &&
+		    client->state != CL_WAITING_LOGIN)
+			continue;
+		if (memcmp(client->cancel_key, req->cancel_key, 8) == 0) {
+			main_client = client;
+			pool = client->pool;
+			break;
 		}
 	}
-found:
 
 	/* wrong key */
 	if (!main_client) {
@@ -1557,23 +1744,9 @@ found:
 	req->pool = pool;
 	change_client_state(req, CL_CANCEL);
 
-	/* need fresh connection */
-	launch_new_connection(pool);
-}
-
-void forward_cancel_request(PgSocket *server)
-{
-	bool res;
-	PgSocket *req = first_socket(&server->pool->cancel_req_list);
-
-	Assert(req != NULL && req->state == CL_CANCEL);
-	Assert(server->state == SV_LOGIN);
-
-	SEND_CancelRequest(res, server, req->cancel_key);
-	if (!res)
-		log_warning("sending cancel request failed: %s", strerror(errno));
-
-	change_client_state(req, CL_JUSTFREE);
+	/* send it on a connection of its own, outside the pool */
+	if (!forward_cancel_request(req, server))
+		disconnect_client(req, false, "cannot forward cancel request");
 }
 
 bool use_client_socket(int fd, PgAddr *addr,
@@ -1641,6 +1814,7 @@ bool use_client_socket(int fd, PgAddr *addr,
 	/* store old cancel key */
 	pktbuf_static(&tmp, client->cancel_key, 8);
 	pktbuf_put_uint64(&tmp, ckey);
+	register_cancel_key(client);
 
 	/* store old fds */
 	client->tmp_sk_oldfd = oldfd;
@@ -1794,6 +1968,7 @@ static void for_each_server_filtered(PgPool *pool, void (*func)(PgSocket *sk), b
 static void tag_dirty(PgSocket *sk)
 {
 	sk->close_needed = true;
+	socket_timeout_arm(sk);
 }
 
 void tag_pool_dirty(PgPool *pool)
@@ -1826,15 +2001,32 @@ void tag_pool_dirty(PgPool *pool)
 	}
 }
 
+/* let per_loop_maint() visit the pool until it has nothing to do */
+void mark_pool_active(PgPool *pool)
+{
+	if (list_empty(&pool->active_head))
+		statlist_append(&active_pool_list, &pool->active_head);
+}
+
+void mark_database_active(PgDatabase *db)
+{
+	struct List *item;
+	PgPool *pool;
+
+	list_for_each(item, &db->pool_list) {
+		pool = container_of(item, PgPool, db_head);
+		mark_pool_active(pool);
+	}
+}
+
 void tag_database_dirty(PgDatabase *db)
 {
 	struct List *item;
 	PgPool *pool;
 
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		if (pool->db == db)
-			tag_pool_dirty(pool);
+	list_for_each(item, &db->pool_list) {
+		pool = container_of(item, PgPool, db_head);
+		tag_pool_dirty(pool);
 	}
 }
 
@@ -1921,6 +2113,8 @@ void reuse_just_freed_objects(void)
 			close_works = sbuf_close(&sk->sbuf);
 		}
 	}
+
+	reuse_just_freed_cancels();
 }
 
 void objects_cleanup(void)
@@ -1946,6 +2140,10 @@ void objects_cleanup(void)
 	memset(&pool_list, 0, sizeof pool_list);
 	memset(&user_tree, 0, sizeof user_tree);
 	memset(&autodatabase_idle_list, 0, sizeof autodatabase_idle_list);
+	hashindex_destroy(&database_index);
+	hashindex_destroy(&pool_index);
+	hashindex_destroy(&cancel_index);
+	cancel_cleanup();
 
 	slab_destroy(server_cache);
 	server_cache = NULL;
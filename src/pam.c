@@ -27,6 +27,10 @@
 #include <pthread.h>
 #include <security/pam_appl.h>
 
+#include <usual/slab.h>
+
+#include "common/scram-common.h"
+
 /* The request is waiting in the queue or being authenticated */
 #define PAM_STATUS_IN_PROGRESS  1
 /* The request was successfully authenticated */
@@ -34,15 +38,11 @@
 /* The request failed authentication */
 #define PAM_STATUS_FAILED       3
 
-/*
- * How many microseconds to sleep between calls to pam_poll in
- * pam_auth_begin when the queue is full.
- * Default is 100 milliseconds.
- */
-#define PAM_QUEUE_WAIT_SLEEP_MCS	(100*1000)
-
 
 struct pam_auth_request {
+	/* Entry in pam_pending_list or pam_done_list */
+	struct List head;
+
 	/* The socket we check authentication for */
 	PgSocket *client;
 
@@ -61,6 +61,9 @@ struct pam_auth_request {
 	/* The request status, one of the PAM_STATUS_* constants */
 	int status;
 
+	/* The result was taken from the cache, PAM was not asked */
+	bool cached;
+
 	/* The username (same as in client->login_user->name).
 	 * See the comment for remote_addr.
 	 */
@@ -72,33 +75,41 @@ struct pam_auth_request {
 
 
 /*
- * All incoming requests are kept in a queue which is implemented using a ring buffer.
- * Such structure allows to avoid memory reallocation thus minimizing amount of
- * synchronization to be done between threads.
- *
- * pam_first_taken_slot points to the first element in the queue;
- * pam_first_free_slot points to the next slot after the last element in the queue.
- *
- * if pam_first_taken_slot == pam_first_free_slot then the queue is considered empty;
+ * Incoming requests wait in pam_pending_list until one of the workers
+ * takes them, and the worker moves them to pam_done_list when PAM has
+ * answered.  The lists grow as needed, so pam_auth_begin() never waits:
+ * the client stays paused until pam_poll() finishes its request.  The
+ * number of requests is limited by the number of clients in login.
  *
+ * Requests are allocated and freed only in the main thread, the mutex
+ * protects the two lists.
  */
-volatile int pam_first_taken_slot;
-volatile int pam_first_free_slot;
-struct pam_auth_request pam_auth_queue[PAM_REQUEST_QUEUE_SIZE];
+static STATLIST(pam_pending_list);
+static STATLIST(pam_done_list);
+static pthread_mutex_t pam_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pam_data_available = PTHREAD_COND_INITIALIZER;
+
+static struct Slab *pam_request_cache;
 
-pthread_t pam_worker_thread;
 
 /*
- * Mutex serializes access to the queue's tail when we add new requests or
- * check that we reach the end of the queue in the worker thread.
- *
- * Head and tail are modified only in the main thread. In theory, being sure that they
- * are properly aligned we can access them directly without any risk for data races.
- * Practically, it is better to secure them anyway to increase overall stability and
- * provide faster notification of new requests via the condition variable.
+ * Recent successful logins, so that a reconnecting client does not go
+ * through the PAM stack again within pam_cache_ttl.  Entries are found
+ * by a keyed hash of user name, password and client address in a
+ * direct-mapped table, a colliding entry replaces the old one.  Failed
+ * logins are never cached.  Used only from the main thread.
  */
-pthread_mutex_t pam_queue_tail_mutex;
-pthread_cond_t pam_data_available;
+struct pam_cache_entry {
+	bool used;
+	uint8_t key[SCRAM_KEY_LEN];
+	usec_t expires;
+};
+
+static struct pam_cache_entry pam_cache[PAM_CACHE_SIZE];
+static uint8_t pam_cache_secret[SCRAM_KEY_LEN];
+static int pam_cache_used;
+static uint64_t pam_cache_hits;
+static uint64_t pam_cache_misses;
 
 /* Forward declarations */
 static void* pam_auth_worker(void *arg);
@@ -111,72 +122,124 @@ static bool pam_check_passwd(struct pam_auth_request *request);
  */
 void pam_init(void)
 {
-	int rc;
+	pthread_t thread;
+	int workers = cf_pam_workers > 0 ? cf_pam_workers : 1;
+	int i, rc;
 
-	pam_first_taken_slot = 0;
-	pam_first_free_slot = 0;
+	pam_request_cache = slab_create("pam_request_cache", sizeof(struct pam_auth_request), 0, NULL, USUAL_ALLOC);
+	if (!pam_request_cache)
+		die("cannot create PAM request cache");
 
-	rc = pthread_mutex_init(&pam_queue_tail_mutex, NULL);
-	if (rc != 0) {
-		die("failed to initialize a mutex: %s", strerror(errno));
-	}
+	get_random_bytes(pam_cache_secret, sizeof(pam_cache_secret));
 
-	rc = pthread_cond_init(&pam_data_available, NULL);
-	if (rc != 0) {
-		die("failed to initialize a condition variable: %s", strerror(errno));
+	for (i = 0; i < workers; i++) {
+		rc = pthread_create(&thread, NULL, &pam_auth_worker, NULL);
+		if (rc != 0) {
+			die("failed to create the authentication thread: %s", strerror(rc));
+		}
 	}
+}
+
+static struct pam_cache_entry *pam_cache_find(const struct pam_auth_request *request, uint8_t *key)
+{
+	char raddr[PGADDR_BUF];
+	scram_HMAC_ctx ctx;
+
+	/* the client port changes on every connection, use only the address */
+	pga_ntop(&request->remote_addr, raddr, sizeof(raddr));
+
+	scram_HMAC_init(&ctx, pam_cache_secret, sizeof(pam_cache_secret));
+	scram_HMAC_update(&ctx, request->username, strlen(request->username) + 1);
+	scram_HMAC_update(&ctx, request->password, strlen(request->password) + 1);
+	scram_HMAC_update(&ctx, raddr, strlen(raddr));
+	scram_HMAC_final(key, &ctx);
 
-	rc = pthread_create(&pam_worker_thread, NULL, &pam_auth_worker, NULL);
-	if (rc != 0) {
-		die("failed to create the authentication thread: %s", strerror(errno));
+	return &pam_cache[(key[0] | key[1] << 8 | key[2] << 16 | (uint32_t) key[3] << 24) % PAM_CACHE_SIZE];
+}
+
+static bool pam_cache_lookup(const struct pam_auth_request *request)
+{
+	struct pam_cache_entry *entry;
+	uint8_t key[SCRAM_KEY_LEN];
+
+	if (cf_pam_cache_ttl <= 0)
+		return false;
+
+	entry = pam_cache_find(request, key);
+	if (entry->used && entry->expires > get_cached_time() &&
+	    memcmp(entry->key, key, sizeof(key)) == 0) {
+		pam_cache_hits++;
+		return true;
 	}
+	pam_cache_misses++;
+	return false;
+}
+
+static void pam_cache_store(const struct pam_auth_request *request)
+{
+	struct pam_cache_entry *entry;
+	uint8_t key[SCRAM_KEY_LEN];
+
+	if (cf_pam_cache_ttl <= 0)
+		return;
+
+	entry = pam_cache_find(request, key);
+	if (!entry->used)
+		pam_cache_used++;
+	entry->used = true;
+	memcpy(entry->key, key, sizeof(key));
+	entry->expires = get_cached_time() + cf_pam_cache_ttl;
+}
+
+void pam_cache_info(int *size, int *used, uint64_t *hits, uint64_t *misses)
+{
+	*size = cf_pam_cache_ttl > 0 ? PAM_CACHE_SIZE : 0;
+	*used = pam_cache_used;
+	*hits = pam_cache_hits;
+	*misses = pam_cache_misses;
 }
 
 /*
  * Initiate the authentication request using PAM. The request result will be
- * available during next calls to pam_poll(). The function might block if the
- * request queue is full until there are free slots available.
+ * available during next calls to pam_poll().  The client must be paused
+ * by the caller and stays so until then.
  * The function is called only from the main thread.
  */
 void pam_auth_begin(PgSocket *client, const char *passwd)
 {
-	int next_free_slot = (pam_first_free_slot + 1) % PAM_REQUEST_QUEUE_SIZE;
 	struct pam_auth_request *request;
 
-	slog_debug(
-		client,
-		"pam_auth_begin(): pam_first_taken_slot=%d, pam_first_free_slot=%d",
-		pam_first_taken_slot, pam_first_free_slot);
-
-	client->wait_for_auth = true;
-
-	/* Check that we have free slots in the queue, and if no
-	 * then block until one is available.
-	 */
-	if (next_free_slot == pam_first_taken_slot)
-		slog_debug(client, "PAM queue is full, waiting");
-
-	while (next_free_slot == pam_first_taken_slot) {
-		if (pam_poll() == 0) {
-			/* Sleep a bit between consequent queue checks to avoid consuming too much CPU */
-			usleep(PAM_QUEUE_WAIT_SLEEP_MCS);
-		}
+	request = slab_alloc(pam_request_cache);
+	if (!request) {
+		disconnect_client(client, true, "no memory for PAM request");
+		return;
 	}
 
-	pthread_mutex_lock(&pam_queue_tail_mutex);
-
-	request = &pam_auth_queue[pam_first_free_slot];
+	client->wait_for_auth = true;
 
+	list_init(&request->head);
 	request->client = client;
 	request->connect_time = client->connect_time;
 	request->status = PAM_STATUS_IN_PROGRESS;
+	request->cached = false;
 	memcpy(&request->remote_addr, &client->remote_addr, sizeof(client->remote_addr));
 	safe_strcpy(request->username, client->login_user->name, MAX_USERNAME);
 	safe_strcpy(request->password, passwd, MAX_PASSWORD);
 
-	pam_first_free_slot = next_free_slot;
+	if (pam_cache_lookup(request)) {
+		/* finished by the next pam_poll() like any other request */
+		slog_debug(client, "pam_auth_begin(): cached result");
+		request->status = PAM_STATUS_SUCCESS;
+		request->cached = true;
+		pthread_mutex_lock(&pam_queue_mutex);
+		statlist_append(&pam_done_list, &request->head);
+		pthread_mutex_unlock(&pam_queue_mutex);
+		return;
+	}
 
-	pthread_mutex_unlock(&pam_queue_tail_mutex);
+	pthread_mutex_lock(&pam_queue_mutex);
+	statlist_append(&pam_pending_list, &request->head);
+	pthread_mutex_unlock(&pam_queue_mutex);
 	pthread_cond_signal(&pam_data_available);
 }
 
@@ -186,56 +249,72 @@ void pam_auth_begin(PgSocket *client, const char *passwd)
  */
 int pam_poll(void)
 {
+	struct StatList done;
 	struct pam_auth_request *request;
+	struct List *item;
 	int count = 0;
 
-	while (pam_first_taken_slot != pam_first_free_slot) {
-		request = &pam_auth_queue[pam_first_taken_slot];
+	statlist_init(&done, "pam_done");
+	pthread_mutex_lock(&pam_queue_mutex);
+	while ((item = statlist_pop(&pam_done_list)) != NULL)
+		statlist_append(&done, item);
+	pthread_mutex_unlock(&pam_queue_mutex);
 
-		if (request->status == PAM_STATUS_IN_PROGRESS) {
-			/* When still-in-progress slot is found there is no need to continue
-			 * the loop since all further requests will be in progress too.
-			 */
-			break;
-		}
+	while ((item = statlist_pop(&done)) != NULL) {
+		request = container_of(item, struct pam_auth_request, head);
+
+		if (request->status == PAM_STATUS_SUCCESS && !request->cached)
+			pam_cache_store(request);
 
 		if (is_valid_socket(request)) {
 			pam_auth_finish(request);
 		}
 
+		memset(request->password, 0, sizeof(request->password));
+		slab_free(pam_request_cache, request);
 		count++;
-		pam_first_taken_slot = (pam_first_taken_slot + 1) % PAM_REQUEST_QUEUE_SIZE;
 	}
 
 	return count;
 }
 
+/* Requests waiting for a worker, for SHOW LISTS */
+int pam_queue_count(void)
+{
+	int count;
+
+	pthread_mutex_lock(&pam_queue_mutex);
+	count = statlist_count(&pam_pending_list);
+	pthread_mutex_unlock(&pam_queue_mutex);
+	return count;
+}
+
 
 /*
- * The authentication thread function.
- * Performs scanning the queue for new requests and calling PAM for them.
+ * The authentication thread function, pam_workers of them run.
+ * Takes requests from the queue and calls PAM for them.
  */
 static void* pam_auth_worker(void *arg)
 {
-	int current_slot = pam_first_taken_slot;
 	struct pam_auth_request *request;
+	struct List *item;
 
 	while (true) {
 
 		/* Wait for new data in the queue */
-		pthread_mutex_lock(&pam_queue_tail_mutex);
+		pthread_mutex_lock(&pam_queue_mutex);
 
-		while (current_slot == pam_first_free_slot) {
-			pthread_cond_wait(&pam_data_available, &pam_queue_tail_mutex);
+		while (statlist_empty(&pam_pending_list)) {
+			pthread_cond_wait(&pam_data_available, &pam_queue_mutex);
 		}
 
-		pthread_mutex_unlock(&pam_queue_tail_mutex);
+		item = statlist_pop(&pam_pending_list);
+
+		pthread_mutex_unlock(&pam_queue_mutex);
 
-		log_debug("pam_auth_worker(): processing slot %d", current_slot);
+		request = container_of(item, struct pam_auth_request, head);
 
-		/* We have at least one request in the queue */
-		request = &pam_auth_queue[current_slot];
-		current_slot = (current_slot + 1) % PAM_REQUEST_QUEUE_SIZE;
+		log_debug("pam_auth_worker(): processing request for %s", request->username);
 
 		/* If the socket is already in the wrong state or reused then ignore it.
 		 * This check is not safe and should not be trusted (the socket state
@@ -243,18 +322,19 @@ static void* pam_auth_worker(void *arg)
 		 * sockets and thus save some time.
 		 */
 		if (!is_valid_socket(request)) {
-			log_debug("pam_auth_worker(): invalid socket in slot %d", current_slot);
+			log_debug("pam_auth_worker(): invalid socket for %s", request->username);
 			request->status = PAM_STATUS_FAILED;
-			continue;
-		}
-
-		if (pam_check_passwd(request)) {
+		} else if (pam_check_passwd(request)) {
 			request->status = PAM_STATUS_SUCCESS;
 		} else {
 			request->status = PAM_STATUS_FAILED;
 		}
 
 		log_debug("pam_auth_worker(): authentication completed, status=%d", request->status);
+
+		pthread_mutex_lock(&pam_queue_mutex);
+		statlist_append(&pam_done_list, &request->head);
+		pthread_mutex_unlock(&pam_queue_mutex);
 	}
 
 	return NULL;
@@ -424,4 +504,15 @@ int pam_poll(void)
 	return 0;
 }
 
+int pam_queue_count(void)
+{
+	return 0;
+}
+
+void pam_cache_info(int *size, int *used, uint64_t *hits, uint64_t *misses)
+{
+	*size = *used = 0;
+	*hits = *misses = 0;
+}
+
 #endif
@@ -328,6 +328,8 @@ static void pool_accept(evutil_socket_t sock, short flags, void *arg)
 	socklen_t len = sizeof(raddr);
 	bool is_unix = pga_is_unix(&ls->addr);
 
+	loop_stats_socket();
+
 	if(!(flags & EV_READ)) {
 		log_warning("no EV_READ in pool_accept");
 		return;
@@ -538,7 +540,8 @@ void pooler_setup(void)
 		if (!ok)
 			die("failed to parse listen_addr list: %s", cf_listen_addr);
 
-		if (cf_unix_socket_dir && *cf_unix_socket_dir)
+		/* with workers, only the first one listens on the unix socket */
+		if (cf_unix_socket_dir && *cf_unix_socket_dir && worker_id == 0)
 			create_unix_socket(cf_unix_socket_dir, cf_listen_port);
 	}
 
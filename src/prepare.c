@@ -0,0 +1,834 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Protocol-level prepared statements for transaction pooling.
+ *
+ * Each distinct Parse body (query text and parameter types) gets a
+ * global id and is prepared on servers as "PGBOUNCER_<id>".  Client
+ * statement names are mapped to those in Parse, Bind, Describe and
+ * Close packets.  Every server connection remembers which statements
+ * it has, so a statement is parsed again only when the client lands
+ * on a server that lacks it.  The responses to such injected packets
+ * are hidden from the client.
+ *
+ * To match server responses with the packets that caused them, the
+ * server keeps a queue of the Parse and Close packets sent to it,
+ * plus a marker for each Sync.  ErrorResponse makes the server skip
+ * everything up to next Sync, so the rest of the current segment is
+ * dropped from the queue and the registry is corrected to match.
+ */
+
+#include "bouncer.h"
+
+#include <usual/cbtree.h>
+
+int cf_max_prepared_statements;
+
+/* statement name used when pgbouncer needs a harmless Close */
+#define NOOP_STATEMENT	"PGBOUNCER_NOOP"
+
+/* distinct Parse body, shared between clients and servers */
+struct PreparedQuery {
+	uint64_t id;
+	int refcnt;
+	char server_name[32];
+	unsigned int body_len;
+	uint8_t body[FLEX_ARRAY];	/* query, nparams, param oids */
+};
+
+/* client statement name -> query */
+struct ClientStatement {
+	struct PreparedQuery *query;
+	unsigned int name_len;
+	char name[FLEX_ARRAY];
+};
+
+/* statement prepared on a server connection */
+struct ServerStatement {
+	struct AANode tree_node;
+	struct List lru_node;
+	struct PreparedQuery *query;
+};
+
+/* what to do with the response to a packet sent to server */
+enum PendingKind {
+	PS_FORWARD,		/* client's own packet, pass response as-is */
+	PS_PARSE,		/* renamed client Parse */
+	PS_PARSE_SKIP,		/* injected Parse, hide ParseComplete */
+	PS_CLOSE_SKIP,		/* eviction Close, hide CloseComplete */
+	PS_CLOSE_AS_PARSE,	/* stands in for Parse of existing stmt */
+	PS_SYNC,		/* Sync, Query or FunctionCall */
+};
+
+struct PendingResponse {
+	uint8_t kind;
+	struct PreparedQuery *query;
+};
+
+struct ServerPrepared {
+	struct AATree tree;		/* ServerStatement by query */
+	struct List lru;		/* most recently used first */
+
+	/* ring buffer of PendingResponse */
+	struct PendingResponse *pending;
+	unsigned int pending_head;
+	unsigned int pending_count;
+	unsigned int pending_alloc;
+};
+
+static struct CBTree *query_cache;
+static uint64_t next_query_id;
+
+/*
+ * Global query cache.
+ */
+
+static size_t query_key(void *ctx, void *obj, const void **dst_p)
+{
+	struct PreparedQuery *query = obj;
+	*dst_p = query->body;
+	return query->body_len;
+}
+
+static struct PreparedQuery *query_get(const uint8_t *body, unsigned int body_len)
+{
+	struct PreparedQuery *query;
+
+	if (!query_cache) {
+		query_cache = cbtree_create(query_key, NULL, NULL, NULL);
+		if (!query_cache)
+			return NULL;
+		/*
+		 * Servers taken over from a previous process may still
+		 * have statements from it, so don't start ids from zero.
+		 */
+		next_query_id = get_cached_time();
+	}
+
+	query = cbtree_lookup(query_cache, body, body_len);
+	if (query) {
+		query->refcnt++;
+		return query;
+	}
+
+	query = malloc(offsetof(struct PreparedQuery, body) + body_len);
+	if (!query)
+		return NULL;
+	query->id = ++next_query_id;
+	query->refcnt = 1;
+	snprintf(query->server_name, sizeof(query->server_name), "PGBOUNCER_%" PRIu64, query->id);
+	query->body_len = body_len;
+	memcpy(query->body, body, body_len);
+	if (!cbtree_insert(query_cache, query)) {
+		free(query);
+		return NULL;
+	}
+	return query;
+}
+
+static void query_put(struct PreparedQuery *query)
+{
+	if (!query || --query->refcnt > 0)
+		return;
+	cbtree_delete(query_cache, query->body, query->body_len);
+	free(query);
+}
+
+/*
+ * Client statement map.
+ */
+
+static size_t client_statement_key(void *ctx, void *obj, const void **dst_p)
+{
+	struct ClientStatement *stmt = obj;
+	*dst_p = stmt->name;
+	return stmt->name_len;
+}
+
+static bool client_statement_free(void *ctx, void *obj)
+{
+	struct ClientStatement *stmt = obj;
+	query_put(stmt->query);
+	free(stmt);
+	return true;
+}
+
+static struct PreparedQuery *client_statement_lookup(PgSocket *client, const char *name)
+{
+	struct ClientStatement *stmt;
+
+	if (!client->prepared_statements)
+		return NULL;
+	stmt = cbtree_lookup(client->prepared_statements, name, strlen(name));
+	return stmt ? stmt->query : NULL;
+}
+
+/* takes over the reference to query */
+static bool client_statement_add(PgSocket *client, const char *name, struct PreparedQuery *query)
+{
+	struct ClientStatement *stmt;
+	unsigned int len = strlen(name);
+
+	if (!client->prepared_statements) {
+		client->prepared_statements = cbtree_create(client_statement_key, client_statement_free, client, NULL);
+		if (!client->prepared_statements)
+			return false;
+	}
+
+	/* Parse with existing name replaces the old statement */
+	cbtree_delete(client->prepared_statements, name, len);
+
+	stmt = malloc(offsetof(struct ClientStatement, name) + len + 1);
+	if (!stmt)
+		return false;
+	stmt->query = query;
+	stmt->name_len = len;
+	memcpy(stmt->name, name, len + 1);
+	if (!cbtree_insert(client->prepared_statements, stmt)) {
+		free(stmt);
+		return false;
+	}
+	return true;
+}
+
+void free_client_prepared(PgSocket *client)
+{
+	if (client->prepared_statements) {
+		cbtree_destroy(client->prepared_statements);
+		client->prepared_statements = NULL;
+	}
+	if (client->prepare_buf) {
+		pktbuf_free(client->prepare_buf);
+		client->prepare_buf = NULL;
+	}
+}
+
+/*
+ * Server statement registry.
+ */
+
+static int server_statement_cmp(uintptr_t val, struct AANode *node)
+{
+	struct ServerStatement *stmt = container_of(node, struct ServerStatement, tree_node);
+	uintptr_t query = (uintptr_t)stmt->query;
+
+	if (val < query)
+		return -1;
+	return val > query ? 1 : 0;
+}
+
+static void server_statement_free(struct AANode *node, void *arg)
+{
+	struct ServerStatement *stmt = container_of(node, struct ServerStatement, tree_node);
+	list_del(&stmt->lru_node);
+	query_put(stmt->query);
+	free(stmt);
+}
+
+static struct ServerPrepared *server_prepared(PgSocket *server)
+{
+	struct ServerPrepared *sp = server->server_prepared;
+	int i;
+
+	if (sp)
+		return sp;
+
+	sp = zmalloc(sizeof(*sp));
+	if (!sp)
+		return NULL;
+	aatree_init(&sp->tree, server_statement_cmp, server_statement_free);
+	list_init(&sp->lru);
+	server->server_prepared = sp;
+
+	/* ReadyForQuery packets already on the way belong to no packet of ours */
+	for (i = 0; server->link && i < server->link->expect_rfq_count; i++) {
+		if (!prepare_server_sync(server))
+			return NULL;
+	}
+	return sp;
+}
+
+static struct ServerStatement *server_statement_lookup(struct ServerPrepared *sp, struct PreparedQuery *query)
+{
+	struct AANode *node = aatree_search(&sp->tree, (uintptr_t)query);
+	return node ? container_of(node, struct ServerStatement, tree_node) : NULL;
+}
+
+static bool server_statement_add(struct ServerPrepared *sp, struct PreparedQuery *query)
+{
+	struct ServerStatement *stmt;
+
+	stmt = malloc(sizeof(*stmt));
+	if (!stmt)
+		return false;
+	query->refcnt++;
+	stmt->query = query;
+	list_init(&stmt->lru_node);
+	list_prepend(&sp->lru, &stmt->lru_node);
+	aatree_insert(&sp->tree, (uintptr_t)query, &stmt->tree_node);
+	return true;
+}
+
+static void server_statement_remove(struct ServerPrepared *sp, struct PreparedQuery *query)
+{
+	if (server_statement_lookup(sp, query))
+		aatree_remove(&sp->tree, (uintptr_t)query);
+}
+
+void free_server_prepared(PgSocket *server)
+{
+	struct ServerPrepared *sp = server->server_prepared;
+
+	if (!sp)
+		return;
+	prepare_server_release(server);
+	aatree_destroy(&sp->tree);
+	free(sp->pending);
+	free(sp);
+	server->server_prepared = NULL;
+}
+
+/*
+ * Queue of responses expected from server.
+ */
+
+static bool pending_push(struct ServerPrepared *sp, enum PendingKind kind, struct PreparedQuery *query)
+{
+	struct PendingResponse *pr;
+
+	if (sp->pending_count == sp->pending_alloc) {
+		unsigned int i, alloc = sp->pending_alloc ? sp->pending_alloc * 2 : 16;
+		struct PendingResponse *list = malloc(alloc * sizeof(*list));
+		if (!list)
+			return false;
+		for (i = 0; i < sp->pending_count; i++)
+			list[i] = sp->pending[(sp->pending_head + i) % sp->pending_alloc];
+		free(sp->pending);
+		sp->pending = list;
+		sp->pending_alloc = alloc;
+		sp->pending_head = 0;
+	}
+
+	pr = &sp->pending[(sp->pending_head + sp->pending_count) % sp->pending_alloc];
+	pr->kind = kind;
+	pr->query = query;
+	if (query)
+		query->refcnt++;
+	sp->pending_count++;
+	return true;
+}
+
+static struct PendingResponse *pending_first(struct ServerPrepared *sp)
+{
+	if (sp->pending_count == 0)
+		return NULL;
+	return &sp->pending[sp->pending_head];
+}
+
+static void pending_pop(struct ServerPrepared *sp)
+{
+	struct PendingResponse *pr = pending_first(sp);
+
+	query_put(pr->query);
+	sp->pending_head = (sp->pending_head + 1) % sp->pending_alloc;
+	sp->pending_count--;
+}
+
+/*
+ * The packet behind the first queued response was not executed,
+ * because server skips everything after an error until next Sync.
+ */
+static void pending_discard(struct ServerPrepared *sp)
+{
+	struct PendingResponse *pr = pending_first(sp);
+
+	switch (pr->kind) {
+	case PS_PARSE:
+	case PS_PARSE_SKIP:
+		server_statement_remove(sp, pr->query);
+		break;
+	case PS_CLOSE_SKIP:
+		/* statement was not closed after all */
+		if (!server_statement_lookup(sp, pr->query)) {
+			if (!server_statement_add(sp, pr->query))
+				log_warning("out of memory, prepared statement %s is lost", pr->query->server_name);
+		}
+		break;
+	}
+	pending_pop(sp);
+}
+
+/* forget packets without response; server is not linked anymore */
+void prepare_server_release(PgSocket *server)
+{
+	struct ServerPrepared *sp = server->server_prepared;
+
+	if (!sp)
+		return;
+	while (sp->pending_count > 0)
+		pending_pop(sp);
+}
+
+bool prepare_server_sync(PgSocket *server)
+{
+	struct ServerPrepared *sp = server->server_prepared;
+
+	if (!sp)
+		return true;
+	return pending_push(sp, PS_SYNC, NULL);
+}
+
+/*
+ * Packet building.
+ */
+
+static bool send_close(PgSocket *client, const char *name)
+{
+	PktBuf *buf = pktbuf_temp();
+
+	pktbuf_write_generic(buf, 'C', "cs", 'S', name);
+	return sbuf_queue_packet(&client->sbuf, &client->link->sbuf, buf);
+}
+
+static bool send_parse(PgSocket *client, struct PreparedQuery *query)
+{
+	PktBuf *buf = pktbuf_temp();
+
+	pktbuf_start_packet(buf, 'P');
+	pktbuf_put_string(buf, query->server_name);
+	pktbuf_put_bytes(buf, query->body, query->body_len);
+	pktbuf_finish_packet(buf);
+	return sbuf_queue_packet(&client->sbuf, &client->link->sbuf, buf);
+}
+
+static bool send_raw(PgSocket *client, const uint8_t *data, unsigned int len)
+{
+	PktBuf *buf = pktbuf_temp();
+
+	pktbuf_put_bytes(buf, data, len);
+	return sbuf_queue_packet(&client->sbuf, &client->link->sbuf, buf);
+}
+
+/*
+ * Make room for one more statement on the server, closing the least
+ * recently used ones.
+ */
+static bool evict_server_statements(PgSocket *client, struct ServerPrepared *sp)
+{
+	struct ServerStatement *stmt;
+	struct List *item;
+
+	while (sp->tree.count > 0 && sp->tree.count >= cf_max_prepared_statements) {
+		item = list_last(&sp->lru);
+		stmt = container_of(item, struct ServerStatement, lru_node);
+		slog_debug(client, "evicting prepared statement %s", stmt->query->server_name);
+		if (!send_close(client, stmt->query->server_name))
+			return false;
+		if (!pending_push(sp, PS_CLOSE_SKIP, stmt->query))
+			return false;
+		aatree_remove(&sp->tree, (uintptr_t)stmt->query);
+	}
+	return true;
+}
+
+/*
+ * Make sure the statement exists on client's server.  Returns false
+ * on out of memory.
+ */
+static bool ensure_prepared(PgSocket *client, struct PreparedQuery *query, bool *exists_p)
+{
+	struct ServerPrepared *sp = client->link->server_prepared;
+	struct ServerStatement *stmt;
+
+	stmt = server_statement_lookup(sp, query);
+	if (stmt) {
+		list_del(&stmt->lru_node);
+		list_prepend(&sp->lru, &stmt->lru_node);
+		*exists_p = true;
+		return true;
+	}
+
+	*exists_p = false;
+	if (!evict_server_statements(client, sp))
+		return false;
+	if (!send_parse(client, query))
+		return false;
+	return server_statement_add(sp, query);
+}
+
+/*
+ * Client packets.
+ */
+
+static bool handle_parse(PgSocket *client, PktHdr *pkt, struct ServerPrepared *sp)
+{
+	struct PreparedQuery *query;
+	const char *name;
+	const uint8_t *body;
+	unsigned int body_len;
+	bool exists;
+
+	if (!mbuf_get_string(&pkt->data, &name))
+		return false;
+	body_len = mbuf_avail_for_read(&pkt->data);
+	if (!mbuf_get_bytes(&pkt->data, body_len, &body))
+		return false;
+
+	query = query_get(body, body_len);
+	if (!query)
+		return false;
+	if (!client_statement_add(client, name, query)) {
+		query_put(query);
+		return false;
+	}
+
+	slog_noise(client, "prepared statement %s as %s", name, query->server_name);
+
+	if (!ensure_prepared(client, query, &exists))
+		return false;
+	if (exists) {
+		/* already there, answer client's Parse with a no-op */
+		if (!send_close(client, NOOP_STATEMENT))
+			return false;
+		return pending_push(sp, PS_CLOSE_AS_PARSE, NULL);
+	}
+	return pending_push(sp, PS_PARSE, query);
+}
+
+static bool handle_bind(PgSocket *client, PktHdr *pkt, struct ServerPrepared *sp,
+			struct PreparedQuery *query)
+{
+	PktBuf *buf;
+	const char *portal, *name;
+	const uint8_t *rest;
+	unsigned int rest_len;
+	bool exists;
+
+	if (!mbuf_get_string(&pkt->data, &portal) || !mbuf_get_string(&pkt->data, &name))
+		return false;
+	rest_len = mbuf_avail_for_read(&pkt->data);
+	if (!mbuf_get_bytes(&pkt->data, rest_len, &rest))
+		return false;
+
+	if (!ensure_prepared(client, query, &exists))
+		return false;
+	if (!exists && !pending_push(sp, PS_PARSE_SKIP, query))
+		return false;
+
+	buf = pktbuf_temp();
+	pktbuf_start_packet(buf, 'B');
+	pktbuf_put_string(buf, portal);
+	pktbuf_put_string(buf, query->server_name);
+	pktbuf_put_bytes(buf, rest, rest_len);
+	pktbuf_finish_packet(buf);
+	return sbuf_queue_packet(&client->sbuf, &client->link->sbuf, buf);
+}
+
+static bool handle_describe(PgSocket *client, struct ServerPrepared *sp, struct PreparedQuery *query)
+{
+	PktBuf *buf;
+	bool exists;
+
+	if (!ensure_prepared(client, query, &exists))
+		return false;
+	if (!exists && !pending_push(sp, PS_PARSE_SKIP, query))
+		return false;
+
+	buf = pktbuf_temp();
+	pktbuf_write_generic(buf, 'D', "cs", 'S', query->server_name);
+	return sbuf_queue_packet(&client->sbuf, &client->link->sbuf, buf);
+}
+
+static bool handle_close(PgSocket *client, const char *name, struct ServerPrepared *sp)
+{
+	/*
+	 * Server keeps the statement for other clients, just send
+	 * something that produces CloseComplete.
+	 */
+	cbtree_delete(client->prepared_statements, name, strlen(name));
+	if (!send_close(client, NOOP_STATEMENT))
+		return false;
+	return pending_push(sp, PS_FORWARD, NULL);
+}
+
+/*
+ * Look at the start of the packet and find the client statement it
+ * refers to.  Returns false if that cannot be decided from the data
+ * available, *name_p is NULL if the packet does not need rewriting.
+ */
+static bool statement_name(PktHdr *pkt, const char **name_p)
+{
+	struct MBuf data;
+	const char *name;
+	char kind;
+
+	*name_p = NULL;
+	mbuf_copy(&pkt->data, &data);
+	switch (pkt->type) {
+	case 'B':
+		if (!mbuf_get_string(&data, &name))
+			return false;
+		/* fallthrough */
+	case 'P':
+		if (!mbuf_get_string(&data, &name))
+			return false;
+		break;
+	case 'D':
+	case 'C':
+		if (!mbuf_get_char(&data, &kind))
+			return false;
+		if (kind != 'S')
+			return true;
+		if (!mbuf_get_string(&data, &name))
+			return false;
+		break;
+	default:
+		return true;
+	}
+	if (*name)
+		*name_p = name;
+	return true;
+}
+
+/* pass the packet through, queue slot for its response */
+static bool forward_packet(PgSocket *client, PktHdr *pkt, struct ServerPrepared *sp)
+{
+	if (pkt->type == 'P' || pkt->type == 'C')
+		return pending_push(sp, PS_FORWARD, NULL);
+	return true;
+}
+
+/*
+ * Rewrite a complete packet.  Returns false if it should be forwarded
+ * unchanged, *failed_p is set on out of memory.
+ */
+static bool rewrite_packet(PgSocket *client, PktHdr *pkt, const char *name,
+			   struct ServerPrepared *sp, bool *failed_p)
+{
+	struct PreparedQuery *query = NULL;
+	bool ok;
+
+	*failed_p = false;
+	if (pkt->type != 'P') {
+		query = client_statement_lookup(client, name);
+		/* unknown statement, let server report the error */
+		if (!query)
+			return false;
+	}
+
+	switch (pkt->type) {
+	case 'P':
+		ok = handle_parse(client, pkt, sp);
+		break;
+	case 'B':
+		ok = handle_bind(client, pkt, sp, query);
+		break;
+	case 'D':
+		ok = handle_describe(client, sp, query);
+		break;
+	case 'C':
+		ok = handle_close(client, name, sp);
+		break;
+	default:
+		return false;
+	}
+	*failed_p = !ok;
+	return true;
+}
+
+/*
+ * Called from handle_client_work() for Parse, Bind, Describe and Close
+ * packets once the client has a server.  Data previously tagged for
+ * sending must be flushed already, see sbuf_flush().
+ */
+bool prepare_client_packet(PgSocket *client, PktHdr *pkt)
+{
+	SBuf *sbuf = &client->sbuf;
+	struct ServerPrepared *sp;
+	const char *name;
+	bool failed;
+
+	sp = server_prepared(client->link);
+	if (!sp)
+		goto oom;
+
+	if (!statement_name(pkt, &name) || (name && incomplete_pkt(pkt))) {
+		/* collect the whole packet, see prepare_client_fetch() */
+		client->prepare_buf = pktbuf_dynamic(pkt->len);
+		if (!client->prepare_buf)
+			goto oom;
+		sbuf_prepare_fetch(sbuf, pkt->len);
+		return true;
+	}
+
+	if (name && rewrite_packet(client, pkt, name, sp, &failed)) {
+		if (failed)
+			goto oom;
+		sbuf_prepare_skip(sbuf, pkt->len);
+		return true;
+	}
+
+	if (!forward_packet(client, pkt, sp))
+		goto oom;
+	sbuf_prepare_send(sbuf, &client->link->sbuf, pkt->len);
+	return true;
+
+oom:
+	disconnect_client(client, true, "out of memory");
+	return false;
+}
+
+/*
+ * SBUF_EV_PKT_CALLBACK: next part of a packet that is too large to be
+ * handled in the buffer.
+ */
+bool prepare_client_fetch(PgSocket *client, struct MBuf *data)
+{
+	PktBuf *buf = client->prepare_buf;
+	struct ServerPrepared *sp;
+	struct MBuf data_buf;
+	const char *name;
+	PktHdr pkt;
+	bool failed, ok;
+
+	if (!buf) {
+		disconnect_client(client, true, "unexpected packet data");
+		return false;
+	}
+
+	pktbuf_put_bytes(buf, mbuf_data(data), mbuf_avail_for_read(data));
+	if (buf->write_pos < buf->buf_len)
+		return true;
+
+	client->prepare_buf = NULL;
+
+	if (!client->link) {
+		pktbuf_free(buf);
+		disconnect_client(client, true, "server connection lost");
+		return false;
+	}
+	sp = server_prepared(client->link);
+	if (!sp) {
+		pktbuf_free(buf);
+		disconnect_client(client, true, "out of memory");
+		return false;
+	}
+
+	mbuf_init_fixed_reader(&data_buf, buf->buf, buf->write_pos);
+	ok = get_header(&data_buf, &pkt) && statement_name(&pkt, &name);
+	if (!ok) {
+		pktbuf_free(buf);
+		disconnect_client(client, true, "bad packet");
+		return false;
+	}
+
+	if (name && rewrite_packet(client, &pkt, name, sp, &failed))
+		ok = !failed;
+	else
+		ok = forward_packet(client, &pkt, sp) && send_raw(client, buf->buf, buf->write_pos);
+	pktbuf_free(buf);
+
+	if (!ok) {
+		disconnect_client(client, true, "out of memory");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Server packets.
+ */
+
+/* "DISCARD ALL" and "DEALLOCATE ALL" drop all statements */
+static bool is_deallocate_all(PktHdr *pkt)
+{
+	struct MBuf data;
+	const char *tag;
+
+	mbuf_copy(&pkt->data, &data);
+	if (!mbuf_get_string(&data, &tag))
+		return false;
+	return strcmp(tag, "DISCARD ALL") == 0 || strcmp(tag, "DEALLOCATE ALL") == 0;
+}
+
+/*
+ * Called from handle_server_work() for every packet from a server that
+ * has seen prepared statements.  Returns false if the packet is a
+ * response to a packet of pgbouncer and must not reach the client.
+ */
+bool prepare_server_packet(PgSocket *server, PktHdr *pkt)
+{
+	struct ServerPrepared *sp = server->server_prepared;
+	struct PendingResponse *pr;
+	uint8_t *type;
+	int kind;
+
+	switch (pkt->type) {
+	case '1':		/* ParseComplete */
+	case '3':		/* CloseComplete */
+		pr = pending_first(sp);
+		if (!pr || pr->kind == PS_SYNC) {
+			slog_warning(server, "unexpected '%c' packet for prepared statements", pkt_desc(pkt));
+			return true;
+		}
+		kind = pr->kind;
+		pending_pop(sp);
+		if (kind == PS_PARSE_SKIP || kind == PS_CLOSE_SKIP)
+			return false;
+		if (kind == PS_CLOSE_AS_PARSE) {
+			type = (uint8_t *)mbuf_data(&pkt->data);
+			*type = '1';
+		}
+		break;
+
+	case 'E':		/* ErrorResponse */
+		while ((pr = pending_first(sp)) && pr->kind != PS_SYNC)
+			pending_discard(sp);
+		break;
+
+	case 'Z':		/* ReadyForQuery */
+		if (!server->link)
+			break;
+		while ((pr = pending_first(sp)) && pr->kind != PS_SYNC)
+			pending_discard(sp);
+		if (pr)
+			pending_pop(sp);
+
+		/* Sync packets ignored in copy mode don't get a response */
+		if (server->link->expect_rfq_count == 0) {
+			unsigned int i, last = 0;
+			for (i = 0; i < sp->pending_count; i++) {
+				if (sp->pending[(sp->pending_head + i) % sp->pending_alloc].kind == PS_SYNC)
+					last = i + 1;
+			}
+			while (last-- > 0)
+				pending_discard(sp);
+		}
+		break;
+
+	case 'C':		/* CommandComplete */
+		if (is_deallocate_all(pkt)) {
+			slog_debug(server, "prepared statements were deallocated");
+			aatree_destroy(&sp->tree);
+			aatree_init(&sp->tree, server_statement_cmp, server_statement_free);
+		}
+		break;
+	}
+	return true;
+}
@@ -260,6 +260,7 @@ bool welcome_client(PgSocket *client)
 	/* give each client its own cancel key */
 	get_random_bytes(client->cancel_key, 8);
 	pktbuf_write_BackendKeyData(msg, client->cancel_key);
+	register_cancel_key(client);
 
 	/* finish */
 	pktbuf_write_ReadyForQuery(msg);
@@ -0,0 +1,516 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Statistics per query shape.
+ *
+ * The text of Query and Parse packets is normalized: literals and
+ * parameters become '?', lists of them collapse into one, comments and
+ * whitespace go away and keywords are lower-cased.  The normalized
+ * text is hashed and counted per database in a table of
+ * query_stats_size entries, using the space-saving algorithm: when the
+ * table is full, a new shape takes the place of the least frequent one
+ * and inherits its count, so frequent shapes stay in the table.  The
+ * count of an entry is never too low and at most "error" too high.
+ *
+ * Entries are found through a small open-addressing index and the
+ * least frequent one through a min-heap, so a query costs one pass
+ * over its text and O(log size) for the table.
+ */
+
+#include "bouncer.h"
+
+int cf_query_stats_size;
+
+#define QUERY_TEXT_LEN	256	/* normalized text kept per entry */
+
+struct QueryEntry {
+	uint64_t hash;
+	uint64_t count;
+	uint64_t error;		/* count may be this much too high */
+	uint64_t timed;		/* queries with known duration */
+	uint64_t bytes;		/* sent and received */
+	usec_t total_time;
+	usec_t max_time;
+	int heap_pos;
+	char text[QUERY_TEXT_LEN];
+};
+
+struct QueryStats {
+	int size;
+	int used;
+	unsigned mask;			/* index size - 1 */
+	struct QueryEntry *entries;
+	int *heap;			/* entry numbers, lowest count first */
+	int *index;			/* entry numbers by hash, -1 is free */
+};
+
+/*
+ * Normalization
+ */
+
+struct Fingerprint {
+	uint64_t hash;
+	char *text;
+	int text_len;
+	int pos;
+	bool word;		/* last token was a word or literal */
+	bool literal;		/* last token was a literal */
+	bool comma;		/* comma after a literal, held back */
+};
+
+static void fp_put(struct Fingerprint *fp, char c)
+{
+	/* FNV-1a */
+	fp->hash ^= (uint8_t)c;
+	fp->hash *= UINT64_C(1099511628211);
+	if (fp->pos < fp->text_len - 1)
+		fp->text[fp->pos++] = c;
+}
+
+/*
+ * Start a token, returns false if it is dropped.  Spacing of the
+ * input does not matter, words are separated by one space and
+ * punctuation by none.
+ */
+static bool fp_token(struct Fingerprint *fp, bool literal, bool word)
+{
+	if (fp->comma) {
+		fp->comma = false;
+		/* "?, ?" -> "?" */
+		if (literal)
+			return false;
+		fp_put(fp, ',');
+		fp->word = false;
+	}
+	if (fp->word && word)
+		fp_put(fp, ' ');
+	fp->word = word;
+	fp->literal = literal;
+	return true;
+}
+
+static bool is_ident_char(uint8_t c)
+{
+	return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+/* skip a '...' string starting at src[i], returns position after it */
+static unsigned skip_string(const uint8_t *src, unsigned len, unsigned i, bool backslash)
+{
+	for (i++; i < len; i++) {
+		if (backslash && src[i] == '\\') {
+			i++;
+		} else if (src[i] == '\'') {
+			if (i + 1 < len && src[i + 1] == '\'')
+				i++;
+			else
+				return i + 1;
+		}
+	}
+	return len;
+}
+
+/* skip $tag$...$tag$, returns 0 if src[i] does not start one */
+static unsigned skip_dollar_quote(const uint8_t *src, unsigned len, unsigned i)
+{
+	unsigned tag_end = i + 1;
+	unsigned tag_len;
+
+	while (tag_end < len && (isalnum(src[tag_end]) || src[tag_end] == '_'))
+		tag_end++;
+	if (tag_end >= len || src[tag_end] != '$' || isdigit(src[i + 1]))
+		return 0;
+	tag_len = tag_end - i + 1;
+	for (i = tag_end + 1; i + tag_len <= len; i++) {
+		if (src[i] == '$' && memcmp(src + i, src + tag_end - tag_len + 1, tag_len) == 0)
+			return i + tag_len;
+	}
+	return len;
+}
+
+static uint64_t fingerprint(const uint8_t *src, unsigned len, char *text, int text_len)
+{
+	struct Fingerprint fp;
+	unsigned i = 0, end;
+	uint8_t c;
+
+	memset(&fp, 0, sizeof(fp));
+	fp.hash = UINT64_C(14695981039346656037);
+	fp.text = text;
+	fp.text_len = text_len;
+
+	while (i < len && src[i]) {
+		c = src[i];
+		if (isspace(c)) {
+			i++;
+		} else if (c == '-' && i + 1 < len && src[i + 1] == '-') {
+			while (i < len && src[i] != '\n')
+				i++;
+		} else if (c == '/' && i + 1 < len && src[i + 1] == '*') {
+			for (i += 2; i + 1 < len && !(src[i] == '*' && src[i + 1] == '/'); i++) {}
+			i += 2;
+		} else if (c == '\'') {
+			i = skip_string(src, len, i, false);
+			if (fp_token(&fp, true, true))
+				fp_put(&fp, '?');
+		} else if ((c == 'e' || c == 'E' || c == 'b' || c == 'B' || c == 'x' || c == 'X') &&
+			   i + 1 < len && src[i + 1] == '\'') {
+			i = skip_string(src, len, i + 1, c == 'e' || c == 'E');
+			if (fp_token(&fp, true, true))
+				fp_put(&fp, '?');
+		} else if (c == '$' && i + 1 < len && isdigit(src[i + 1])) {
+			for (i++; i < len && isdigit(src[i]); i++) {}
+			if (fp_token(&fp, true, true))
+				fp_put(&fp, '?');
+		} else if (c == '$' && (end = skip_dollar_quote(src, len, i)) > 0) {
+			i = end;
+			if (fp_token(&fp, true, true))
+				fp_put(&fp, '?');
+		} else if (isdigit(c) || (c == '.' && i + 1 < len && isdigit(src[i + 1]))) {
+			while (i < len && (isalnum(src[i]) || src[i] == '.' ||
+					   ((src[i] == '+' || src[i] == '-') && (src[i - 1] == 'e' || src[i - 1] == 'E'))))
+				i++;
+			if (fp_token(&fp, true, true))
+				fp_put(&fp, '?');
+		} else if (c == '"') {
+			fp_token(&fp, false, true);
+			do {
+				fp_put(&fp, src[i++]);
+			} while (i < len && src[i] != '"');
+			if (i < len)
+				fp_put(&fp, src[i++]);
+		} else if (is_ident_char(c)) {
+			fp_token(&fp, false, true);
+			while (i < len && is_ident_char(src[i]))
+				fp_put(&fp, tolower(src[i++]));
+		} else if (c == ',' && fp.literal && !fp.comma) {
+			fp.comma = true;
+			i++;
+		} else {
+			fp_token(&fp, false, false);
+			fp_put(&fp, c);
+			i++;
+		}
+	}
+	if (fp.comma)
+		fp_put(&fp, ',');
+	text[fp.pos] = '\0';
+
+	/* 0 means no fingerprint on the client */
+	return fp.hash ? fp.hash : 1;
+}
+
+/*
+ * Table
+ */
+
+static void heap_swap(struct QueryStats *qs, int a, int b)
+{
+	int tmp = qs->heap[a];
+
+	qs->heap[a] = qs->heap[b];
+	qs->heap[b] = tmp;
+	qs->entries[qs->heap[a]].heap_pos = a;
+	qs->entries[qs->heap[b]].heap_pos = b;
+}
+
+static uint64_t heap_count(struct QueryStats *qs, int pos)
+{
+	return qs->entries[qs->heap[pos]].count;
+}
+
+static void heap_up(struct QueryStats *qs, int pos)
+{
+	while (pos > 0 && heap_count(qs, (pos - 1) / 2) > heap_count(qs, pos)) {
+		heap_swap(qs, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+static void heap_down(struct QueryStats *qs, int pos)
+{
+	int child;
+
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= qs->used)
+			break;
+		if (child + 1 < qs->used && heap_count(qs, child + 1) < heap_count(qs, child))
+			child++;
+		if (heap_count(qs, pos) <= heap_count(qs, child))
+			break;
+		heap_swap(qs, pos, child);
+		pos = child;
+	}
+}
+
+static int index_slot(struct QueryStats *qs, uint64_t hash)
+{
+	unsigned i = hash & qs->mask;
+
+	while (qs->index[i] >= 0 && qs->entries[qs->index[i]].hash != hash)
+		i = (i + 1) & qs->mask;
+	return i;
+}
+
+static struct QueryEntry *find_entry(struct QueryStats *qs, uint64_t hash)
+{
+	int n = qs->index[index_slot(qs, hash)];
+
+	return n >= 0 ? &qs->entries[n] : NULL;
+}
+
+/* linear probing removal, moves later entries of the run back */
+static void index_remove(struct QueryStats *qs, uint64_t hash)
+{
+	unsigned i = index_slot(qs, hash);
+	unsigned j = i, home;
+
+	if (qs->index[i] < 0)
+		return;
+	for (;;) {
+		j = (j + 1) & qs->mask;
+		if (qs->index[j] < 0)
+			break;
+		home = qs->entries[qs->index[j]].hash & qs->mask;
+		/* can the entry at j move to i? */
+		if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			qs->index[i] = qs->index[j];
+			i = j;
+		}
+	}
+	qs->index[i] = -1;
+}
+
+void query_stats_free(PgDatabase *db)
+{
+	struct QueryStats *qs = db->query_stats;
+
+	if (!qs)
+		return;
+	free(qs->entries);
+	free(qs->heap);
+	free(qs->index);
+	free(qs);
+	db->query_stats = NULL;
+}
+
+static struct QueryStats *get_query_stats(PgDatabase *db)
+{
+	struct QueryStats *qs = db->query_stats;
+	unsigned index_size = 1;
+	int i;
+
+	if (qs && qs->size == cf_query_stats_size)
+		return qs;
+
+	/* size was changed on reload, start over */
+	query_stats_free(db);
+
+	while (index_size < 2 * (unsigned)cf_query_stats_size)
+		index_size <<= 1;
+
+	qs = calloc(1, sizeof(*qs));
+	if (!qs)
+		return NULL;
+	qs->size = cf_query_stats_size;
+	qs->mask = index_size - 1;
+	qs->entries = calloc(qs->size, sizeof(*qs->entries));
+	qs->heap = calloc(qs->size, sizeof(*qs->heap));
+	qs->index = malloc(index_size * sizeof(*qs->index));
+	db->query_stats = qs;
+	if (!qs->entries || !qs->heap || !qs->index) {
+		query_stats_free(db);
+		return NULL;
+	}
+	for (i = 0; i < (int)index_size; i++)
+		qs->index[i] = -1;
+	return qs;
+}
+
+/* count one query, returns its entry */
+static struct QueryEntry *count_query(struct QueryStats *qs, uint64_t hash, const char *text)
+{
+	struct QueryEntry *e;
+	uint64_t min_count = 0;
+	int n;
+
+	e = find_entry(qs, hash);
+	if (e) {
+		e->count++;
+		heap_down(qs, e->heap_pos);
+		return e;
+	}
+
+	if (qs->used < qs->size) {
+		n = qs->used++;
+		e = &qs->entries[n];
+		e->heap_pos = n;
+		qs->heap[n] = n;
+	} else {
+		/* take over the least frequent shape */
+		n = qs->heap[0];
+		e = &qs->entries[n];
+		min_count = e->count;
+		index_remove(qs, e->hash);
+	}
+
+	e->hash = hash;
+	e->count = min_count + 1;
+	e->error = min_count;
+	e->timed = 0;
+	e->bytes = 0;
+	e->total_time = 0;
+	e->max_time = 0;
+	safe_strcpy(e->text, text, sizeof(e->text));
+	qs->index[index_slot(qs, hash)] = n;
+
+	if (min_count > 0)
+		heap_down(qs, e->heap_pos);
+	else
+		heap_up(qs, e->heap_pos);
+	return e;
+}
+
+/* Query or Parse packet from client */
+void query_stats_add(PgSocket *client, PktHdr *pkt)
+{
+	struct MBuf data = pkt->data;
+	struct QueryStats *qs;
+	struct QueryEntry *e;
+	const char *name;
+	const uint8_t *body;
+	unsigned body_len;
+	char text[QUERY_TEXT_LEN];
+	uint64_t hash;
+
+	if (cf_query_stats_size <= 0 || client->pool->db->admin)
+		return;
+
+	/* statement name comes first in Parse */
+	if (pkt->type == 'P' && !mbuf_get_string(&data, &name))
+		return;
+	/* only the buffered part of a large packet is looked at */
+	body_len = mbuf_avail_for_read(&data);
+	if (!mbuf_get_bytes(&data, body_len, &body))
+		return;
+
+	qs = get_query_stats(client->pool->db);
+	if (!qs)
+		return;
+
+	hash = fingerprint(body, body_len, text, sizeof(text));
+	e = count_query(qs, hash, text);
+	e->bytes += pkt->len;
+
+	/*
+	 * The first statement of a query gets its time.  query_start is
+	 * already set here, query_fp is cleared together with it.
+	 */
+	if (!client->query_fp) {
+		client->query_fp = hash;
+		client->query_fp_bytes = client->stats.server_bytes;
+	}
+}
+
+/* the query of client is done */
+void query_stats_finish(PgSocket *client, usec_t query_time)
+{
+	struct QueryStats *qs = client->pool->db->query_stats;
+	struct QueryEntry *e;
+
+	if (!client->query_fp)
+		return;
+	e = qs ? find_entry(qs, client->query_fp) : NULL;
+	client->query_fp = 0;
+	if (!e)
+		return;
+
+	e->timed++;
+	e->total_time += query_time;
+	if (query_time > e->max_time)
+		e->max_time = query_time;
+	e->bytes += client->stats.server_bytes - client->query_fp_bytes;
+}
+
+/*
+ * Command: SHOW QUERIES
+ */
+
+static struct QueryStats *sort_stats;
+
+static int cmp_total_time(const void *a, const void *b)
+{
+	const struct QueryEntry *ea = &sort_stats->entries[*(const int *)a];
+	const struct QueryEntry *eb = &sort_stats->entries[*(const int *)b];
+
+	if (ea->total_time != eb->total_time)
+		return ea->total_time > eb->total_time ? -1 : 1;
+	if (ea->count != eb->count)
+		return ea->count > eb->count ? -1 : 1;
+	return 0;
+}
+
+bool admin_query_stats(PgSocket *admin)
+{
+	struct List *item;
+	PgDatabase *db;
+	struct QueryStats *qs;
+	struct QueryEntry *e;
+	PktBuf *buf;
+	int *order = NULL;
+	int i;
+
+	buf = pktbuf_dynamic(1024);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "ssqqqqqq", "database", "query",
+				    "calls", "calls_error", "total_time",
+				    "avg_time", "max_time", "bytes");
+	statlist_for_each(item, &database_list) {
+		db = container_of(item, PgDatabase, head);
+		qs = db->query_stats;
+		if (!qs || qs->used == 0)
+			continue;
+
+		free(order);
+		order = malloc(qs->used * sizeof(*order));
+		if (!order)
+			break;
+		for (i = 0; i < qs->used; i++)
+			order[i] = i;
+		sort_stats = qs;
+		qsort(order, qs->used, sizeof(*order), cmp_total_time);
+
+		for (i = 0; i < qs->used; i++) {
+			e = &qs->entries[order[i]];
+			pktbuf_write_DataRow(buf, "ssqqqqqq", db->name, e->text,
+					     e->count, e->error, e->total_time,
+					     e->timed ? e->total_time / e->timed : 0,
+					     e->max_time, e->bytes);
+		}
+	}
+	free(order);
+
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
@@ -29,8 +29,30 @@
 #include <usual/safeio.h>
 #include <usual/slab.h>
 
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#endif
+
+/* IORING_OP_RECV, IORING_OP_SEND and the probe came in Linux 5.6 */
+#if defined(HAVE_DECL_IORING_REGISTER_PROBE) && HAVE_DECL_IORING_REGISTER_PROBE
+#define USE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #ifdef USUAL_LIBSSL_FOR_TLS
 #define USE_TLS
+#include <usual/tls/tls_internal.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+/* OpenSSL 3.0 and later can hand the record layer over to the kernel */
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS)
+#define USE_KTLS
+#endif
 #endif
 
 /* sbuf_main_loop() skip_recv values */
@@ -57,6 +79,13 @@ enum WaitType {
 	W_ONCE
 };
 
+/* SBuf.uring_op */
+enum URingOp {
+	URING_NONE = 0,
+	URING_RECV,
+	URING_SEND,
+};
+
 #define AssertSanity(sbuf) do { \
 	Assert(iobuf_sane((sbuf)->io)); \
 } while (0)
@@ -68,6 +97,7 @@ enum WaitType {
 
 /* declare static stuff */
 static bool sbuf_queue_send(SBuf *sbuf) _MUSTCHECK;
+static bool sbuf_send_extra(SBuf *sbuf) _MUSTCHECK;
 static bool sbuf_send_pending(SBuf *sbuf) _MUSTCHECK;
 static bool sbuf_process_pending(SBuf *sbuf) _MUSTCHECK;
 static void sbuf_connect_cb(evutil_socket_t sock, short flags, void *arg);
@@ -78,8 +108,13 @@ static bool sbuf_wait_for_data(SBuf *sbuf) _MUSTCHECK;
 static void sbuf_main_loop(SBuf *sbuf, bool skip_recv);
 static bool sbuf_call_proto(SBuf *sbuf, int event) /* _MUSTCHECK */;
 static bool sbuf_actual_recv(SBuf *sbuf, size_t len)  _MUSTCHECK;
+static unsigned sbuf_recv_amount(SBuf *sbuf);
+static bool sbuf_uring_queue(SBuf *sbuf, enum URingOp op);
 static bool sbuf_after_connect_check(SBuf *sbuf)  _MUSTCHECK;
 static bool handle_tls_handshake(SBuf *sbuf) /* _MUSTCHECK */;
+static void detach_tls_job(SBuf *sbuf);
+static bool sbuf_send_pipe(SBuf *sbuf) _MUSTCHECK;
+static void splice_pipe_put(struct SplicePipe *p);
 
 /* regular I/O */
 static ssize_t raw_sbufio_recv(struct SBuf *sbuf, void *dst, size_t len);
@@ -102,6 +137,9 @@ static const SBufIO tls_sbufio_ops = {
 	tls_sbufio_close
 };
 static void sbuf_tls_handshake_cb(evutil_socket_t fd, short flags, void *_sbuf);
+static void tls_session_flush(void);
+static bool client_tls_resume_setup(SSL_CTX *ctx);
+static bool ticket_secret_setup(void);
 #endif
 
 /*********************************
@@ -306,15 +344,29 @@ bool sbuf_close(SBuf *sbuf)
 			/* if (errno == ENOMEM) return false; */
 		}
 	}
+	if (sbuf->tls_job)
+		detach_tls_job(sbuf);
+	/* a queued recv() or send() is skipped */
+	sbuf->uring_op = URING_NONE;
 	sbuf_op_close(sbuf);
 	sbuf->dst = NULL;
 	sbuf->sock = 0;
 	sbuf->pkt_remain = 0;
 	sbuf->pkt_action = sbuf->wait_type = 0;
+	sbuf->ktls = 0;
 	if (sbuf->io) {
 		slab_free(iobuf_cache, sbuf->io);
 		sbuf->io = NULL;
 	}
+	if (sbuf->extra) {
+		pktbuf_free(sbuf->extra);
+		sbuf->extra = NULL;
+	}
+	if (sbuf->pipe) {
+		splice_pipe_put(sbuf->pipe);
+		sbuf->pipe = NULL;
+	}
+	sbuf->no_splice = false;
 	return true;
 }
 
@@ -452,6 +504,8 @@ static void sbuf_send_cb(evutil_socket_t sock, short flags, void *arg)
 	SBuf *sbuf = arg;
 	bool res;
 
+	loop_stats_socket();
+
 	/* sbuf was closed before in this loop */
 	if (!sbuf->sock)
 		return;
@@ -501,6 +555,44 @@ static bool sbuf_queue_send(SBuf *sbuf)
 	return true;
 }
 
+/*
+ * Send data queued with sbuf_queue_packet().  Returns bool if processing
+ * can continue.
+ */
+static bool sbuf_send_extra(SBuf *sbuf)
+{
+	PktBuf *buf = sbuf->extra;
+	int avail;
+	ssize_t res;
+
+	if (sbuf->dst->sock == 0) {
+		log_error("sbuf_send_extra: no dst sock?");
+		sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+		return false;
+	}
+
+	while (buf->send_pos < buf->write_pos) {
+		avail = buf->write_pos - buf->send_pos;
+		res = sbuf_op_send(sbuf->dst, buf->buf + buf->send_pos, avail);
+		if (res > 0) {
+			buf->send_pos += res;
+		} else if (res < 0) {
+			if (errno == EAGAIN) {
+				if (!sbuf_queue_send(sbuf))
+					/* drop if queue failed */
+					sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+			} else {
+				sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+			}
+			return false;
+		}
+	}
+
+	pktbuf_free(buf);
+	sbuf->extra = NULL;
+	return true;
+}
+
 /*
  * There's data in buffer to be sent. Returns bool if processing can continue.
  *
@@ -515,6 +607,14 @@ static bool sbuf_send_pending(SBuf *sbuf)
 	AssertActive(sbuf);
 	Assert(sbuf->dst || iobuf_amount_pending(io) == 0);
 
+	/* spliced data was received before anything in io */
+	if (sbuf->pipe && !sbuf_send_pipe(sbuf))
+		return false;
+
+	/* generated packets go out before the data queued after them */
+	if (sbuf->extra && !sbuf_send_extra(sbuf))
+		return false;
+
 try_more:
 	/* how much data is available for sending */
 	avail = iobuf_amount_pending(io);
@@ -527,6 +627,10 @@ try_more:
 		return false;
 	}
 
+	/* batched with other sockets, the completion continues */
+	if (sbuf_uring_queue(sbuf, URING_SEND))
+		return false;
+
 	/* actually send it */
 	//res = iobuf_send_pending(io, sbuf->dst->sock);
 	res = sbuf_op_send(sbuf->dst, io->buf + io->done_pos, avail);
@@ -584,6 +688,7 @@ static bool sbuf_process_pending(SBuf *sbuf)
 			if (!res)
 				return false;
 			Assert(sbuf->pkt_remain > 0);
+			probe4(sbuf__packet, sbuf, sbuf->sock, sbuf->pkt_action, sbuf->pkt_remain);
 		}
 
 		if (sbuf->pkt_action == ACT_SKIP || sbuf->pkt_action == ACT_CALL) {
@@ -618,6 +723,531 @@ static bool sbuf_process_pending(SBuf *sbuf)
 	return sbuf_send_pending(sbuf);
 }
 
+#ifdef HAVE_SPLICE
+
+/*
+ * Zero-copy forwarding.
+ *
+ * When the rest of a big packet that is being sent on is still in
+ * the kernel, it is moved from the socket into a pipe and from there
+ * to the destination socket with splice(), without passing through
+ * the IOBuf.  The pipe is held by the SBuf until the packet is done
+ * and the pipe is empty, then it goes back to a small cache.
+ */
+
+struct SplicePipe {
+	struct List head;
+	int fds[2];
+	unsigned pending;	/* bytes in the pipe */
+};
+
+#define SPLICE_PIPE_CACHE	16
+
+static STATLIST(splice_pipe_list);
+
+static struct SplicePipe *splice_pipe_get(void)
+{
+	struct SplicePipe *p;
+	struct List *item;
+
+	item = statlist_pop(&splice_pipe_list);
+	if (item)
+		return container_of(item, struct SplicePipe, head);
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		/* probably fd limit, copy instead */
+		log_debug("splice_pipe_get: pipe2 failed: %s", strerror(errno));
+		free(p);
+		return NULL;
+	}
+	list_init(&p->head);
+	return p;
+}
+
+static void splice_pipe_free(struct SplicePipe *p)
+{
+	safe_close(p->fds[0]);
+	safe_close(p->fds[1]);
+	free(p);
+}
+
+/* pipes with data left in them cannot be reused */
+static void splice_pipe_put(struct SplicePipe *p)
+{
+	if (p->pending == 0 && statlist_count(&splice_pipe_list) < SPLICE_PIPE_CACHE)
+		statlist_append(&splice_pipe_list, &p->head);
+	else
+		splice_pipe_free(p);
+}
+
+/* whether the rest of the current packet can be spliced */
+static bool sbuf_can_splice(SBuf *sbuf)
+{
+	if (cf_splice_threshold <= 0 || sbuf->no_splice)
+		return false;
+	if (sbuf->pkt_action != ACT_SEND || sbuf->pkt_remain < (unsigned)cf_splice_threshold)
+		return false;
+	/* all data received so far must be out, and no TLS on either side */
+	if (!iobuf_empty(sbuf->io) || sbuf->extra)
+		return false;
+	if (!sbuf->dst || !sbuf->dst->sock)
+		return false;
+	if (sbuf->ops != &raw_sbufio_ops || sbuf->dst->ops != &raw_sbufio_ops)
+		return false;
+
+	if (!sbuf->pipe)
+		sbuf->pipe = splice_pipe_get();
+	return sbuf->pipe != NULL;
+}
+
+/*
+ * Move one pipe full of the current packet.  Returns true if processing
+ * can continue.
+ */
+static bool sbuf_splice(SBuf *sbuf)
+{
+	ssize_t got;
+
+	Assert(sbuf->pipe->pending == 0);
+
+	got = splice(sbuf->sock, NULL, sbuf->pipe->fds[1], NULL, sbuf->pkt_remain,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (got > 0) {
+		sbuf->pipe->pending += got;
+		sbuf->pkt_remain -= got;
+		return sbuf_send_pending(sbuf);
+	} else if (got == 0) {
+		/* eof from socket */
+		sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+		return false;
+	} else if (errno == EAGAIN) {
+		/* wait for more, without holding on to an empty buffer */
+		sbuf_try_resync(sbuf, true);
+		return false;
+	} else if (errno == EINVAL) {
+		/* socket type without splice support, copy instead */
+		sbuf->no_splice = true;
+		splice_pipe_put(sbuf->pipe);
+		sbuf->pipe = NULL;
+		return true;
+	}
+	sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+	return false;
+}
+
+/* send out what is in the pipe.  Returns bool if processing can continue. */
+static bool sbuf_send_pipe(SBuf *sbuf)
+{
+	struct SplicePipe *p = sbuf->pipe;
+	ssize_t res;
+
+	if (sbuf->dst->sock == 0) {
+		log_error("sbuf_send_pipe: no dst sock?");
+		sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+		return false;
+	}
+
+	while (p->pending > 0) {
+		res = splice(p->fds[0], NULL, sbuf->dst->sock, NULL, p->pending,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (res > 0) {
+			p->pending -= res;
+		} else if (res < 0 && errno == EAGAIN) {
+			if (!sbuf_queue_send(sbuf))
+				/* drop if queue failed */
+				sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+			return false;
+		} else {
+			sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+			return false;
+		}
+	}
+
+	/* keep the pipe until the packet is done */
+	if (sbuf->pkt_remain == 0) {
+		splice_pipe_put(p);
+		sbuf->pipe = NULL;
+	}
+	return true;
+}
+
+static void splice_cleanup(void)
+{
+	struct List *item;
+
+	while ((item = statlist_pop(&splice_pipe_list)) != NULL)
+		splice_pipe_free(container_of(item, struct SplicePipe, head));
+}
+
+#else /* !HAVE_SPLICE */
+
+static bool sbuf_can_splice(SBuf *sbuf) { return false; }
+static bool sbuf_splice(SBuf *sbuf) { return true; }
+static bool sbuf_send_pipe(SBuf *sbuf) { return true; }
+static void splice_pipe_put(struct SplicePipe *p) {}
+static void splice_cleanup(void) {}
+
+#endif /* !HAVE_SPLICE */
+
+#ifdef USE_URING
+
+/*
+ * Batched socket I/O with io_uring.
+ *
+ * With event_backend = io_uring, the sockets are still waited on with
+ * epoll through libevent, but the recv() and send() calls that the
+ * callbacks would make are queued instead.  Once libevent has run the
+ * callbacks of all ready sockets, sbuf_uring_flush() hands the queued
+ * calls to the kernel with one io_uring_enter() and continues each
+ * SBuf with its result.  That usually queues the send() of the data
+ * just received, so it repeats in rounds until nothing is queued.
+ *
+ * An SBuf has at most one call queued and its main loop waits for it.
+ * The buffer position is looked up only when the round is submitted,
+ * an SBuf that was paused or closed meanwhile is skipped.  MSG_DONTWAIT
+ * makes the calls complete right away, a socket that is not ready
+ * gives EAGAIN like the direct call.  TLS connections, generated
+ * packets and spliced data do not go through the ring.
+ */
+
+#define URING_ENTRIES	512
+
+struct URing {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+static struct URing uring = { .fd = -1 };
+
+/* calls queued for the next round, and the round being completed */
+static SBuf **uring_queue, **uring_batch;
+static int *uring_res;
+static unsigned uring_queue_len;
+
+static void uring_cleanup(void)
+{
+	if (uring.sqes)
+		munmap(uring.sqes, uring.entries * sizeof(struct io_uring_sqe));
+	if (uring.cq_ring && uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	if (uring.sq_ring)
+		munmap(uring.sq_ring, uring.sq_ring_size);
+	if (uring.fd >= 0)
+		safe_close(uring.fd);
+	free(uring_queue);
+	free(uring_batch);
+	free(uring_res);
+	memset(&uring, 0, sizeof(uring));
+	uring.fd = -1;
+	uring_queue = uring_batch = NULL;
+	uring_res = NULL;
+	uring_queue_len = 0;
+}
+
+static bool uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+	bool ok = false;
+
+	probe = calloc(1, len);
+	if (!probe)
+		return false;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) >= 0) {
+		ok = probe->ops_len > IORING_OP_RECV && probe->ops_len > IORING_OP_SEND &&
+		     (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+		     (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ok;
+}
+
+static void *uring_map(size_t len, off_t offset)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* set up the ring, must be called after workers_setup() */
+bool sbuf_uring_setup(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring.fd < 0) {
+		log_error("io_uring_setup failed: %s", strerror(errno));
+		return false;
+	}
+	if (!uring_probe(uring.fd)) {
+		log_error("io_uring does not support socket recv and send, needs Linux 5.6 or later");
+		goto failed;
+	}
+
+	uring.entries = p.sq_entries;
+	uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_size > uring.sq_ring_size)
+			uring.sq_ring_size = uring.cq_ring_size;
+		uring.cq_ring_size = uring.sq_ring_size;
+	}
+	uring.sq_ring = uring_map(uring.sq_ring_size, IORING_OFF_SQ_RING);
+	if (!uring.sq_ring)
+		goto mmap_failed;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring.cq_ring = uring.sq_ring;
+	else
+		uring.cq_ring = uring_map(uring.cq_ring_size, IORING_OFF_CQ_RING);
+	if (!uring.cq_ring)
+		goto mmap_failed;
+	uring.sqes = uring_map(uring.entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+	if (!uring.sqes)
+		goto mmap_failed;
+
+	uring.sq_tail = (unsigned *)((char *)uring.sq_ring + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)((char *)uring.sq_ring + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)((char *)uring.sq_ring + p.sq_off.array);
+	uring.cq_head = (unsigned *)((char *)uring.cq_ring + p.cq_off.head);
+	uring.cq_tail = (unsigned *)((char *)uring.cq_ring + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)((char *)uring.cq_ring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((char *)uring.cq_ring + p.cq_off.cqes);
+
+	uring_queue = calloc(uring.entries, sizeof(SBuf *));
+	uring_batch = calloc(uring.entries, sizeof(SBuf *));
+	uring_res = calloc(uring.entries, sizeof(int));
+	if (!uring_queue || !uring_batch || !uring_res) {
+		log_error("io_uring setup: no memory");
+		goto failed;
+	}
+
+	log_info("io_uring: batching socket I/O, %u entries", uring.entries);
+	return true;
+
+mmap_failed:
+	log_error("io_uring mmap failed: %s", strerror(errno));
+failed:
+	uring_cleanup();
+	return false;
+}
+
+/* queue recv() or send() for the next round, false to call it directly */
+static bool sbuf_uring_queue(SBuf *sbuf, enum URingOp op)
+{
+	const SBufIO *ops = (op == URING_RECV) ? sbuf->ops : sbuf->dst->ops;
+
+	if (uring.fd < 0 || ops != &raw_sbufio_ops)
+		return false;
+	if (sbuf->wait_type != W_RECV || uring_queue_len >= uring.entries)
+		return false;
+
+	Assert(sbuf->uring_op == URING_NONE);
+	sbuf->uring_op = op;
+	uring_queue[uring_queue_len++] = sbuf;
+	return true;
+}
+
+/* whether calls are left over for the next loop */
+bool sbuf_uring_pending(void)
+{
+	return uring_queue_len > 0;
+}
+
+/*
+ * Fill in the submission for a queued call.  Returns false if there
+ * is nothing to submit, *res is then the result to complete with.
+ */
+static bool uring_prep(struct io_uring_sqe *sqe, SBuf *sbuf, int *res)
+{
+	IOBuf *io = sbuf->io;
+
+	*res = 0;
+	memset(sqe, 0, sizeof(*sqe));
+	switch (sbuf->uring_op) {
+	case URING_RECV:
+		/* paused meanwhile, sbuf_continue() starts over */
+		if (sbuf->wait_type != W_RECV) {
+			sbuf->uring_op = URING_NONE;
+			return false;
+		}
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sbuf->sock;
+		sqe->addr = (uintptr_t)(io->buf + io->recv_pos);
+		sqe->len = sbuf_recv_amount(sbuf);
+		break;
+	case URING_SEND:
+		if (!sbuf->dst || sbuf->dst->sock == 0) {
+			log_error("sbuf_uring_flush: no dst sock?");
+			*res = -EPIPE;
+			return false;
+		}
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = sbuf->dst->sock;
+		sqe->addr = (uintptr_t)(io->buf + io->done_pos);
+		sqe->len = iobuf_amount_pending(io);
+		break;
+	default:
+		/* closed */
+		return false;
+	}
+	sqe->msg_flags = MSG_DONTWAIT;
+	return true;
+}
+
+/* the rest of sbuf_main_loop() after recv() */
+static void uring_recv_done(SBuf *sbuf, int res)
+{
+	if (res > 0) {
+		sbuf->io->recv_pos += res;
+	} else if (res == 0) {
+		/* eof from socket */
+		sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+		return;
+	} else if (res != -EAGAIN) {
+		errno = -res;
+		sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+		return;
+	}
+
+	/* paused meanwhile, the data waits for sbuf_continue() */
+	if (sbuf->wait_type == W_RECV)
+		sbuf_main_loop(sbuf, SKIP_RECV);
+}
+
+/* the rest of sbuf_send_pending() after send() */
+static void uring_send_done(SBuf *sbuf, int res)
+{
+	if (res == -EAGAIN) {
+		if (sbuf->wait_type != W_RECV)
+			return;
+		if (!sbuf->dst->sock || !sbuf_queue_send(sbuf))
+			sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+		return;
+	} else if (res < 0) {
+		errno = -res;
+		sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+		return;
+	}
+
+	sbuf->io->done_pos += res;
+	if (sbuf->wait_type == W_RECV)
+		sbuf_main_loop(sbuf, SKIP_RECV);
+}
+
+/* submit n prepared calls and collect their results */
+static void uring_submit(unsigned n)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, unsubmitted = n, done = 0;
+	long ret;
+
+	while (done < n) {
+		ret = syscall(__NR_io_uring_enter, uring.fd, unsubmitted, n - done,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			fatal_perror("io_uring_enter");
+		}
+		unsubmitted -= ret;
+
+		head = *uring.cq_head;
+		tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			cqe = &uring.cqes[head & *uring.cq_mask];
+			uring_res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Run the queued calls, called after the event callbacks.  Like
+ * sbuf_loopcnt, the number of rounds is limited so that busy
+ * connections cannot hold up the rest, what is left runs after the
+ * next event loop, which then does not wait.
+ */
+void sbuf_uring_flush(void)
+{
+	struct io_uring_sqe *sqe;
+	SBuf **batch, *sbuf;
+	unsigned i, n, prepared, tail, mask;
+	enum URingOp op;
+	int rounds = 0;
+
+	while (uring_queue_len > 0) {
+		if (cf_sbuf_loopcnt > 0 && rounds >= 2 * cf_sbuf_loopcnt) {
+			log_debug("io_uring rounds full");
+			loop_stats_yield();
+			return;
+		}
+		rounds++;
+
+		/* callbacks below queue into the other array */
+		batch = uring_queue;
+		uring_queue = uring_batch;
+		uring_batch = batch;
+		n = uring_queue_len;
+		uring_queue_len = 0;
+
+		tail = *uring.sq_tail;
+		mask = *uring.sq_mask;
+		prepared = 0;
+		for (i = 0; i < n; i++) {
+			sqe = &uring.sqes[tail & mask];
+			if (!uring_prep(sqe, batch[i], &uring_res[i]))
+				continue;
+			sqe->user_data = i;
+			uring.sq_array[tail & mask] = tail & mask;
+			tail++;
+			prepared++;
+		}
+		__atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+		if (prepared > 0)
+			uring_submit(prepared);
+
+		for (i = 0; i < n; i++) {
+			sbuf = batch[i];
+			op = sbuf->uring_op;
+			/* closed, or paused before recv() */
+			if (op == URING_NONE)
+				continue;
+			sbuf->uring_op = URING_NONE;
+			if (op == URING_RECV)
+				uring_recv_done(sbuf, uring_res[i]);
+			else
+				uring_send_done(sbuf, uring_res[i]);
+		}
+	}
+}
+
+#else /* !USE_URING */
+
+bool sbuf_uring_setup(void)
+{
+	log_error("io_uring support was not built");
+	return false;
+}
+
+static bool sbuf_uring_queue(SBuf *sbuf, enum URingOp op) { return false; }
+bool sbuf_uring_pending(void) { return false; }
+void sbuf_uring_flush(void) {}
+static void uring_cleanup(void) {}
+
+#endif /* !USE_URING */
+
 /* reposition at buffer start again */
 static void sbuf_try_resync(SBuf *sbuf, bool release)
 {
@@ -641,6 +1271,23 @@ static void sbuf_try_resync(SBuf *sbuf, bool release)
 	}
 }
 
+/* how much to ask from the kernel at once */
+static unsigned sbuf_recv_amount(SBuf *sbuf)
+{
+	unsigned free = iobuf_amount_recv(sbuf->io);
+
+	/*
+	 * When suspending, try to hit packet boundary ASAP.
+	 */
+	if (cf_pause_mode == P_SUSPEND
+	    && sbuf->pkt_remain > 0
+	    && sbuf->pkt_remain < free)
+	{
+		free = sbuf->pkt_remain;
+	}
+	return free;
+}
+
 /* actually ask kernel for more data */
 static bool sbuf_actual_recv(SBuf *sbuf, size_t len)
 {
@@ -669,6 +1316,7 @@ static bool sbuf_actual_recv(SBuf *sbuf, size_t len)
 static void sbuf_recv_cb(evutil_socket_t sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
+	loop_stats_socket();
 	sbuf_main_loop(sbuf, DO_RECV);
 }
 
@@ -703,6 +1351,10 @@ static void sbuf_main_loop(SBuf *sbuf, bool skip_recv)
 	if (!sbuf->sock)
 		return;
 
+	/* recv() or send() queued for io_uring, its completion continues */
+	if (sbuf->uring_op)
+		return;
+
 	/* reading should be disabled when waiting */
 	Assert(sbuf->wait_type == W_RECV);
 	AssertSanity(sbuf);
@@ -723,6 +1375,7 @@ try_more:
 		bool _ignore;
 
 		log_debug("loopcnt full");
+		loop_stats_yield();
 		/*
 		 * sbuf_process_pending() avoids some data if buffer is full,
 		 * but as we exit processing loop here, we need to retry
@@ -736,21 +1389,22 @@ try_more:
 	}
 	loopcnt++;
 
+	/* large packet body, bypass the buffer */
+	if (sbuf_can_splice(sbuf)) {
+		if (!sbuf_splice(sbuf))
+			return;
+		goto try_more;
+	}
+
 	/*
 	 * here used to be if (free > SBUF_SMALL_PKT) check
 	 * but with skip_recv switch its should not be needed anymore.
 	 */
-	free = iobuf_amount_recv(sbuf->io);
+	free = sbuf_recv_amount(sbuf);
 	if (free > 0) {
-		/*
-		 * When suspending, try to hit packet boundary ASAP.
-		 */
-		if (cf_pause_mode == P_SUSPEND
-		    && sbuf->pkt_remain > 0
-		    && sbuf->pkt_remain < free)
-		{
-			free = sbuf->pkt_remain;
-		}
+		/* batched with other sockets, the completion continues */
+		if (sbuf_uring_queue(sbuf, URING_RECV))
+			return;
 
 		/* now fetch the data */
 		ok = sbuf_actual_recv(sbuf, free);
@@ -806,6 +1460,8 @@ static void sbuf_connect_cb(evutil_socket_t sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
 
+	loop_stats_socket();
+
 	Assert(sbuf->wait_type == W_CONNECT || sbuf->wait_type == W_NONE);
 	sbuf->wait_type = W_NONE;
 
@@ -837,6 +1493,46 @@ bool sbuf_answer(SBuf *sbuf, const void *buf, size_t len)
 	return (unsigned)res == len;
 }
 
+/*
+ * Queue a packet generated by pgbouncer to be sent to dst, ahead of
+ * the stream data that is tagged for sending after this call.
+ *
+ * Stream data tagged earlier must already be sent, see sbuf_flush().
+ */
+bool sbuf_queue_packet(SBuf *sbuf, SBuf *dst, PktBuf *pkt)
+{
+	AssertActive(sbuf);
+	Assert(iobuf_amount_pending(sbuf->io) == 0);
+	Assert(!sbuf->extra || sbuf->dst == dst);
+
+	if (pkt->failed)
+		return false;
+
+	if (!sbuf->extra) {
+		sbuf->extra = pktbuf_dynamic(pkt->write_pos);
+		if (!sbuf->extra)
+			return false;
+	}
+	pktbuf_put_bytes(sbuf->extra, pkt->buf, pkt->write_pos);
+	sbuf->dst = dst;
+	return !sbuf->extra->failed;
+}
+
+/*
+ * Send out all data tagged for sending so far.  Can only be called from
+ * the SBUF_EV_READ callback.  If false is returned, sbuf waits until the
+ * destination is writable and then calls the callback again for the
+ * same packet.
+ */
+bool sbuf_flush(SBuf *sbuf)
+{
+	AssertActive(sbuf);
+
+	if (iobuf_amount_pending(sbuf->io) == 0 && !sbuf->extra)
+		return true;
+	return sbuf_send_pending(sbuf);
+}
+
 /*
  * Standard IO ops.
  */
@@ -980,6 +1676,9 @@ bool sbuf_tls_setup(void)
 	struct tls_config *new_server_connect_conf = NULL;
 	struct tls *new_client_accept_base = NULL;
 
+	if (!ticket_secret_setup())
+		return false;
+
 	if (cf_client_tls_sslmode != SSLMODE_DISABLED) {
 		if (!*cf_client_tls_key_file || !*cf_client_tls_cert_file) {
 			log_error("To allow TLS connections from clients, client_tls_key_file and client_tls_cert_file must be set.");
@@ -1042,6 +1741,8 @@ bool sbuf_tls_setup(void)
 			log_error("TLS setup failed: %s", tls_error(new_client_accept_base));
 			goto failed;
 		}
+		if (!client_tls_resume_setup(new_client_accept_base->ssl_ctx))
+			goto failed;
 	}
 
 	/*
@@ -1061,6 +1762,7 @@ bool sbuf_tls_setup(void)
 			pool = container_of(item, PgPool, head);
 			tag_pool_dirty(pool);
 		}
+		tls_session_flush();
 	}
 
 	tls_free(client_accept_base);
@@ -1080,14 +1782,410 @@ failed:
 }
 
 /*
- * TLS handshake
+ * Kernel TLS
+ *
+ * When asked to before the handshake, OpenSSL installs the session keys
+ * into the socket once the handshake is done, if the kernel supports
+ * kTLS and the negotiated cipher.  Otherwise it silently stays in
+ * user space.  Reads and writes keep going through libtls, OpenSSL
+ * then only passes data through and handles the records the kernel
+ * cannot, like alerts and session tickets.
  */
 
-static bool handle_tls_handshake(SBuf *sbuf)
+static void sbuf_ktls_request(SBuf *sbuf, bool enable)
 {
+#ifdef USE_KTLS
+	if (enable)
+		SSL_set_options(sbuf->tls->ssl_conn, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+static void sbuf_ktls_check(SBuf *sbuf)
+{
+#ifdef USE_KTLS
+	SSL *ssl = sbuf->tls->ssl_conn;
+
+	if (!(SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS))
+		return;
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		sbuf->ktls |= SBUF_KTLS_SEND;
+	if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		sbuf->ktls |= SBUF_KTLS_RECV;
+	if (sbuf->ktls != (SBUF_KTLS_SEND | SBUF_KTLS_RECV))
+		log_debug("kTLS not fully available on fd %d (%s), send=%d recv=%d",
+			  sbuf->sock, SSL_get_cipher_name(ssl),
+			  (sbuf->ktls & SBUF_KTLS_SEND) != 0,
+			  (sbuf->ktls & SBUF_KTLS_RECV) != 0);
+#endif
+}
+
+/*
+ * Client-side session cache for server connections
+ *
+ * OpenSSL hands over new sessions, including TLS 1.3 tickets that
+ * arrive after the handshake, through the new session callback.  They
+ * are kept per server address and offered on the next connection to
+ * it.  TLS 1.3 tickets are used only once, as RFC 8446 recommends, the
+ * resumed connection brings new ones.  PostgreSQL itself does not
+ * resume sessions, but TLS terminating proxies in front of it may.
+ */
+
+#define TLS_SESSION_CACHE_MAX	256
+
+struct TLSSession {
+	struct List head;
+	SSL_SESSION *sess;
+	char key[FLEX_ARRAY];
+};
+
+/* most recently stored first */
+static STATLIST(tls_session_list);
+
+/* the new session callback may run in an auth thread */
+static pthread_mutex_t tls_session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* SSL ex_data with the cache key of the connection */
+static int tls_session_key_idx = -1;
+
+/* call with tls_session_lock held */
+static struct TLSSession *tls_session_find(const char *key)
+{
+	struct List *item;
+	struct TLSSession *ts;
+
+	statlist_for_each(item, &tls_session_list) {
+		ts = container_of(item, struct TLSSession, head);
+		if (strcmp(ts->key, key) == 0)
+			return ts;
+	}
+	return NULL;
+}
+
+/* call with tls_session_lock held */
+static void tls_session_drop(struct TLSSession *ts)
+{
+	statlist_remove(&tls_session_list, &ts->head);
+	SSL_SESSION_free(ts->sess);
+	free(ts);
+}
+
+static void tls_session_flush(void)
+{
+	struct List *item;
+
+	pthread_mutex_lock(&tls_session_lock);
+	while ((item = statlist_first(&tls_session_list)) != NULL)
+		tls_session_drop(container_of(item, struct TLSSession, head));
+	pthread_mutex_unlock(&tls_session_lock);
+}
+
+/* takes over the reference to sess, call with tls_session_lock held */
+static bool tls_session_store(const char *key, SSL_SESSION *sess)
+{
+	struct TLSSession *ts;
+	struct List *item;
+
+	ts = tls_session_find(key);
+	if (ts) {
+		SSL_SESSION_free(ts->sess);
+		ts->sess = sess;
+		statlist_remove(&tls_session_list, &ts->head);
+		statlist_prepend(&tls_session_list, &ts->head);
+		return true;
+	}
+
+	if (statlist_count(&tls_session_list) >= TLS_SESSION_CACHE_MAX) {
+		item = statlist_last(&tls_session_list);
+		tls_session_drop(container_of(item, struct TLSSession, head));
+	}
+
+	ts = malloc(sizeof(*ts) + strlen(key) + 1);
+	if (!ts)
+		return false;
+	list_init(&ts->head);
+	ts->sess = sess;
+	strcpy(ts->key, key);
+	statlist_prepend(&tls_session_list, &ts->head);
+	return true;
+}
+
+static int tls_session_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	const char *key = SSL_get_ex_data(ssl, tls_session_key_idx);
+	bool stored;
+
+	if (!key || !SSL_SESSION_is_resumable(sess))
+		return 0;
+	pthread_mutex_lock(&tls_session_lock);
+	stored = tls_session_store(key, sess);
+	pthread_mutex_unlock(&tls_session_lock);
+	return stored ? 1 : 0;
+}
+
+static void tls_session_key_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+				 int idx, long argl, void *argp)
+{
+	free(ptr);
+}
+
+/* offer a cached session and ask for new ones, before the handshake */
+static void tls_session_prepare(SBuf *sbuf, const char *key)
+{
+	SSL *ssl = sbuf->tls->ssl_conn;
+	SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+	struct TLSSession *ts;
+	char *k;
+
+	if (tls_session_key_idx < 0) {
+		tls_session_key_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, tls_session_key_free);
+		if (tls_session_key_idx < 0)
+			return;
+	}
+
+	k = strdup(key);
+	if (!k)
+		return;
+	if (!SSL_set_ex_data(ssl, tls_session_key_idx, k)) {
+		free(k);
+		return;
+	}
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_session_new_cb);
+
+	pthread_mutex_lock(&tls_session_lock);
+	ts = tls_session_find(key);
+	if (ts) {
+		if (!SSL_set_session(ssl, ts->sess))
+			tls_session_drop(ts);
+		else if (SSL_SESSION_get_protocol_version(ts->sess) >= TLS1_3_VERSION)
+			tls_session_drop(ts);
+	}
+	pthread_mutex_unlock(&tls_session_lock);
+}
+
+bool sbuf_tls_session_reused(SBuf *sbuf)
+{
+	return sbuf->tls && SSL_session_reused(sbuf->tls->ssl_conn);
+}
+
+/*
+ * Session resumption for client connections
+ *
+ * Session tickets are encrypted with keys that live in this process,
+ * not in the SSL_CTX, so they stay valid when RELOAD rebuilds the
+ * context.  Time is divided into periods of client_tls_session_lifetime,
+ * and the key of a period is derived from a random secret and the
+ * period number.  The secret is made before the workers are forked, so
+ * all workers use the same keys and a ticket made by one is accepted
+ * by the others.  Tickets made with the previous period's key are still
+ * accepted and renewed.  The callback may run in an auth thread, hence
+ * the lock.  The session ID cache is kept by OpenSSL in the SSL_CTX,
+ * so it is per worker and starts empty after RELOAD.
+ */
+
+struct TicketKey {
+	unsigned char name[16];
+	unsigned char aes_key[32];
+	unsigned char hmac_key[32];
+	uint64_t period;
+	bool valid;
+};
+
+static unsigned char ticket_secret[32];
+static bool ticket_secret_ready;
+
+/* keys of the current and previous period, indexed by period parity */
+static struct TicketKey ticket_keys[2];
+static pthread_mutex_t ticket_key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned char client_tls_sid_ctx[] = "pgbouncer";
+
+static uint64_t ticket_period_now(void)
+{
+	usec_t lifetime = cf_client_tls_session_lifetime;
+
+	if (lifetime < USEC)
+		lifetime = USEC;
+	return get_time_usec() / lifetime;
+}
+
+/*
+ * SHA-256 over the secret, the period and a label.  The secret has
+ * fixed length, so the inputs cannot be confused with each other.
+ */
+static bool ticket_derive(unsigned char *dst, size_t len, uint64_t period, char label)
+{
+	unsigned char buf[sizeof(ticket_secret) + 9];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+	int i;
+
+	memcpy(buf, ticket_secret, sizeof(ticket_secret));
+	for (i = 0; i < 8; i++)
+		buf[sizeof(ticket_secret) + i] = period >> (56 - 8 * i);
+	buf[sizeof(ticket_secret) + 8] = label;
+	if (EVP_Digest(buf, sizeof(buf), md, &mdlen, EVP_sha256(), NULL) != 1 || mdlen < len)
+		return false;
+	memcpy(dst, md, len);
+	return true;
+}
+
+/*
+ * Made on the first sbuf_tls_setup(), before workers_setup(), even if
+ * tickets are off, so that enabling them on RELOAD gives the same
+ * keys in all workers.
+ */
+static bool ticket_secret_setup(void)
+{
+	if (ticket_secret_ready)
+		return true;
+	if (RAND_bytes(ticket_secret, sizeof(ticket_secret)) != 1) {
+		log_error("TLS setup failed: cannot generate session ticket secret");
+		return false;
+	}
+	ticket_secret_ready = true;
+	return true;
+}
+
+/* call with ticket_key_lock held */
+static struct TicketKey *ticket_key_for(uint64_t period)
+{
+	struct TicketKey *key = &ticket_keys[period & 1];
+
+	if (key->valid && key->period == period)
+		return key;
+
+	key->valid = false;
+	if (!ticket_secret_ready ||
+	    !ticket_derive(key->name, sizeof(key->name), period, 'n') ||
+	    !ticket_derive(key->aes_key, sizeof(key->aes_key), period, 'a') ||
+	    !ticket_derive(key->hmac_key, sizeof(key->hmac_key), period, 'h'))
+		return NULL;
+	key->period = period;
+	key->valid = true;
+	return key;
+}
+
+/* call with ticket_key_lock held */
+static struct TicketKey *ticket_key_find(const unsigned char *name, uint64_t period)
+{
+	struct TicketKey *key;
+	int i;
+
+	for (i = 0; i < 2 && period >= (uint64_t)i; i++) {
+		key = ticket_key_for(period - i);
+		if (key && memcmp(key->name, name, sizeof(key->name)) == 0)
+			return key;
+	}
+	return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMacCtx;
+
+static bool ticket_mac_init(TicketMacCtx *hctx, const struct TicketKey *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+						      (void *)key->hmac_key,
+						      sizeof(key->hmac_key));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(hctx, params) == 1;
+}
+#else
+typedef HMAC_CTX TicketMacCtx;
+
+static bool ticket_mac_init(TicketMacCtx *hctx, const struct TicketKey *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL) == 1;
+}
+#endif
+
+/* returns 1 to use the ticket, 2 to use and renew it, 0 to ignore it, -1 on error */
+static int ticket_key_cb(SSL *ssl, unsigned char name[16], unsigned char *iv,
+			 EVP_CIPHER_CTX *cctx, TicketMacCtx *hctx, int enc)
+{
+	struct TicketKey *key;
+	uint64_t period = ticket_period_now();
+	int res = -1;
+
+	pthread_mutex_lock(&ticket_key_lock);
+	if (enc) {
+		key = ticket_key_for(period);
+		if (key &&
+		    RAND_bytes(iv, EVP_MAX_IV_LENGTH) == 1 &&
+		    EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) == 1 &&
+		    ticket_mac_init(hctx, key)) {
+			memcpy(name, key->name, sizeof(key->name));
+			res = 1;
+		}
+	} else {
+		key = ticket_key_find(name, period);
+		if (!key) {
+			res = 0;
+		} else if (ticket_mac_init(hctx, key) &&
+			   EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) == 1) {
+			res = (key->period == period) ? 1 : 2;
+		}
+	}
+	pthread_mutex_unlock(&ticket_key_lock);
+	return res;
+}
+
+static bool client_tls_resume_setup(SSL_CTX *ctx)
+{
+	long timeout = cf_client_tls_session_lifetime / USEC;
+
+	if (!cf_client_tls_session_tickets && cf_client_tls_session_cache_size <= 0) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		return true;
+	}
+
+	/* needed for resumption when client certificates are checked */
+	if (!SSL_CTX_set_session_id_context(ctx, client_tls_sid_ctx, sizeof(client_tls_sid_ctx) - 1)) {
+		log_error("TLS setup failed: cannot set session id context");
+		return false;
+	}
+	SSL_CTX_set_timeout(ctx, timeout > 0 ? timeout : 1);
+
+	if (cf_client_tls_session_tickets) {
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+	} else {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	if (cf_client_tls_session_cache_size > 0) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, cf_client_tls_session_cache_size);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+	return true;
+}
+
+/*
+ * TLS handshake
+ */
+
+/* handshake step that runs in an auth thread */
+struct TLSHandshakeJob {
+	struct AuthJob job;
+	SBuf *sbuf;		/* NULL if the sbuf was closed meanwhile */
+	struct tls *tls;
+	int sock;
 	int err;
+};
 
-	err = tls_handshake(sbuf->tls);
+static bool handle_tls_handshake_result(SBuf *sbuf, int err)
+{
 	log_noise("tls_handshake: err=%d", err);
 	if (err == TLS_WANT_POLLIN) {
 		return sbuf_use_callback_once(sbuf, EV_READ, sbuf_tls_handshake_cb);
@@ -1095,6 +2193,7 @@ static bool handle_tls_handshake(SBuf *sbuf)
 		return sbuf_use_callback_once(sbuf, EV_WRITE, sbuf_tls_handshake_cb);
 	} else if (err == 0) {
 		sbuf->tls_state = SBUF_TLS_OK;
+		sbuf_ktls_check(sbuf);
 		sbuf_call_proto(sbuf, SBUF_EV_TLS_READY);
 		return true;
 	} else {
@@ -1103,6 +2202,62 @@ static bool handle_tls_handshake(SBuf *sbuf)
 	}
 }
 
+static void tls_handshake_work(struct AuthJob *aj)
+{
+	struct TLSHandshakeJob *job = container_of(aj, struct TLSHandshakeJob, job);
+
+	job->err = tls_handshake(job->tls);
+}
+
+static void tls_handshake_done(struct AuthJob *aj)
+{
+	struct TLSHandshakeJob *job = container_of(aj, struct TLSHandshakeJob, job);
+	SBuf *sbuf = job->sbuf;
+	int err = job->err;
+
+	if (!sbuf) {
+		/* sbuf_close() left the connection to us */
+		tls_close(job->tls);
+		tls_free(job->tls);
+		safe_close(job->sock);
+		free(job);
+		return;
+	}
+
+	sbuf->tls_job = NULL;
+	free(job);
+	if (!handle_tls_handshake_result(sbuf, err))
+		sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+}
+
+/* the thread still uses tls and sock, tls_handshake_done() closes them */
+static void detach_tls_job(SBuf *sbuf)
+{
+	sbuf->tls_job->sbuf = NULL;
+	sbuf->tls_job = NULL;
+	sbuf->tls = NULL;
+	sbuf->sock = 0;
+}
+
+static bool handle_tls_handshake(SBuf *sbuf)
+{
+	struct TLSHandshakeJob *job;
+
+	if (auth_threads_enabled()) {
+		job = calloc(1, sizeof(*job));
+		if (job) {
+			job->sbuf = sbuf;
+			job->tls = sbuf->tls;
+			job->sock = sbuf->sock;
+			sbuf->tls_job = job;
+			auth_job_submit(&job->job, tls_handshake_work, tls_handshake_done);
+			return true;
+		}
+	}
+
+	return handle_tls_handshake_result(sbuf, tls_handshake(sbuf->tls));
+}
+
 static void sbuf_tls_handshake_cb(evutil_socket_t fd, short flags, void *_sbuf)
 {
 	SBuf *sbuf = _sbuf;
@@ -1130,6 +2285,7 @@ bool sbuf_tls_accept(SBuf *sbuf)
 		log_warning("TLS accept error: %s", tls_error(sbuf->tls));
 		return false;
 	}
+	sbuf_ktls_request(sbuf, cf_client_tls_ktls);
 
 	sbuf->tls_state = SBUF_TLS_DO_HANDSHAKE;
 	return true;
@@ -1139,7 +2295,7 @@ bool sbuf_tls_accept(SBuf *sbuf)
  * Connect to remote TLS host.
  */
 
-bool sbuf_tls_connect(SBuf *sbuf, const char *hostname)
+bool sbuf_tls_connect(SBuf *sbuf, const char *hostname, const char *session_key)
 {
 	struct tls *ctls;
 	int err;
@@ -1169,6 +2325,9 @@ bool sbuf_tls_connect(SBuf *sbuf, const char *hostname)
 		log_warning("TLS connect error: %s", tls_error(sbuf->tls));
 		return false;
 	}
+	sbuf_ktls_request(sbuf, cf_server_tls_ktls);
+	if (cf_server_tls_session_cache && session_key)
+		tls_session_prepare(sbuf, session_key);
 
 	sbuf->tls_state = SBUF_TLS_DO_HANDSHAKE;
 	return true;
@@ -1245,6 +2404,9 @@ static int tls_sbufio_close(struct SBuf *sbuf)
 
 void sbuf_cleanup(void)
 {
+	splice_cleanup();
+	uring_cleanup();
+	tls_session_flush();
 	tls_free(client_accept_base);
 	tls_config_free(client_accept_conf);
 	tls_config_free(server_connect_conf);
@@ -1260,10 +2422,13 @@ int server_connect_sslmode = SSLMODE_DISABLED;
 
 bool sbuf_tls_setup(void) { return true; }
 bool sbuf_tls_accept(SBuf *sbuf) { return false; }
-bool sbuf_tls_connect(SBuf *sbuf, const char *hostname) { return false; }
+bool sbuf_tls_connect(SBuf *sbuf, const char *hostname, const char *session_key) { return false; }
+bool sbuf_tls_session_reused(SBuf *sbuf) { return false; }
 
 void sbuf_cleanup(void)
 {
+	splice_cleanup();
+	uring_cleanup();
 }
 
 static bool handle_tls_handshake(SBuf *sbuf)
@@ -1271,4 +2436,8 @@ static bool handle_tls_handshake(SBuf *sbuf)
 	return false;
 }
 
+static void detach_tls_job(SBuf *sbuf)
+{
+}
+
 #endif
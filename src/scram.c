@@ -38,6 +38,214 @@ static bool calculate_client_proof(ScramState *scram_state,
 				   uint8_t *result);
 
 
+/*
+ * Cache of keys derived from plain-text passwords.
+ *
+ * Deriving SaltedPassword takes thousands of HMAC rounds, and without
+ * a cache it is done on every login of a user with a plain-text
+ * password.  Entries are found by (user, salt, iterations) in a
+ * direct-mapped table of scram_key_cache_size slots, a colliding entry
+ * simply replaces the old one.  Each entry also has a keyed digest of
+ * the password, so an entry made with an older password is not used
+ * and gets replaced.  Passwords given by clients are only cached once
+ * they are verified, so failed logins cannot evict good entries.
+ */
+struct ScramKeyCacheEntry {
+	bool used;
+	bool prefetched;			/* stored by an auth thread, not looked up yet */
+	uint8_t id[SCRAM_KEY_LEN];		/* H(user, salt, iterations) */
+	uint8_t password_check[SCRAM_KEY_LEN];	/* HMAC(cache secret, password) */
+	uint8_t ClientKey[SCRAM_KEY_LEN];
+	uint8_t StoredKey[SCRAM_KEY_LEN];
+	uint8_t ServerKey[SCRAM_KEY_LEN];
+};
+
+static struct ScramKeyCacheEntry *key_cache;
+static int key_cache_size;
+static int key_cache_used;
+static uint64_t key_cache_hits;
+static uint64_t key_cache_misses;
+static uint8_t key_cache_secret[SCRAM_KEY_LEN];
+
+#if defined(HAVE_PTHREAD_H) && !defined(WIN32)
+
+#include <pthread.h>
+
+/*
+ * Auth threads store entries too.  The table is only resized from the
+ * event loop, but under the lock, as a thread may be storing then.
+ */
+static pthread_mutex_t key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define key_cache_lock() pthread_mutex_lock(&key_cache_mutex)
+#define key_cache_unlock() pthread_mutex_unlock(&key_cache_mutex)
+
+#else
+
+#define key_cache_lock() do { } while (0)
+#define key_cache_unlock() do { } while (0)
+
+#endif
+
+/* (re)allocate the table if scram_key_cache_size was changed */
+static void key_cache_resize(void)
+{
+	static bool secret_initialized = false;
+	struct ScramKeyCacheEntry *new_cache = NULL;
+
+	if (key_cache_size == cf_scram_key_cache_size)
+		return;
+
+	if (cf_scram_key_cache_size > 0) {
+		if (!secret_initialized) {
+			get_random_bytes(key_cache_secret, sizeof(key_cache_secret));
+			secret_initialized = true;
+		}
+		new_cache = calloc(cf_scram_key_cache_size, sizeof(*new_cache));
+		if (!new_cache)
+			log_warning("no memory for SCRAM key cache");
+	}
+
+	key_cache_lock();
+	if (key_cache) {
+		memset(key_cache, 0, key_cache_size * sizeof(*key_cache));
+		free(key_cache);
+	}
+	key_cache = new_cache;
+	key_cache_size = new_cache ? cf_scram_key_cache_size : 0;
+	key_cache_used = 0;
+	key_cache_unlock();
+}
+
+/* cache lookup keys for one (user, salt, iterations, password) */
+static void key_cache_ids(const char *username, const char *password,
+			  const char *salt, int saltlen, int iterations,
+			  uint8_t *id, uint8_t *password_check)
+{
+	uint32_t iter = htonl(iterations);
+	struct sha256_ctx sha;
+	scram_HMAC_ctx ctx;
+
+	sha256_reset(&sha);
+	sha256_update(&sha, (const uint8_t *) username, strlen(username) + 1);
+	sha256_update(&sha, (const uint8_t *) &iter, sizeof(iter));
+	sha256_update(&sha, (const uint8_t *) salt, saltlen);
+	sha256_final(&sha, id);
+
+	scram_HMAC_init(&ctx, key_cache_secret, sizeof(key_cache_secret));
+	scram_HMAC_update(&ctx, password, strlen(password));
+	scram_HMAC_final(password_check, &ctx);
+}
+
+/* must be called with the lock held and key_cache set */
+static struct ScramKeyCacheEntry *key_cache_slot(const uint8_t *id)
+{
+	return &key_cache[(id[0] | id[1] << 8 | id[2] << 16 | (uint32_t) id[3] << 24) % key_cache_size];
+}
+
+/* copy out cached keys, ClientKey may be NULL to only check for them */
+static bool key_cache_lookup(const uint8_t *id, const uint8_t *password_check, bool count,
+			     uint8_t *ClientKey, uint8_t *StoredKey, uint8_t *ServerKey)
+{
+	struct ScramKeyCacheEntry *entry;
+	bool found = false;
+
+	key_cache_lock();
+	if (key_cache) {
+		entry = key_cache_slot(id);
+		found = entry->used &&
+			memcmp(entry->id, id, SCRAM_KEY_LEN) == 0 &&
+			memcmp(entry->password_check, password_check, SCRAM_KEY_LEN) == 0;
+		if (found && ClientKey) {
+			memcpy(ClientKey, entry->ClientKey, SCRAM_KEY_LEN);
+			memcpy(StoredKey, entry->StoredKey, SCRAM_KEY_LEN);
+			memcpy(ServerKey, entry->ServerKey, SCRAM_KEY_LEN);
+		}
+		/* keys that an auth thread derived for this login were a miss */
+		if (count && found && !entry->prefetched)
+			key_cache_hits++;
+		else if (count)
+			key_cache_misses++;
+		if (count && found)
+			entry->prefetched = false;
+	}
+	key_cache_unlock();
+	return found;
+}
+
+static void key_cache_store(const uint8_t *id, const uint8_t *password_check, bool prefetched,
+			    const uint8_t *ClientKey, const uint8_t *StoredKey, const uint8_t *ServerKey)
+{
+	struct ScramKeyCacheEntry *entry;
+
+	key_cache_lock();
+	if (key_cache) {
+		entry = key_cache_slot(id);
+		if (!entry->used)
+			key_cache_used++;
+		entry->used = true;
+		entry->prefetched = prefetched;
+		memcpy(entry->id, id, SCRAM_KEY_LEN);
+		memcpy(entry->password_check, password_check, SCRAM_KEY_LEN);
+		memcpy(entry->ClientKey, ClientKey, SCRAM_KEY_LEN);
+		memcpy(entry->StoredKey, StoredKey, SCRAM_KEY_LEN);
+		memcpy(entry->ServerKey, ServerKey, SCRAM_KEY_LEN);
+	}
+	key_cache_unlock();
+}
+
+static void compute_keys(const char *password, const char *salt, int saltlen, int iterations,
+			 uint8_t *ClientKey, uint8_t *StoredKey, uint8_t *ServerKey)
+{
+	uint8_t salted_password[SCRAM_KEY_LEN];
+
+	scram_SaltedPassword(password, salt, saltlen, iterations, salted_password);
+	scram_ClientKey(salted_password, ClientKey);
+	scram_H(ClientKey, SCRAM_KEY_LEN, StoredKey);
+	scram_ServerKey(salted_password, ServerKey);
+	memset(salted_password, 0, sizeof(salted_password));
+}
+
+/*
+ * Derive ClientKey, StoredKey and ServerKey from an already normalized
+ * password, using the cache when possible.  If expected_ServerKey is
+ * given, the password is being checked and the keys are only cached
+ * when they match, so wrong passwords cannot evict good entries.
+ */
+static void scram_derive_keys(const char *username, const char *password,
+			      const char *salt, int saltlen, int iterations,
+			      const uint8_t *expected_ServerKey,
+			      uint8_t *ClientKey, uint8_t *StoredKey, uint8_t *ServerKey)
+{
+	uint8_t id[SCRAM_KEY_LEN];
+	uint8_t password_check[SCRAM_KEY_LEN];
+
+	key_cache_resize();
+
+	if (!key_cache) {
+		compute_keys(password, salt, saltlen, iterations, ClientKey, StoredKey, ServerKey);
+		return;
+	}
+
+	key_cache_ids(username, password, salt, saltlen, iterations, id, password_check);
+	if (key_cache_lookup(id, password_check, true, ClientKey, StoredKey, ServerKey))
+		return;
+	compute_keys(password, salt, saltlen, iterations, ClientKey, StoredKey, ServerKey);
+	if (expected_ServerKey && memcmp(ServerKey, expected_ServerKey, SCRAM_KEY_LEN) != 0)
+		return;
+	key_cache_store(id, password_check, false, ClientKey, StoredKey, ServerKey);
+}
+
+void scram_key_cache_info(int *size, int *used, uint64_t *hits, uint64_t *misses)
+{
+	key_cache_lock();
+	*size = key_cache_size;
+	*used = key_cache_used;
+	*hits = key_cache_hits;
+	*misses = key_cache_misses;
+	key_cache_unlock();
+}
+
+
 /*
  * free SCRAM state info after auth is done
  */
@@ -48,7 +256,6 @@ void free_scram_state(ScramState *scram_state)
 	free(scram_state->client_final_message_without_proof);
 	free(scram_state->server_nonce);
 	free(scram_state->server_first_message);
-	free(scram_state->SaltedPassword);
 	free(scram_state->salt);
 	memset(scram_state, 0, sizeof(*scram_state));
 }
@@ -504,6 +711,7 @@ static bool calculate_client_proof(ScramState *scram_state,
 	if (user->has_scram_keys)
 	{
 		memcpy(ClientKey, user->scram_ClientKey, SCRAM_KEY_LEN);
+		scram_H(ClientKey, SCRAM_KEY_LEN, StoredKey);
 	}
 	else
 	{
@@ -518,20 +726,11 @@ static bool calculate_client_proof(ScramState *scram_state,
 				return false;
 		}
 
-		scram_state->SaltedPassword = malloc(SCRAM_KEY_LEN);
-		if (scram_state->SaltedPassword == NULL)
-			goto failed;
-		scram_SaltedPassword(prep_password,
-				     salt,
-				     saltlen,
-				     iterations,
-				     scram_state->SaltedPassword);
-
-		scram_ClientKey(scram_state->SaltedPassword, ClientKey);
+		/* ServerKey is needed later in verify_server_signature() */
+		scram_derive_keys(user->name, prep_password, salt, saltlen, iterations, NULL,
+				  ClientKey, StoredKey, scram_state->ServerKey);
 	}
 
-	scram_H(ClientKey, SCRAM_KEY_LEN, StoredKey);
-
 	scram_HMAC_init(&ctx, StoredKey, SCRAM_KEY_LEN);
 	scram_HMAC_update(&ctx,
 			  scram_state->client_first_message_bare,
@@ -551,9 +750,6 @@ static bool calculate_client_proof(ScramState *scram_state,
 
 	free(prep_password);
 	return true;
-failed:
-	free(prep_password);
-	return false;
 }
 
 bool verify_server_signature(ScramState *scram_state, const PgUser *user, const char *ServerSignature)
@@ -565,7 +761,7 @@ bool verify_server_signature(ScramState *scram_state, const PgUser *user, const
 	if (user->has_scram_keys)
 		memcpy(ServerKey, user->scram_ServerKey, SCRAM_KEY_LEN);
 	else
-		scram_ServerKey(scram_state->SaltedPassword, ServerKey);
+		memcpy(ServerKey, scram_state->ServerKey, SCRAM_KEY_LEN);
 
 	scram_HMAC_init(&ctx, ServerKey, SCRAM_KEY_LEN);
 	scram_HMAC_update(&ctx,
@@ -759,57 +955,6 @@ failed:
 	return false;
 }
 
-/*
- * For doing SCRAM with a password stored in plain text, build a SCRAM
- * secret on the fly.
- */
-static bool build_adhoc_scram_secret(const char *plain_password, ScramState *scram_state)
-{
-	const char *password;
-	char *prep_password;
-	pg_saslprep_rc rc;
-	char saltbuf[SCRAM_DEFAULT_SALT_LEN];
-	int encoded_len;
-	uint8_t salted_password[SCRAM_KEY_LEN];
-
-	rc = pg_saslprep(plain_password, &prep_password);
-	if (rc == SASLPREP_OOM)
-		goto failed;
-	else if (rc == SASLPREP_SUCCESS)
-		password = prep_password;
-	else
-		password = plain_password;
-
-	get_random_bytes((uint8_t *) saltbuf, sizeof(saltbuf));
-
-	scram_state->adhoc = true;
-
-	scram_state->iterations = SCRAM_DEFAULT_ITERATIONS;
-
-	encoded_len = pg_b64_enc_len(sizeof(saltbuf));
-	scram_state->salt = malloc(encoded_len + 1);
-	if (!scram_state->salt)
-		goto failed;
-	encoded_len = pg_b64_encode(saltbuf, sizeof(saltbuf), scram_state->salt, encoded_len);
-	if (encoded_len < 0)
-		goto failed;
-	scram_state->salt[encoded_len] = '\0';
-
-	/* Calculate StoredKey and ServerKey */
-	scram_SaltedPassword(password, saltbuf, sizeof(saltbuf),
-			     scram_state->iterations,
-			     salted_password);
-	scram_ClientKey(salted_password, scram_state->StoredKey);
-	scram_H(scram_state->StoredKey, SCRAM_KEY_LEN, scram_state->StoredKey);
-	scram_ServerKey(salted_password, scram_state->ServerKey);
-
-	free(prep_password);
-	return true;
-failed:
-	free(prep_password);
-	return false;
-}
-
 /*
  * Deterministically generate salt for mock authentication, using a
  * SHA256 hash based on the username and an instance-level secret key.
@@ -865,6 +1010,58 @@ failed:
 	return false;
 }
 
+/*
+ * For doing SCRAM with a password stored in plain text, build a SCRAM
+ * secret on the fly.
+ *
+ * The salt is derived from the user name like for mock authentication,
+ * so that it stays the same between logins and the derived keys can
+ * come from the key cache.
+ */
+static bool build_adhoc_scram_secret(const char *username, const char *plain_password, ScramState *scram_state)
+{
+	const char *password;
+	char *prep_password;
+	pg_saslprep_rc rc;
+	uint8_t saltbuf[SCRAM_DEFAULT_SALT_LEN];
+	int encoded_len;
+
+	rc = pg_saslprep(plain_password, &prep_password);
+	if (rc == SASLPREP_OOM)
+		goto failed;
+	else if (rc == SASLPREP_SUCCESS)
+		password = prep_password;
+	else
+		password = plain_password;
+
+	scram_mock_salt(username, saltbuf);
+
+	scram_state->adhoc = true;
+
+	scram_state->iterations = SCRAM_DEFAULT_ITERATIONS;
+
+	encoded_len = pg_b64_enc_len(sizeof(saltbuf));
+	scram_state->salt = malloc(encoded_len + 1);
+	if (!scram_state->salt)
+		goto failed;
+	encoded_len = pg_b64_encode((char *) saltbuf, sizeof(saltbuf), scram_state->salt, encoded_len);
+	if (encoded_len < 0)
+		goto failed;
+	scram_state->salt[encoded_len] = '\0';
+
+	/* Calculate StoredKey and ServerKey */
+	scram_derive_keys(username, password, (char *) saltbuf, sizeof(saltbuf),
+			  scram_state->iterations, NULL,
+			  scram_state->ClientKey, scram_state->StoredKey,
+			  scram_state->ServerKey);
+
+	free(prep_password);
+	return true;
+failed:
+	free(prep_password);
+	return false;
+}
+
 char *build_server_first_message(ScramState *scram_state, const char *username, const char *stored_secret)
 {
 	uint8_t raw_nonce[SCRAM_RAW_NONCE_LEN + 1];
@@ -886,7 +1083,7 @@ char *build_server_first_message(ScramState *scram_state, const char *username,
 				goto failed;
 			break;
 		case PASSWORD_TYPE_PLAINTEXT:
-			if (!build_adhoc_scram_secret(stored_secret, scram_state))
+			if (!build_adhoc_scram_secret(username, stored_secret, scram_state))
 				goto failed;
 			break;
 		default:
@@ -1054,9 +1251,10 @@ scram_verify_plain_password(PgSocket *client,
 	char *salt = NULL;
 	int saltlen;
 	int iterations;
-	uint8_t salted_password[SCRAM_KEY_LEN];
 	uint8_t stored_key[SCRAM_KEY_LEN];
 	uint8_t server_key[SCRAM_KEY_LEN];
+	uint8_t client_key[SCRAM_KEY_LEN];
+	uint8_t computed_stored_key[SCRAM_KEY_LEN];
 	uint8_t computed_key[SCRAM_KEY_LEN];
 	char *prep_password = NULL;
 	pg_saslprep_rc rc;
@@ -1087,8 +1285,8 @@ scram_verify_plain_password(PgSocket *client,
 		password = prep_password;
 
 	/* Compute Server Key based on the user-supplied plaintext password */
-	scram_SaltedPassword(password, salt, saltlen, iterations, salted_password);
-	scram_ServerKey(salted_password, computed_key);
+	scram_derive_keys(username, password, salt, saltlen, iterations, server_key,
+			  client_key, computed_stored_key, computed_key);
 
 	/*
 	 * Compare the secret's Server Key with the one computed from the
@@ -1102,3 +1300,115 @@ failed:
 	free(prep_password);
 	return result;
 }
+
+/*
+ * Key derivation for an auth thread.  The thread fills the key cache,
+ * and the login then finds the keys there.
+ */
+struct ScramKeyJob {
+	char *password;		/* normalized */
+	char *salt;
+	int saltlen;
+	int iterations;
+	bool check;		/* password is checked against server_key */
+	uint8_t server_key[SCRAM_KEY_LEN];
+	uint8_t id[SCRAM_KEY_LEN];
+	uint8_t password_check[SCRAM_KEY_LEN];
+};
+
+/*
+ * Prepare the derivation that a login would do inline.  If password is
+ * NULL, secret is a plain-text password used for SCRAM authentication,
+ * otherwise password is checked against the SCRAM secret.  Returns NULL
+ * if the keys are cached already or there is no cache to fill.
+ */
+struct ScramKeyJob *scram_key_job_new(const char *username, const char *password, const char *secret)
+{
+	struct ScramKeyJob *job;
+	char *encoded_salt = NULL;
+	char *prep_password = NULL;
+	uint8_t stored_key[SCRAM_KEY_LEN];
+	pg_saslprep_rc rc;
+
+	key_cache_resize();
+	if (!key_cache)
+		return NULL;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	if (!password) {
+		password = secret;
+		job->iterations = SCRAM_DEFAULT_ITERATIONS;
+		job->saltlen = SCRAM_DEFAULT_SALT_LEN;
+		job->salt = malloc(job->saltlen);
+		if (!job->salt)
+			goto failed;
+		scram_mock_salt(username, (uint8_t *) job->salt);
+	} else {
+		if (!parse_scram_secret(secret, &job->iterations, &encoded_salt, stored_key, job->server_key))
+			goto failed;
+		job->check = true;
+		job->saltlen = pg_b64_dec_len(strlen(encoded_salt));
+		job->salt = malloc(job->saltlen);
+		if (!job->salt)
+			goto failed;
+		job->saltlen = pg_b64_decode(encoded_salt, strlen(encoded_salt), job->salt, job->saltlen);
+		if (job->saltlen < 0)
+			goto failed;
+	}
+
+	rc = pg_saslprep(password, &prep_password);
+	if (rc == SASLPREP_OOM)
+		goto failed;
+	job->password = strdup(rc == SASLPREP_SUCCESS ? prep_password : password);
+	if (!job->password)
+		goto failed;
+
+	key_cache_ids(username, job->password, job->salt, job->saltlen, job->iterations,
+		      job->id, job->password_check);
+	/* the login counts the lookup when it runs again */
+	if (key_cache_lookup(job->id, job->password_check, false, NULL, NULL, NULL))
+		goto failed;
+
+	free(encoded_salt);
+	free(prep_password);
+	return job;
+failed:
+	free(encoded_salt);
+	free(prep_password);
+	scram_key_job_free(job);
+	return NULL;
+}
+
+/*
+ * Runs in an auth thread.  Returns false if the password was checked
+ * against a SCRAM secret and does not match.
+ */
+bool scram_key_job_run(struct ScramKeyJob *job)
+{
+	uint8_t ClientKey[SCRAM_KEY_LEN];
+	uint8_t StoredKey[SCRAM_KEY_LEN];
+	uint8_t ServerKey[SCRAM_KEY_LEN];
+
+	compute_keys(job->password, job->salt, job->saltlen, job->iterations,
+		     ClientKey, StoredKey, ServerKey);
+	/* do not let a wrong password evict a good entry */
+	if (job->check && memcmp(ServerKey, job->server_key, SCRAM_KEY_LEN) != 0)
+		return false;
+	key_cache_store(job->id, job->password_check, true, ClientKey, StoredKey, ServerKey);
+	return true;
+}
+
+void scram_key_job_free(struct ScramKeyJob *job)
+{
+	if (!job)
+		return;
+	if (job->password) {
+		memset(job->password, 0, strlen(job->password));
+		free(job->password);
+	}
+	free(job->salt);
+	free(job);
+}
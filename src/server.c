@@ -158,6 +158,8 @@ static bool handle_server_startup(PgSocket *server, PktHdr *pkt)
 		/* login ok */
 		slog_debug(server, "server login ok, start accepting queries");
 		server->ready = true;
+		stats_record_latency(server->pool, LATENCY_CONNECT,
+				     get_cached_time() - server->connect_time);
 
 		/* got all params */
 		finish_welcome_msg(server);
@@ -242,6 +244,20 @@ int database_max_connections(PgDatabase *db)
 	}
 }
 
+int database_max_concurrent_logins(PgDatabase *db)
+{
+	if (db->max_concurrent_logins <= 0)
+		return cf_max_concurrent_logins > 0 ? cf_max_concurrent_logins : 1;
+	return db->max_concurrent_logins;
+}
+
+int database_connect_rate(PgDatabase *db)
+{
+	if (db->connect_rate < 0)
+		return cf_server_connect_rate;
+	return db->connect_rate;
+}
+
 int user_max_connections(PgUser *user)
 {
 	if (user->max_user_connections <= 0) {
@@ -437,7 +453,14 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 	}
 	server->idle_tx = idle_tx;
 	server->ready = ready;
+
+	/* unlinked server got dirty, let janitor close it */
+	if (!ready && (server->state == SV_IDLE || server->state == SV_USED))
+		socket_timeout_arm(server);
 	server->pool->stats.server_bytes += pkt->len;
+	proto_stats_add(server->pool, server, pkt);
+	if (client)
+		client->stats.server_bytes += pkt->len;
 
 	if (server->setting_vars) {
 		Assert(client);
@@ -445,6 +468,9 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 	} else if (client) {
 		if (client->state == CL_LOGIN) {
 			return handle_auth_query_response(client, pkt);
+		} else if (server->server_prepared && !prepare_server_packet(server, pkt)) {
+			/* response to packet generated by pgbouncer */
+			sbuf_prepare_skip(sbuf, pkt->len);
 		} else {
 			sbuf_prepare_send(sbuf, &client->sbuf, pkt->len);
 
@@ -468,6 +494,9 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 						total = get_cached_time() - client->query_start;
 						client->query_start = 0;
 						server->pool->stats.query_time += total;
+						client->stats.query_time += total;
+						query_stats_finish(client, total);
+						stats_record_latency(server->pool, LATENCY_QUERY, total);
 						slog_debug(client, "query time: %d us", (int)total);
 					} else if (!async_response) {
 						slog_warning(client, "FIXME: query end, but query_start == 0");
@@ -481,6 +510,8 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 						total = get_cached_time() - client->xact_start;
 						client->xact_start = 0;
 						server->pool->stats.xact_time += total;
+						client->stats.xact_time += total;
+						stats_record_latency(server->pool, LATENCY_XACT, total);
 						slog_debug(client, "transaction time: %d us", (int)total);
 					} else if (!async_response) {
 						/* XXX This happens during takeover if the new process
@@ -495,6 +526,11 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 			slog_warning(server,
 				     "got packet '%c' from server when not linked",
 				     pkt_desc(pkt));
+		if (server->server_prepared) {
+			/* reset query may drop the prepared statements */
+			bool _ignore = prepare_server_packet(server, pkt);
+			(void) _ignore;
+		}
 		sbuf_prepare_skip(sbuf, pkt->len);
 	}
 
@@ -505,7 +541,6 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 static bool handle_connect(PgSocket *server)
 {
 	bool res = false;
-	PgPool *pool = server->pool;
 	char buf[PGADDR_BUF + 32];
 	bool is_unix = pga_is_unix(&server->remote_addr);
 
@@ -519,27 +554,17 @@ static bool handle_connect(PgSocket *server)
 				  pga_str(&server->local_addr, buf, sizeof(buf)));
 	}
 
-	if (!statlist_empty(&pool->cancel_req_list)) {
-		slog_debug(server, "use it for pending cancel req");
-		/* if pending cancel req, send it */
-		forward_cancel_request(server);
-		/* notify disconnect_server() that connect did not fail */
-		server->ready = true;
-		disconnect_server(server, false, "sent cancel req");
+	if (server_connect_sslmode > SSLMODE_DISABLED && !is_unix) {
+		slog_noise(server, "P: SSL request");
+		res = send_sslreq_packet(server);
+		if (res)
+			server->wait_sslchar = true;
 	} else {
-		/* proceed with login */
-		if (server_connect_sslmode > SSLMODE_DISABLED && !is_unix) {
-			slog_noise(server, "P: SSL request");
-			res = send_sslreq_packet(server);
-			if (res)
-				server->wait_sslchar = true;
-		} else {
-			slog_noise(server, "P: startup");
-			res = send_startup_packet(server);
-		}
-		if (!res)
-			disconnect_server(server, false, "startup pkt failed");
+		slog_noise(server, "P: startup");
+		res = send_startup_packet(server);
 	}
+	if (!res)
+		disconnect_server(server, false, "startup pkt failed");
 	return res;
 }
 
@@ -567,8 +592,17 @@ static bool handle_sslchar(PgSocket *server, struct MBuf *data)
 	}
 
 	if (schar == 'S') {
+		char key[PGADDR_BUF + 256];
+
 		slog_noise(server, "launching tls");
-		ok = sbuf_tls_connect(&server->sbuf, server->pool->db->host);
+		/* sessions are only valid for the same address and host name */
+		pga_str(&server->remote_addr, key, sizeof(key));
+		if (server->pool->db->host) {
+			strlcat(key, "/", sizeof(key));
+			strlcat(key, server->pool->db->host, sizeof(key));
+		}
+		server->request_time = get_cached_time();
+		ok = sbuf_tls_connect(&server->sbuf, server->pool->db->host, key);
 	} else if (server_connect_sslmode >= SSLMODE_REQUIRE) {
 		disconnect_server(server, false, "server refused SSL");
 		return false;
@@ -698,6 +732,13 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 			slog_noise(server, "SSL established: %s", infobuf);
 		}
 
+		/* request_time was set when the handshake started */
+		if (sbuf_tls_session_reused(&server->sbuf))
+			pool->tls_resumed++;
+		else
+			pool->tls_full++;
+		stats_record_latency(pool, LATENCY_TLS, get_cached_time() - server->request_time);
+
 		server->request_time = get_cached_time();
 		res = send_startup_packet(server);
 		if (res)
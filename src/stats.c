@@ -21,6 +21,106 @@
 static struct event ev_stats;
 static usec_t old_stamp, new_stamp;
 
+/*
+ * Log-linear latency histogram, in microseconds.
+ *
+ * Values below LATENCY_SUB_COUNT get a bucket each, above that every
+ * power of two is split into LATENCY_SUB_COUNT buckets, so a bucket is
+ * at most 1/LATENCY_SUB_COUNT of its value wide.  Values from
+ * 2^LATENCY_MAX_BITS us (about 19 hours) up land in the last bucket.
+ */
+#define LATENCY_SUB_BITS	3
+#define LATENCY_SUB_COUNT	(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS	36
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+struct LatencyHistogram {
+	uint64_t count;
+	usec_t max;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+/* ->cur is filled online, ->last is the previous stats_period */
+struct PoolLatency {
+	struct LatencyHistogram cur[LATENCY_KIND_COUNT];
+	struct LatencyHistogram last[LATENCY_KIND_COUNT];
+};
+
+static const char *latency_kind_names[LATENCY_KIND_COUNT] = {
+	"query", "xact", "wait", "connect", "tls"
+};
+
+struct ProtoType {
+	char type;
+	const char *name;
+};
+
+/* in slot order, slot 0 is for anything else */
+static const struct ProtoType proto_client_types[PROTO_CLIENT_TYPES] = {
+	{ '?', "Other" },
+	{ 'Q', "Query" },
+	{ 'P', "Parse" },
+	{ 'B', "Bind" },
+	{ 'E', "Execute" },
+	{ 'D', "Describe" },
+	{ 'C', "Close" },
+	{ 'S', "Sync" },
+	{ 'H', "Flush" },
+	{ 'F', "FunctionCall" },
+	{ 'd', "CopyData" },
+	{ 'c', "CopyDone" },
+	{ 'f', "CopyFail" },
+	{ 'X', "Terminate" },
+};
+
+static const struct ProtoType proto_server_types[PROTO_SERVER_TYPES] = {
+	{ '?', "Other" },
+	{ '1', "ParseComplete" },
+	{ '2', "BindComplete" },
+	{ '3', "CloseComplete" },
+	{ 'C', "CommandComplete" },
+	{ 'D', "DataRow" },
+	{ 'E', "ErrorResponse" },
+	{ 'I', "EmptyQueryResponse" },
+	{ 'N', "NoticeResponse" },
+	{ 'A', "NotificationResponse" },
+	{ 'n', "NoData" },
+	{ 's', "PortalSuspended" },
+	{ 'S', "ParameterStatus" },
+	{ 'T', "RowDescription" },
+	{ 't', "ParameterDescription" },
+	{ 'V', "FunctionCallResponse" },
+	{ 'Z', "ReadyForQuery" },
+	{ 'G', "CopyInResponse" },
+	{ 'H', "CopyOutResponse" },
+	{ 'W', "CopyBothResponse" },
+	{ 'd', "CopyData" },
+	{ 'c', "CopyDone" },
+	{ 'R', "Authentication" },
+	{ 'K', "BackendKeyData" },
+	{ 'v', "NegotiateProtocolVersion" },
+};
+
+uint8_t proto_client_slot[256];
+uint8_t proto_server_slot[256];
+
+struct LoopHistogram {
+	uint64_t total;
+	struct LatencyHistogram h;
+};
+
+static const char *loop_stat_names[LOOP_STAT_COUNT] = {
+	"iteration", "wait", "events", "janitor", "pam", "maint",
+	"reuse", "timers", "pooler", "dns", "sockets", "yields"
+};
+
+static struct LoopHistogram loop_cur[LOOP_STAT_COUNT];
+static struct LoopHistogram loop_last[LOOP_STAT_COUNT];
+
+/* current iteration */
+static usec_t loop_start, loop_wake, loop_busy, loop_stamp;
+static unsigned int loop_sockets, loop_yields;
+
 static void reset_stats(PgStats *stat)
 {
 	stat->server_bytes = 0;
@@ -43,6 +143,149 @@ static void stat_add(PgStats *total, PgStats *stat)
 	total->wait_time += stat->wait_time;
 }
 
+static int highest_bit(uint64_t v)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(v);
+#else
+	int bit = 0;
+	while (v >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+static int latency_bucket(usec_t value)
+{
+	uint64_t v = value > 0 ? value : 0;
+	int shift;
+
+	if (v < LATENCY_SUB_COUNT)
+		return v;
+	if (v >> LATENCY_MAX_BITS)
+		return LATENCY_BUCKETS - 1;
+	shift = highest_bit(v) - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_COUNT + (int)(v >> shift) - LATENCY_SUB_COUNT;
+}
+
+/* highest value that falls into the bucket */
+static usec_t latency_bucket_value(int bucket)
+{
+	int shift;
+
+	if (bucket < LATENCY_SUB_COUNT)
+		return bucket;
+	shift = bucket / LATENCY_SUB_COUNT - 1;
+	return ((usec_t)(LATENCY_SUB_COUNT + bucket % LATENCY_SUB_COUNT) << shift) + ((usec_t)1 << shift) - 1;
+}
+
+/* value below which permille of the recorded values are */
+static usec_t latency_percentile(const struct LatencyHistogram *h, int permille)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	rank = (h->count * permille + 999) / 1000;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	/* the exact maximum is known, buckets only give an upper bound */
+	if (i >= LATENCY_BUCKETS || latency_bucket_value(i) > h->max)
+		return h->max;
+	return latency_bucket_value(i);
+}
+
+static void histogram_add(struct LatencyHistogram *h, usec_t value)
+{
+	h->count++;
+	h->buckets[latency_bucket(value)]++;
+	if (value > h->max)
+		h->max = value;
+}
+
+void stats_record_latency(PgPool *pool, enum LatencyKind kind, usec_t value)
+{
+	if (!pool->latency) {
+		pool->latency = calloc(1, sizeof(*pool->latency));
+		if (!pool->latency)
+			return;
+	}
+
+	histogram_add(&pool->latency->cur[kind], value);
+}
+
+void stats_free_latency(PgPool *pool)
+{
+	free(pool->latency);
+	pool->latency = NULL;
+}
+
+void loop_stats_record(enum LoopStat stat, usec_t value)
+{
+	loop_cur[stat].total += value;
+	histogram_add(&loop_cur[stat].h, value);
+}
+
+void loop_stats_begin(void)
+{
+	loop_start = get_time_usec();
+	loop_wake = 0;
+	loop_sockets = 0;
+	loop_yields = 0;
+}
+
+/*
+ * First callback of the iteration that does real work.  Time before
+ * it was spent blocked in the kernel.
+ */
+void loop_stats_wake(void)
+{
+	if (!loop_wake)
+		loop_wake = get_time_usec();
+}
+
+void loop_stats_socket(void)
+{
+	loop_stats_wake();
+	loop_sockets++;
+}
+
+void loop_stats_yield(void)
+{
+	loop_yields++;
+}
+
+/* event_base_loop() returned */
+void loop_stats_dispatched(void)
+{
+	loop_stamp = get_time_usec();
+	loop_busy = loop_wake ? loop_wake : loop_stamp;
+	loop_stats_record(LOOP_WAIT, loop_busy - loop_start);
+	loop_stats_record(LOOP_EVENTS, loop_stamp - loop_busy);
+}
+
+/* time since the previous phase ended */
+void loop_stats_phase(enum LoopStat phase)
+{
+	usec_t now = get_time_usec();
+
+	loop_stats_record(phase, now - loop_stamp);
+	loop_stamp = now;
+}
+
+void loop_stats_end(void)
+{
+	loop_stats_record(LOOP_ITERATION, loop_stamp - loop_busy);
+	loop_stats_record(LOOP_SOCKETS, loop_sockets);
+	loop_stats_record(LOOP_YIELDS, loop_yields);
+}
+
 static void calc_average(PgStats *avg, PgStats *cur, PgStats *old)
 {
 	uint64_t query_count;
@@ -282,6 +525,17 @@ bool admin_database_stats_averages(PgSocket *client, struct StatList *pool_list)
 	return true;
 }
 
+/* TLS handshakes with clients, which happen before a pool is known */
+static uint64_t client_tls_full, client_tls_resumed;
+
+void stats_client_tls(bool resumed)
+{
+	if (resumed)
+		client_tls_resumed++;
+	else
+		client_tls_full++;
+}
+
 bool show_stat_totals(PgSocket *client, struct StatList *pool_list)
 {
 	PgPool *pool;
@@ -326,6 +580,120 @@ bool show_stat_totals(PgSocket *client, struct StatList *pool_list)
 	WAVG(xact_time);
 	WAVG(query_time);
 	WAVG(wait_time);
+	pktbuf_write_DataRow(buf, "sN", "total_client_tls_full", client_tls_full);
+	pktbuf_write_DataRow(buf, "sN", "total_client_tls_resumed", client_tls_resumed);
+
+	admin_flush(client, buf, "SHOW");
+	return true;
+}
+
+static void write_proto_rows(PktBuf *buf, PgPool *pool, const char *dir,
+			     const struct ProtoType *types, const struct ProtoCounter *counters,
+			     int count)
+{
+	char type[2] = "";
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (counters[i].count == 0)
+			continue;
+		type[0] = i ? types[i].type : '\0';
+		pktbuf_write_DataRow(buf, "sssssqq", pool->db->name, pool->user->name,
+				     dir, type, types[i].name,
+				     counters[i].count, counters[i].bytes);
+	}
+}
+
+/* Command: SHOW PROTOCOL */
+bool admin_protocol_stats(PgSocket *client, struct StatList *pool_list)
+{
+	PgPool *pool;
+	struct List *item;
+	PktBuf *buf;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(client, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "sssssqq", "database", "user", "source",
+				    "type", "name", "count", "bytes");
+	statlist_for_each(item, pool_list) {
+		pool = container_of(item, PgPool, head);
+		write_proto_rows(buf, pool, "client", proto_client_types,
+				 pool->proto_stats.client, PROTO_CLIENT_TYPES);
+		write_proto_rows(buf, pool, "server", proto_server_types,
+				 pool->proto_stats.server, PROTO_SERVER_TYPES);
+	}
+
+	admin_flush(client, buf, "SHOW");
+	return true;
+}
+
+/* Command: SHOW LATENCY */
+bool admin_latency_stats(PgSocket *client, struct StatList *pool_list)
+{
+	PgPool *pool;
+	struct List *item;
+	const struct LatencyHistogram *h;
+	PktBuf *buf;
+	int kind;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(client, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "sssqqqqqq", "database", "user", "type",
+				    "count", "p50", "p90", "p99", "p999", "max");
+	statlist_for_each(item, pool_list) {
+		pool = container_of(item, PgPool, head);
+		if (!pool->latency)
+			continue;
+		for (kind = 0; kind < LATENCY_KIND_COUNT; kind++) {
+			h = &pool->latency->last[kind];
+			pktbuf_write_DataRow(buf, "sssqqqqqq",
+					     pool->db->name, pool->user->name,
+					     latency_kind_names[kind], h->count,
+					     latency_percentile(h, 500),
+					     latency_percentile(h, 900),
+					     latency_percentile(h, 990),
+					     latency_percentile(h, 999),
+					     h->max);
+		}
+	}
+
+	admin_flush(client, buf, "SHOW");
+	return true;
+}
+
+/* Command: SHOW LOOP */
+bool admin_loop_stats(PgSocket *client)
+{
+	const struct LoopHistogram *l;
+	PktBuf *buf;
+	int stat;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(client, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "sqqqqqqq", "stat", "count", "total",
+				    "avg", "p50", "p99", "p999", "max");
+	for (stat = 0; stat < LOOP_STAT_COUNT; stat++) {
+		l = &loop_last[stat];
+		pktbuf_write_DataRow(buf, "sqqqqqqq", loop_stat_names[stat],
+				     l->h.count, l->total,
+				     l->h.count ? l->total / l->h.count : 0,
+				     latency_percentile(&l->h, 500),
+				     latency_percentile(&l->h, 990),
+				     latency_percentile(&l->h, 999),
+				     l->h.max);
+	}
 
 	admin_flush(client, buf, "SHOW");
 	return true;
@@ -344,11 +712,19 @@ static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 	old_stamp = new_stamp;
 	new_stamp = get_cached_time();
 
+	memcpy(loop_last, loop_cur, sizeof(loop_last));
+	memset(loop_cur, 0, sizeof(loop_cur));
+
 	statlist_for_each(item, &pool_list) {
 		pool = container_of(item, PgPool, head);
 		pool->older_stats = pool->newer_stats;
 		pool->newer_stats = pool->stats;
 
+		if (pool->latency) {
+			memcpy(pool->latency->last, pool->latency->cur, sizeof(pool->latency->last));
+			memset(pool->latency->cur, 0, sizeof(pool->latency->cur));
+		}
+
 		if (cf_log_stats) {
 			stat_add(&cur_total, &pool->stats);
 			stat_add(&old_total, &pool->older_stats);
@@ -388,6 +764,12 @@ static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 void stats_setup(void)
 {
 	struct timeval period = { cf_stats_period, 0 };
+	int i;
+
+	for (i = 1; i < PROTO_CLIENT_TYPES; i++)
+		proto_client_slot[(uint8_t)proto_client_types[i].type] = i;
+	for (i = 1; i < PROTO_SERVER_TYPES; i++)
+		proto_server_slot[(uint8_t)proto_server_types[i].type] = i;
 
 	new_stamp = get_cached_time();
 	old_stamp = new_stamp - USEC;
@@ -181,6 +181,7 @@ static void takeover_create_link(PgPool *pool, PgSocket *client)
 		if (server->tmp_sk_oldfd == client->tmp_sk_linkfd) {
 			server->link = client;
 			client->link = server;
+			client->link_time = get_cached_time();
 			return;
 		}
 	}
@@ -320,6 +320,161 @@ void rescue_timers(void)
 }
 
 
+/*
+ * Hash index
+ */
+
+#define HASHINDEX_MIN_SIZE	64
+
+/* returned for lookups before the first insert */
+static LIST(empty_bucket);
+
+void hashindex_init(struct HashIndex *idx, uint32_t (*node_hash)(struct List *node))
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->node_hash = node_hash;
+}
+
+void hashindex_destroy(struct HashIndex *idx)
+{
+	free(idx->buckets);
+	hashindex_init(idx, idx->node_hash);
+}
+
+/* move nodes to a larger bucket array, keep old one on failure */
+static bool hashindex_grow(struct HashIndex *idx)
+{
+	unsigned int i, size = idx->size ? idx->size * 2 : HASHINDEX_MIN_SIZE;
+	struct List *buckets, *item, *tmp;
+
+	buckets = malloc(size * sizeof(*buckets));
+	if (!buckets)
+		return false;
+	for (i = 0; i < size; i++)
+		list_init(&buckets[i]);
+
+	for (i = 0; i < idx->size; i++) {
+		list_for_each_safe(item, &idx->buckets[i], tmp) {
+			list_del(item);
+			list_append(&buckets[idx->node_hash(item) & (size - 1)], item);
+		}
+	}
+	free(idx->buckets);
+	idx->buckets = buckets;
+	idx->size = size;
+	return true;
+}
+
+bool hashindex_insert(struct HashIndex *idx, struct List *node)
+{
+	if (idx->count >= idx->size && !hashindex_grow(idx) && idx->size == 0)
+		return false;
+
+	list_append(&idx->buckets[idx->node_hash(node) & (idx->size - 1)], node);
+	idx->count++;
+	return true;
+}
+
+void hashindex_remove(struct HashIndex *idx, struct List *node)
+{
+	list_del(node);
+	idx->count--;
+}
+
+/* list of nodes that may have the hash */
+struct List *hashindex_bucket(struct HashIndex *idx, uint32_t hash)
+{
+	if (idx->size == 0)
+		return &empty_bucket;
+	return &idx->buckets[hash & (idx->size - 1)];
+}
+
+
+/*
+ * Timer wheel
+ */
+
+void timerwheel_init(struct TimerWheel *w, usec_t tick)
+{
+	unsigned int i;
+
+	for (i = 0; i < TIMERWHEEL_SLOTS; i++)
+		list_init(&w->slots[i]);
+	w->tick = tick;
+	w->last_tick = get_cached_time() / tick;
+	w->count = 0;
+}
+
+void timerwheel_node_init(struct TimerWheelNode *node)
+{
+	list_init(&node->head);
+	node->deadline = 0;
+}
+
+/* (re)arm node, deadlines in the past fire on the next tick */
+void timerwheel_add(struct TimerWheel *w, struct TimerWheelNode *node, usec_t deadline)
+{
+	uint64_t tick = deadline / w->tick;
+
+	timerwheel_remove(w, node);
+	if (tick <= w->last_tick)
+		tick = w->last_tick + 1;
+	node->deadline = deadline;
+	list_append(&w->slots[tick & (TIMERWHEEL_SLOTS - 1)], &node->head);
+	w->count++;
+}
+
+void timerwheel_remove(struct TimerWheel *w, struct TimerWheelNode *node)
+{
+	if (!timerwheel_node_armed(node))
+		return;
+	list_del(&node->head);
+	w->count--;
+}
+
+/*
+ * Call cb for each node whose deadline has passed.  The node is
+ * disarmed before the call, cb may re-arm it or remove other nodes.
+ */
+void timerwheel_expire(struct TimerWheel *w, usec_t now, timerwheel_expire_f cb)
+{
+	uint64_t tick, last = now / w->tick;
+	struct List *slot, *item, *tmp;
+	struct TimerWheelNode *node;
+	struct List expired;
+
+	if (last <= w->last_tick)
+		return;
+
+	/* after a long stall one revolution covers all slots */
+	tick = w->last_tick + 1;
+	if (last - tick >= TIMERWHEEL_SLOTS)
+		tick = last - TIMERWHEEL_SLOTS + 1;
+
+	for (; tick <= last; tick++) {
+		/* nodes re-armed from cb must go to a later slot */
+		w->last_tick = tick;
+
+		list_init(&expired);
+		slot = &w->slots[tick & (TIMERWHEEL_SLOTS - 1)];
+		list_for_each_safe(item, slot, tmp) {
+			node = container_of(item, struct TimerWheelNode, head);
+			if (node->deadline > now)
+				continue;
+			list_del(item);
+			list_append(&expired, item);
+		}
+
+		while (!list_empty(&expired)) {
+			item = list_pop(&expired);
+			w->count--;
+			node = container_of(item, struct TimerWheelNode, head);
+			cb(node);
+		}
+	}
+}
+
+
 /*
  * PgAddr operations
  */
@@ -0,0 +1,402 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Worker mode: several event loops serving one configuration.
+ *
+ * The pooler state (pools, sockets, slabs, timers) is owned by a
+ * single event loop and is not safe to share, so each worker is a
+ * forked copy of the process with its own libevent base and its own
+ * SO_REUSEPORT listeners; the kernel spreads incoming TCP connections
+ * between them.  Configuration is loaded once before the fork and
+ * reloads are forwarded to every worker.
+ *
+ * Per-database and per-user server connection counts are kept in a
+ * small shared memory table, so that max_db_connections and
+ * max_user_connections limit the total over all workers.  A connection
+ * is counted before it is launched and given back if that goes over a
+ * limit, so workers cannot pass the limit together.  Each worker's
+ * share is kept as well, so it can be taken out when a worker dies.
+ * The server_connect_rate limiter of each database lives there too.
+ */
+
+#include "bouncer.h"
+
+#include <usual/hashing/memhash.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+int cf_workers;
+
+/* 0 in the first (or only) process, 1..N-1 in forked workers */
+int worker_id;
+
+#define MAX_WORKERS		256
+#define SHARED_COUNTER_SLOTS	8192
+
+enum CounterKind {
+	COUNTER_DB = 1,
+	COUNTER_USER = 2,
+};
+
+enum CounterState {
+	SLOT_EMPTY = 0,
+	SLOT_BUSY,		/* name is being filled in */
+	SLOT_READY,
+};
+
+struct SharedCounter {
+	int state;
+	int kind;
+	uint32_t hash;
+	int count;
+	uint64_t connect_tat;	/* database connect_rate limiter */
+	char name[MAX_USERNAME];
+	int worker_count[FLEX_ARRAY];	/* cf_workers entries */
+};
+
+static struct SharedCounter *shared_counters;
+
+/* size of one slot, with worker_count */
+static size_t shared_counter_size;
+
+#define shared_counter_at(pos) \
+	((struct SharedCounter *)((char *)shared_counters + (size_t)(pos) * shared_counter_size))
+
+/* pids of forked workers, only filled in worker 0 */
+static pid_t worker_pids[MAX_WORKERS];
+
+/*
+ * Find or create the slot for given name.  Slots are never freed,
+ * the table only needs to hold all databases and users ever seen.
+ */
+static struct SharedCounter *shared_counter(int kind, const char *name)
+{
+	size_t len = strlen(name);
+	uint32_t hash = memhash(name, len) ^ kind;
+	unsigned int i, pos;
+	struct SharedCounter *slot;
+	int state;
+
+	for (i = 0; i < SHARED_COUNTER_SLOTS; i++) {
+		pos = (hash + i) % SHARED_COUNTER_SLOTS;
+		slot = shared_counter_at(pos);
+
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == SLOT_EMPTY) {
+			int expected = SLOT_EMPTY;
+			if (__atomic_compare_exchange_n(&slot->state, &expected, SLOT_BUSY, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				slot->kind = kind;
+				slot->hash = hash;
+				safe_strcpy(slot->name, name, sizeof(slot->name));
+				__atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+				return slot;
+			}
+			state = expected;
+		}
+		/* another worker is filling this slot, wait for the name */
+		while (state == SLOT_BUSY) {
+			sched_yield();
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		}
+		if (slot->hash == hash && slot->kind == kind && strcmp(slot->name, name) == 0)
+			return slot;
+	}
+	return NULL;
+}
+
+static struct SharedCounter *db_counter(PgDatabase *db)
+{
+	if (!db->shared_counter)
+		db->shared_counter = shared_counter(COUNTER_DB, db->name);
+	return db->shared_counter;
+}
+
+static struct SharedCounter *user_counter(PgUser *user)
+{
+	if (!user->shared_counter)
+		user->shared_counter = shared_counter(COUNTER_USER, user->name);
+	return user->shared_counter;
+}
+
+/* server connections to the database over all workers */
+int database_total_connections(PgDatabase *db)
+{
+	struct SharedCounter *c;
+
+	if (!workers_enabled())
+		return db->connection_count;
+	c = db_counter(db);
+	if (!c)
+		return db->connection_count;
+	return __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+}
+
+/* server connections of the user over all workers */
+int user_total_connections(PgUser *user)
+{
+	struct SharedCounter *c;
+
+	if (!workers_enabled())
+		return user->connection_count;
+	c = user_counter(user);
+	if (!c)
+		return user->connection_count;
+	return __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+}
+
+/*
+ * How many of this worker's server connections of the user have to go
+ * to bring the user down to max.  Every worker runs this on RELOAD at
+ * the same time, so each takes only its share of the excess, in
+ * proportion to the connections it holds, rounded up.
+ */
+int user_connection_excess(PgUser *user, int max)
+{
+	struct SharedCounter *c;
+	int total, mine, excess;
+
+	total = user_total_connections(user);
+	excess = total - max;
+	if (excess <= 0)
+		return 0;
+	if (!workers_enabled())
+		return excess;
+	c = user_counter(user);
+	if (!c)
+		return excess;
+	mine = __atomic_load_n(&c->worker_count[worker_id], __ATOMIC_RELAXED);
+	if (mine <= 0)
+		return 0;
+	return ((int64_t)excess * mine + total - 1) / total;
+}
+
+/*
+ * Connect rate limiter for the database.  It keeps the time at which
+ * the token bucket is full again; a connection may start if that
+ * stays within one burst of now.  With workers the time is kept in
+ * the shared table, so the rate applies to all workers together.
+ * If take is false, only check whether a token is there.
+ */
+bool database_connect_token(PgDatabase *db, bool take)
+{
+	int rate = database_connect_rate(db);
+	usec_t now = get_cached_time();
+	usec_t interval, limit, tat, next;
+	struct SharedCounter *c;
+	uint64_t *tatp = &db->connect_tat;
+
+	if (rate <= 0)
+		return true;
+
+	interval = USEC / rate;
+	limit = (usec_t)(cf_server_connect_burst > 0 ? cf_server_connect_burst : rate) * interval;
+	if (workers_enabled()) {
+		c = db_counter(db);
+		if (c)
+			tatp = &c->connect_tat;
+	}
+
+	tat = __atomic_load_n(tatp, __ATOMIC_RELAXED);
+	do {
+		next = (tat > now ? tat : now) + interval;
+		if (next - now > limit)
+			return false;
+		if (!take)
+			return true;
+	} while (!__atomic_compare_exchange_n(tatp, &tat, next, false,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+/* returns the new total */
+static int shared_counter_add(struct SharedCounter *c, int delta)
+{
+	__atomic_add_fetch(&c->worker_count[worker_id], delta, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&c->count, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a server connection about to be launched for the pool.
+ * Returns false if that would take the database or the user over its
+ * limit, then nothing is counted.
+ */
+bool workers_connection_reserve(PgPool *pool)
+{
+	struct SharedCounter *dbc, *userc;
+	int max;
+
+	if (!workers_enabled())
+		return true;
+
+	dbc = db_counter(pool->db);
+	if (dbc) {
+		max = database_max_connections(pool->db);
+		if (shared_counter_add(dbc, 1) > max && max > 0) {
+			shared_counter_add(dbc, -1);
+			return false;
+		}
+	}
+	userc = user_counter(pool->user);
+	if (userc) {
+		max = user_max_connections(pool->user);
+		if (shared_counter_add(userc, 1) > max && max > 0) {
+			shared_counter_add(userc, -1);
+			if (dbc)
+				shared_counter_add(dbc, -1);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* give back what workers_connection_reserve() counted */
+void workers_connection_release(PgPool *pool)
+{
+	struct SharedCounter *c;
+
+	if (!workers_enabled())
+		return;
+	c = db_counter(pool->db);
+	if (c)
+		shared_counter_add(c, -1);
+	c = user_counter(pool->user);
+	if (c)
+		shared_counter_add(c, -1);
+}
+
+/* the server connections of a dead worker are gone */
+static void forget_worker_connections(int worker)
+{
+	struct SharedCounter *c;
+	unsigned int pos;
+	int n;
+
+	for (pos = 0; pos < SHARED_COUNTER_SLOTS; pos++) {
+		c = shared_counter_at(pos);
+		if (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) != SLOT_READY)
+			continue;
+		n = __atomic_exchange_n(&c->worker_count[worker], 0, __ATOMIC_RELAXED);
+		if (n)
+			__atomic_sub_fetch(&c->count, n, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Pass a signal received by worker 0 to the other workers,
+ * so that RELOAD, PAUSE, RESUME and shutdown apply to all of them.
+ */
+void workers_signal(int sig)
+{
+	int i;
+
+	if (!workers_enabled() || worker_id != 0)
+		return;
+	for (i = 1; i < cf_workers; i++) {
+		if (worker_pids[i] <= 0)
+			continue;
+		if (kill(worker_pids[i], sig) < 0)
+			log_warning("could not signal worker %d (pid %d): %s",
+				    i, (int)worker_pids[i], strerror(errno));
+	}
+}
+
+#ifndef WIN32
+
+/* collect exited workers, called on SIGCHLD */
+void workers_reap(void)
+{
+	pid_t pid;
+	int i, status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 1; i < cf_workers; i++) {
+			if (worker_pids[i] != pid)
+				continue;
+			worker_pids[i] = 0;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				log_info("worker %d (pid %d) exited", i, (int)pid);
+			else
+				log_error("worker %d (pid %d) terminated abnormally, status %d",
+					  i, (int)pid, status);
+			forget_worker_connections(i);
+		}
+	}
+}
+
+/*
+ * Fork the workers.  Must be called after config is loaded but
+ * before the event base and any helper threads are created.
+ */
+void workers_setup(void)
+{
+	size_t len;
+	pid_t pid;
+	int i;
+
+	if (!workers_enabled())
+		return;
+
+	if (cf_workers > MAX_WORKERS)
+		die("workers must not be larger than %d", MAX_WORKERS);
+	if (!cf_so_reuseport)
+		die("workers requires so_reuseport to be enabled");
+	if (cf_reboot)
+		die("online restart is not supported with workers");
+	if (sd_listen_fds(0) > 0)
+		die("workers cannot be used with sockets passed from service manager");
+
+	shared_counter_size = sizeof(struct SharedCounter) + sizeof(int) * cf_workers;
+	shared_counter_size = (shared_counter_size + 7) & ~(size_t)7;
+	len = shared_counter_size * SHARED_COUNTER_SLOTS;
+	shared_counters = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared_counters == MAP_FAILED)
+		die("could not allocate shared memory for workers: %s", strerror(errno));
+
+	for (i = 1; i < cf_workers; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("could not fork worker %d: %s", i, strerror(errno));
+		if (pid == 0) {
+			worker_id = i;
+#ifdef PR_SET_PDEATHSIG
+			/* do not outlive worker 0 */
+			if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+				log_warning("prctl(PR_SET_PDEATHSIG) failed: %s", strerror(errno));
+#endif
+			log_info("worker %d started", i);
+			return;
+		}
+		worker_pids[i] = pid;
+	}
+	log_info("started %d workers", cf_workers);
+}
+
+#else /* WIN32 */
+
+void workers_reap(void) {}
+void workers_setup(void) {}
+
+#endif
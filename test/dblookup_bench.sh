@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# Measure client login cost with different numbers of configured
+# databases.  Each pgbench transaction opens a new client connection
+# to a database that sorts after all the others, the server connection
+# is reused from the pool, so the result mostly shows the login path.
+#
+# Needs a running PostgreSQL with database p0 and user bouncer on port
+# $PG_PORT (6666 by default, like test.sh) and pgbench in PATH.
+#
+# Usage: ./dblookup_bench.sh [count ...]
+
+cd $(dirname $0)
+
+PG_PORT=${PG_PORT:-6666}
+BOUNCER_PORT=${BOUNCER_PORT:-6669}
+DURATION=${DURATION:-5}
+BOUNCER_EXE="$BOUNCER_EXE_PREFIX ../pgbouncer"
+
+WORKDIR=bench
+mkdir -p $WORKDIR
+
+counts=${*:-10 100 1000 10000 100000}
+
+command -v pgbench > /dev/null || {
+	echo "pgbench not found"
+	exit 1
+}
+
+echo "select 1;" > $WORKDIR/select.sql
+
+printf "%10s %12s %14s\n" databases tps "connect (ms)"
+for n in $counts; do
+	ini=$WORKDIR/bench.ini
+	{
+		echo "[databases]"
+		i=0
+		while [ $i -lt $n ]; do
+			printf "db%06d = port=$PG_PORT host=127.0.0.1 dbname=p0 user=bouncer\n" $i
+			i=$((i + 1))
+		done
+		echo "zzz_target = port=$PG_PORT host=127.0.0.1 dbname=p0 user=bouncer"
+		echo "[pgbouncer]"
+		echo "listen_addr = 127.0.0.1"
+		echo "listen_port = $BOUNCER_PORT"
+		echo "unix_socket_dir ="
+		echo "auth_type = any"
+		echo "pool_mode = transaction"
+		echo "logfile = $WORKDIR/bench.log"
+		echo "pidfile = $WORKDIR/bench.pid"
+	} > $ini
+
+	$BOUNCER_EXE -d $ini || exit 1
+	until psql -X -h 127.0.0.1 -p $BOUNCER_PORT -d zzz_target -c "select 1" > /dev/null 2>&1; do
+		sleep 0.1
+	done
+
+	pgbench -n -C -c 1 -T $DURATION -f $WORKDIR/select.sql \
+		-h 127.0.0.1 -p $BOUNCER_PORT zzz_target > $WORKDIR/pgbench.out 2>&1
+	tps=`sed -n 's/^tps = \([0-9.]*\).*/\1/p' $WORKDIR/pgbench.out | head -1`
+	conn=`sed -n 's/^average connection time = \([0-9.]*\).*/\1/p' $WORKDIR/pgbench.out`
+	printf "%10d %12s %14s\n" $n "$tps" "${conn:-n/a}"
+
+	kill `cat $WORKDIR/bench.pid`
+	while [ -f $WORKDIR/bench.pid ]; do sleep 0.1; done
+done
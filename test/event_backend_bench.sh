@@ -0,0 +1,93 @@
+#!/bin/sh
+
+# Compare event_backend values under many small queries: transactions
+# per second from pgbench, and, if strace is installed, the system
+# calls PgBouncer makes per transaction.  io_uring should replace most
+# recv() and send() calls with far fewer io_uring_enter() calls, the
+# more clients are active at once the bigger the batches.  strace slows
+# PgBouncer down, so the throughput is measured in a separate run.
+#
+# Needs a running PostgreSQL with database p0 and user bouncer on port
+# $PG_PORT (6666 by default, like test.sh), and pgbench.
+#
+# Usage: ./event_backend_bench.sh [event_backend ...]
+
+cd $(dirname $0)
+
+PG_PORT=${PG_PORT:-6666}
+BOUNCER_PORT=${BOUNCER_PORT:-6669}
+CLIENTS=${CLIENTS:-32}
+DURATION=${DURATION:-10}
+BOUNCER_EXE="$BOUNCER_EXE_PREFIX ../pgbouncer"
+
+WORKDIR=bench
+mkdir -p $WORKDIR
+
+backends=${*:-epoll epoll_changelist io_uring}
+
+echo "select 1;" > $WORKDIR/select1.sql
+
+run_pgbench() {
+	pgbench -n -h 127.0.0.1 -p $BOUNCER_PORT -U bouncer -f $WORKDIR/select1.sql \
+		-c $CLIENTS -j 4 -T $DURATION p0 2>/dev/null
+}
+
+start_bouncer() {
+	ini=$WORKDIR/bench.ini
+	{
+		echo "[databases]"
+		echo "p0 = port=$PG_PORT host=127.0.0.1 dbname=p0 user=bouncer"
+		echo "[pgbouncer]"
+		echo "listen_addr = 127.0.0.1"
+		echo "listen_port = $BOUNCER_PORT"
+		echo "unix_socket_dir ="
+		echo "auth_type = any"
+		echo "pool_mode = transaction"
+		echo "default_pool_size = $CLIENTS"
+		echo "max_client_conn = $((CLIENTS + 10))"
+		echo "event_backend = $1"
+		echo "logfile = $WORKDIR/bench.log"
+		echo "pidfile = $WORKDIR/bench.pid"
+	} > $ini
+
+	$BOUNCER_EXE -d $ini || exit 1
+	until psql -X -h 127.0.0.1 -p $BOUNCER_PORT -d p0 -U bouncer -c "select 1" > /dev/null 2>&1; do
+		if grep -q "event_backend $1 is not" $WORKDIR/bench.log 2>/dev/null; then
+			echo "event_backend $1 is not available" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+stop_bouncer() {
+	kill `cat $WORKDIR/bench.pid`
+	while [ -f $WORKDIR/bench.pid ]; do sleep 0.1; done
+}
+
+# sum of the calls column of strace -c
+count_syscalls() {
+	awk '/^-/ { n++; next } n == 1 { sum += $4 } END { print sum }' $1
+}
+
+printf "%18s %10s %14s\n" event_backend tps "syscalls/xact"
+for b in $backends; do
+	rm -f $WORKDIR/bench.log
+	start_bouncer $b
+	tps=`run_pgbench | awk '/^tps/ { printf "%.0f", $3 }'`
+
+	per_xact=-
+	if command -v strace > /dev/null; then
+		strace -c -f -o $WORKDIR/strace.out -p `cat $WORKDIR/bench.pid` &
+		strace_pid=$!
+		sleep 1
+		xacts=`run_pgbench | awk '/^number of transactions actually processed/ { split($NF, a, "/"); print a[1] }'`
+		kill -INT $strace_pid
+		wait $strace_pid
+		calls=`count_syscalls $WORKDIR/strace.out`
+		per_xact=`echo "$calls $xacts" | awk '{ printf "%.2f", $1 / $2 }'`
+	fi
+
+	printf "%18s %10s %14s\n" $b "$tps" "$per_xact"
+	stop_bouncer
+done
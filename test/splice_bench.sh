@@ -0,0 +1,69 @@
+#!/bin/sh
+
+# Measure forwarding throughput of large packets with and without
+# splice().  Each row of the COPY is sent as one CopyData packet of
+# $ROW_SIZE bytes, so with a splice_threshold below that most of the
+# data bypasses PgBouncer's buffers.  splice_threshold 0 is the
+# regular copying path.
+#
+# Needs a running PostgreSQL with database p0 and user bouncer on port
+# $PG_PORT (6666 by default, like test.sh).
+#
+# Usage: ./splice_bench.sh [splice_threshold ...]
+
+cd $(dirname $0)
+
+PG_PORT=${PG_PORT:-6666}
+BOUNCER_PORT=${BOUNCER_PORT:-6669}
+ROW_SIZE=${ROW_SIZE:-1000000}
+ROWS=${ROWS:-2000}
+BOUNCER_EXE="$BOUNCER_EXE_PREFIX ../pgbouncer"
+
+WORKDIR=bench
+mkdir -p $WORKDIR
+
+thresholds=${*:-0 16384}
+
+query="copy (select repeat('x', $ROW_SIZE) from generate_series(1, $ROWS)) to stdout"
+
+now() {
+	date +%s.%N
+}
+
+run_copy() {
+	start=`now`
+	psql -X -h 127.0.0.1 -p $1 -d p0 -U bouncer -c "$query" > /dev/null || exit 1
+	end=`now`
+	echo "$start $end" | awk -v mb=$((ROW_SIZE * ROWS / 1000000)) \
+		'{ printf "%10.2f %10.0f\n", $2 - $1, mb / ($2 - $1) }'
+}
+
+printf "%16s %10s %10s\n" splice_threshold seconds "MB/s"
+printf "%16s " direct
+run_copy $PG_PORT
+for t in $thresholds; do
+	ini=$WORKDIR/bench.ini
+	{
+		echo "[databases]"
+		echo "p0 = port=$PG_PORT host=127.0.0.1 dbname=p0 user=bouncer"
+		echo "[pgbouncer]"
+		echo "listen_addr = 127.0.0.1"
+		echo "listen_port = $BOUNCER_PORT"
+		echo "unix_socket_dir ="
+		echo "auth_type = any"
+		echo "splice_threshold = $t"
+		echo "logfile = $WORKDIR/bench.log"
+		echo "pidfile = $WORKDIR/bench.pid"
+	} > $ini
+
+	$BOUNCER_EXE -d $ini || exit 1
+	until psql -X -h 127.0.0.1 -p $BOUNCER_PORT -d p0 -U bouncer -c "select 1" > /dev/null 2>&1; do
+		sleep 0.1
+	done
+
+	printf "%16d " $t
+	run_copy $BOUNCER_PORT
+
+	kill `cat $WORKDIR/bench.pid`
+	while [ -f $WORKDIR/bench.pid ]; do sleep 0.1; done
+done
@@ -500,6 +500,47 @@ test_client_ssl_scram() {
 	return $rc
 }
 
+# session tickets must stay valid across reload
+test_client_ssl_resume() {
+	command -v openssl >/dev/null || return 77
+	reconf_bouncer "auth_type = trust" "server_tls_sslmode = prefer" \
+		"client_tls_sslmode = require" \
+		"client_tls_key_file = TestCA1/sites/01-localhost.key" \
+		"client_tls_cert_file = TestCA1/sites/01-localhost.crt" \
+		"client_tls_session_tickets = 1"
+	openssl s_client -starttls postgres -tls1_2 -connect 127.0.0.1:$BOUNCER_PORT \
+		-sess_out tmp/test.sess </dev/null >tmp/test.tmp 2>&1
+	test -s tmp/test.sess || return 77
+	admin "reload"
+	openssl s_client -starttls postgres -tls1_2 -connect 127.0.0.1:$BOUNCER_PORT \
+		-sess_in tmp/test.sess </dev/null 2>&1 | tee tmp/test.tmp
+	grep -q "^Reused" tmp/test.tmp || return 1
+	admin "show totals" | tee tmp/test.tmp
+	grep -q "total_client_tls_resumed *| *1" tmp/test.tmp
+}
+
+# tickets made by one worker must be accepted by the others
+test_client_ssl_resume_workers() {
+	command -v openssl >/dev/null || return 77
+	test `uname` = Linux || return 77
+	reconf_bouncer "auth_type = trust" "server_tls_sslmode = prefer" \
+		"client_tls_sslmode = require" \
+		"client_tls_key_file = TestCA1/sites/01-localhost.key" \
+		"client_tls_cert_file = TestCA1/sites/01-localhost.crt" \
+		"client_tls_session_tickets = 1" \
+		"workers = 2" "so_reuseport = 1"
+	openssl s_client -starttls postgres -tls1_2 -connect 127.0.0.1:$BOUNCER_PORT \
+		-sess_out tmp/test.sess </dev/null >tmp/test.tmp 2>&1
+	test -s tmp/test.sess || return 77
+	# each connection lands in either worker
+	for i in 1 2 3 4 5 6 7 8; do
+		openssl s_client -starttls postgres -tls1_2 -connect 127.0.0.1:$BOUNCER_PORT \
+			-sess_in tmp/test.sess </dev/null 2>&1 | tee tmp/test.tmp
+		grep -q "^Reused" tmp/test.tmp || return 1
+	done
+	return 0
+}
+
 testlist="
 test_server_ssl
 test_server_ssl_set_disable
@@ -519,6 +560,8 @@ test_client_ssl_sighup_enable
 test_client_ssl_sighup_change_ca
 test_client_ssl_auth
 test_client_ssl_scram
+test_client_ssl_resume
+test_client_ssl_resume_workers
 "
 if [ $# -gt 0 ]; then
 	testlist="$*"
@@ -356,6 +356,20 @@ test_help() {
 	$BOUNCER_EXE --help || return 1
 }
 
+# the probes built in with --with-sdt
+test_probes() {
+	command -v readelf > /dev/null || return 77
+	readelf -n ../pgbouncer > $LOGDIR/probes.txt || return 1
+	grep -q 'Provider: pgbouncer' $LOGDIR/probes.txt || return 77
+
+	for probe in client__accept client__login client__disconnect \
+		server__launch server__link server__release server__disconnect \
+		sbuf__packet; do
+		grep -q "Name: $probe\$" $LOGDIR/probes.txt || return 1
+	done
+	return 0
+}
+
 # test all the show commands
 #
 # This test right now just runs all the commands without checking the
@@ -363,16 +377,47 @@ test_help() {
 # commands don't completely die.  The output can be manually eyeballed
 # in the test log file.
 test_show() {
-	for what in clients config databases fds help lists pools servers sockets active_sockets stats stats_totals stats_averages users totals mem dns_hosts dns_zones; do
+	# so that pools have counters to show
+	psql -X -c "select 1" p0 || return 1
+
+	for what in auth_caches cancels clients config databases fds hba help latency lists loop pools protocol queries servers sockets active_sockets stats stats_totals stats_averages top_clients top_clients_bytes top_clients_queries top_clients_wait users totals mem dns_hosts dns_zones; do
 		    echo "=> show $what;"
 		    psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show $what;" || return 1
 	done
 
+	psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show protocol;" | grep -q "p0 .*| client .*| Q " || return 1
 	psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show bogus;" && return 1
 
 	return 0
 }
 
+# metrics_listen_addr, scraped over HTTP
+test_metrics() {
+	command -v curl > /dev/null || return 77
+
+	# metrics_listen_addr cannot be reloaded, restart with it
+	cp test.ini test.ini.bak
+	echo "metrics_listen_addr = 127.0.0.1" >> test.ini
+	echo "metrics_port = 6670" >> test.ini
+	$BOUNCER_EXE -d -R $BOUNCER_INI
+	status=$?
+	cp test.ini.bak test.ini
+	rm test.ini.bak
+	test $status -eq 0 || return 1
+	sleep 1
+
+	psql -X -c "select 1" p0 || return 1
+
+	curl -sf http://127.0.0.1:6670/metrics > $LOGDIR/metrics.txt || return 1
+	cat $LOGDIR/metrics.txt
+	grep -q '^pgbouncer_pool_queries_total{database="p0",user="bouncer"} [1-9]' $LOGDIR/metrics.txt || return 1
+	tail -n 1 $LOGDIR/metrics.txt | grep -q '^# EOF$' || return 1
+
+	curl -sf http://127.0.0.1:6670/bogus && return 1
+
+	return 0
+}
+
 # server_lifetime
 test_server_lifetime() {
 	admin "set server_lifetime=2"
@@ -394,6 +439,77 @@ test_server_idle_timeout() {
 	return $rc
 }
 
+# large packets in both directions with splice()
+test_splice() {
+	admin "set splice_threshold=16384"
+
+	copy="copy (select repeat(md5(i::text), 10000) from generate_series(1, 50) i) to stdout"
+	sum1=`psql -X -p $PG_PORT -c "$copy" p0 | md5sum` || return 1
+	sum2=`psql -X -c "$copy" p0 | md5sum` || return 1
+	test "$sum1" = "$sum2" || return 1
+
+	big=$(printf '%*s' 300000 | tr ' ' x)
+	len=$(echo "select length('$big')" | psql -X -tAq p0) || return 1
+	test "$len" = 300000 || return 1
+
+	admin "set splice_threshold=0"
+	return 0
+}
+
+# restart with event_backend $1 and forward some data through it
+check_event_backend() {
+	local status copy sum1 sum2 big len i
+	test `uname` = Linux || return 77
+
+	stopit test.pid
+	cp test.ini test.ini.bak
+	echo "event_backend = $1" >> test.ini
+	$BOUNCER_EXE -d $BOUNCER_INI
+	status=$?
+	cp test.ini.bak test.ini
+	rm test.ini.bak
+	test $status -eq 0 || return 1
+	for i in `seq 50`; do
+		psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show version" 2>/dev/null 1>&2 && break
+		if grep -q "event_backend $1 is not" $BOUNCER_LOG; then
+			# not available here, keep runtest from taking it for a crash
+			sed -i '/FATAL @/d' $BOUNCER_LOG
+			return 77
+		fi
+		sleep 0.1
+	done
+
+	copy="copy (select repeat(md5(i::text), 10000) from generate_series(1, 50) i) to stdout"
+	sum1=`psql -X -p $PG_PORT -c "$copy" p0 | md5sum` || return 1
+	sum2=`psql -X -c "$copy" p0 | md5sum` || return 1
+	test "$sum1" = "$sum2" || return 1
+
+	big=$(printf '%*s' 300000 | tr ' ' x)
+	len=$(echo "select length('$big')" | psql -X -tAq p0) || return 1
+	test "$len" = 300000 || return 1
+
+	# many connections ready in the same loop iteration
+	sum1=`seq 100 | md5sum`
+	for i in {1..10}; do
+		seq 100 | sed 's/.*/select &;/' | psql -X -tAq p0 | md5sum > $LOGDIR/backend.$i &
+	done
+	wait
+	for i in {1..10}; do
+		sum2=`cat $LOGDIR/backend.$i`
+		rm -f $LOGDIR/backend.$i
+		test "$sum1" = "$sum2" || return 1
+	done
+	return 0
+}
+
+test_event_backend_changelist() {
+	check_event_backend epoll_changelist
+}
+
+test_event_backend_io_uring() {
+	check_event_backend io_uring
+}
+
 # query_timeout
 test_query_timeout() {
 	admin "set query_timeout=3"
@@ -425,6 +541,26 @@ test_idle_transaction_timeout() {
 	return 0
 }
 
+# named prepared statements in transaction pooling
+test_prepared_statements() {
+	command -v pgbench > /dev/null || return 77
+
+	admin "set pool_mode=transaction"
+	admin "set max_prepared_statements=2"
+
+	# three statements with room for two forces evictions
+	cat > $LOGDIR/prepared.sql <<-SQL_EOF
+	\set id random(1, 1000)
+	select :id;
+	select :id + 1;
+	select :id, 'x';
+	SQL_EOF
+
+	pgbench -n -M prepared -c 8 -t 100 -f $LOGDIR/prepared.sql p0 || return 1
+
+	return 0
+}
+
 # client_idle_timeout
 test_client_idle_timeout() {
 	admin "set client_idle_timeout=2"
@@ -848,6 +984,34 @@ test_reserve_pool_size() {
 	grep "taking connection from reserve_pool" $BOUNCER_LOG || return 1
 }
 
+test_server_connect_rate() {
+	# make existing connections go away
+	psql -X -p $PG_PORT -d postgres -c "select pg_terminate_backend(pid) from pg_stat_activity where usename='bouncer'"
+	until test $(psql -X -p $PG_PORT -d postgres -tAq -c "select count(1) from pg_stat_activity where usename='bouncer'") -eq 0; do sleep 0.1; done
+
+	# default_pool_size=5
+	admin "set max_concurrent_logins = 5"
+	admin "set server_connect_rate = 1"
+	admin "set server_connect_burst = 2"
+
+	for i in {1..5}; do
+		psql -X -c "select pg_sleep(8)" p1 >/dev/null &
+	done
+	sleep 0.5
+	cnt=`psql -X -p $PG_PORT -tAq -c "select count(1) from pg_stat_activity where usename='bouncer' and datname='p1'" postgres`
+	echo $cnt
+	test "$cnt" -eq 2 || return 1
+
+	sleep 4  # one new connection per second
+
+	cnt=`psql -X -p $PG_PORT -tAq -c "select count(1) from pg_stat_activity where usename='bouncer' and datname='p1'" postgres`
+	echo $cnt
+	test "$cnt" -eq 5 || return 1
+
+	wait
+	return 0
+}
+
 test_max_db_connections() {
 	local users
 
@@ -868,6 +1032,89 @@ test_max_db_connections() {
 	return 0
 }
 
+# max_db_connections over several workers
+test_workers() {
+	local users status cnt
+	test `uname` = Linux || return 77
+
+	# some users, doesn't matter which ones
+	users=(muser1 muser2 puser1 puser2)
+
+	# workers cannot be reloaded or taken over, start afresh
+	stopit test.pid
+	cp test.ini test.ini.bak
+	echo "workers = 4" >> test.ini
+	echo "so_reuseport = 1" >> test.ini
+	$BOUNCER_EXE -d $BOUNCER_INI
+	status=$?
+	cp test.ini.bak test.ini
+	rm test.ini.bak
+	test $status -eq 0 || return 1
+	until psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show version" 2>/dev/null 1>&2; do sleep 0.1; done
+
+	for i in {1..20}; do
+		psql -X -U ${users[$(($i % 4))]} -c "select pg_sleep(0.5)" p2 >/dev/null &
+	done
+	wait
+	cnt=`psql -X -p $PG_PORT -tAq -c "select count(1) from pg_stat_activity where usename in ('muser1', 'muser2', 'puser1', 'puser2') and datname='p0'" postgres`
+	echo "server connections: $cnt"
+	test $cnt -gt 0 || return 1
+	test $cnt -le 4 || return 1
+
+	# cannot be passed on to the other workers
+	psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "set max_db_connections = 5" && return 1
+	admin "reload"
+
+	return 0
+}
+
+# lowering max_user_connections on reload must not make every worker
+# evict down to the limit on its own
+test_workers_user_limit() {
+	local databases status cnt
+	test `uname` = Linux || return 77
+
+	databases=(p7a p7b p7c)
+
+	count_connections() {
+		psql -X -p $PG_PORT -tAq -c "select count(1) from pg_stat_activity where usename = 'maxedout' and datname = 'p7'" postgres
+	}
+
+	stopit test.pid
+	cp test.ini test.ini.bak
+	sed -i 's/^maxedout = .*/maxedout = max_user_connections=8/' test.ini
+	echo "workers = 4" >> test.ini
+	echo "so_reuseport = 1" >> test.ini
+	$BOUNCER_EXE -d $BOUNCER_INI
+	status=$?
+	if [ $status -ne 0 ]; then
+		cp test.ini.bak test.ini
+		rm test.ini.bak
+		return 1
+	fi
+	until psql -X -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show version" 2>/dev/null 1>&2; do sleep 0.1; done
+
+	for i in {1..8}; do
+		psql -X -U maxedout -c "select pg_sleep(5)" ${databases[$(($i % 3))]} >/dev/null 2>&1 &
+	done
+	sleep 2
+	cnt=`count_connections`
+	echo "before reload: $cnt"
+
+	sed -i 's/^maxedout = .*/maxedout = max_user_connections=4/' test.ini
+	kill -HUP `head -n1 test.pid`
+	sleep 1
+	cp test.ini.bak test.ini
+	rm test.ini.bak
+
+	test $cnt -gt 4 || return 1
+	cnt=`count_connections`
+	echo "after reload: $cnt"
+	test $cnt -ge 1 || return 1
+	test $cnt -le 4 || return 1
+	return 0
+}
+
 test_max_user_connections() {
   	rm -f $LOGDIR/test.tmp
 	local databases
@@ -1442,6 +1689,54 @@ test_scram_both() {
 	return 0
 }
 
+# test that keys derived from plain-text passwords are cached
+test_scram_key_cache() {
+	$have_getpeereid || return 77
+	$pg_supports_scram || return 77
+
+	admin "set auth_type='scram-sha-256'"
+
+	PGPASSWORD=baz psql -X -U scramuser3 -c "select 1" p61 || return 1
+	PGPASSWORD=baz psql -X -U scramuser3 -c "select 1" p61 || return 1
+	PGPASSWORD=wrong psql -X -U scramuser3 -c "select 1" p61 && return 1
+
+	hits=$(psql -X -tAq -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show auth_caches;" | awk -F'|' '$1 == "scram_keys" { print $4 }')
+	echo "hits=$hits"
+	test "$hits" -ge 1 || return 1
+
+	return 0
+}
+
+# SCRAM with a plain-text password, key derivation done in auth threads
+test_auth_threads() {
+	$have_getpeereid || return 77
+	$pg_supports_scram || return 77
+
+	# auth_threads cannot be reloaded, restart with it
+	cp test.ini test.ini.bak
+	echo "auth_threads = 2" >> test.ini
+	$BOUNCER_EXE -d -R $BOUNCER_INI
+	status=$?
+	cp test.ini.bak test.ini
+	rm test.ini.bak
+	test $status -eq 0 || return 1
+	sleep 1
+
+	grep -F "started 2 auth threads" $BOUNCER_LOG || return 1
+
+	admin "set auth_type='scram-sha-256'"
+
+	PGPASSWORD=baz psql -X -U scramuser3 -c "select 1" p61 || return 1
+	PGPASSWORD=baz psql -X -U scramuser3 -c "select 1" p61 || return 1
+	PGPASSWORD=wrong psql -X -U scramuser3 -c "select 1" p61 && return 1
+
+	misses=$(psql -X -tAq -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show auth_caches;" | awk -F'|' '$1 == "scram_keys" { print $5 }')
+	echo "misses=$misses"
+	test "$misses" -ge 1 || return 1
+
+	return 0
+}
+
 # test that SCRAM authentication pass-through is preserved by online
 # restart
 #
@@ -1721,15 +2016,17 @@ test_cancel_wait() {
 	return 0
 }
 
-# Test that cancel requests can exceed the pool size
+# Test that cancel requests get through when the pool is full
 #
-# Cancel request connections can use twice the pool size.  See also GH
-# PR #543.
+# Cancel requests are sent on connections of their own that do not
+# count against the pool size.  With max_cancel_connections=1 they
+# also have to queue for the server address.  See also GH PR #543.
 test_cancel_pool_size() {
 	case `uname` in MINGW*) return 77;; esac
 
 	# default_pool_size=5
 	admin "set server_idle_timeout=2"
+	admin "set max_cancel_connections=1"
 
 	psql -X -d p3 -c "select pg_sleep(20)" &
 	psql1_pid=$!
@@ -1747,14 +2044,19 @@ test_cancel_pool_size() {
 	# default_pool_size=5.
 	kill -INT $psql1_pid $psql2_pid $psql3_pid $psql4_pid $psql5_pid
 
-	wait $psql1_pid
-
 	# Prior to the change fix, the cancels would never get through
 	# and the psql processes would simply run the full sleep and
 	# exit successfully.
-	test $? -ne 0 || return 1
+	for pid in $psql1_pid $psql2_pid $psql3_pid $psql4_pid $psql5_pid; do
+		wait $pid
+		test $? -ne 0 || return 1
+	done
 	grep -F "canceling statement due to user request" $PG_LOG || return 1
 
+	sent=$(psql -X -tAq -h $BOUNCER_ADMIN_HOST -U pgbouncer -d pgbouncer -c "show cancels;" | awk -F'|' '{ n += $4 } END { print n }')
+	echo "sent=$sent"
+	test "$sent" -ge 5 || return 1
+
 	return 0
 }
 
@@ -1794,14 +2096,20 @@ test_host_list_dummy() {
 testlist="
 test_show_version
 test_help
+test_probes
 test_show
+test_metrics
 test_server_login_retry
 test_auth_user
 test_client_idle_timeout
 test_server_lifetime
 test_server_idle_timeout
+test_splice
+test_event_backend_changelist
+test_event_backend_io_uring
 test_query_timeout
 test_idle_transaction_timeout
+test_prepared_statements
 test_shadow_password_server_login
 test_server_connect_timeout_establish
 test_server_connect_timeout_reject
@@ -1811,7 +2119,10 @@ test_max_client_conn
 test_pool_size
 test_min_pool_size
 test_reserve_pool_size
+test_server_connect_rate
 test_max_db_connections
+test_workers
+test_workers_user_limit
 test_max_user_connections
 test_connect_query
 test_online_restart
@@ -1831,6 +2142,8 @@ test_md5_client
 test_scram_server
 test_scram_client
 test_scram_both
+test_scram_key_cache
+test_auth_threads
 test_scram_takeover
 test_no_user_trust
 test_no_user_trust_forced_user